@@ -0,0 +1,454 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        CachedImage.h - Sector cache shared between images
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// One SectorCache is shared by all images, and by all of the clients using them.  Sectors are
+// keyed by (image, lba) and are evicted least recently used first.  Along with the data, each
+// entry keeps the sector's checksum, so a hit costs neither a disk read nor a checksum pass.
+//
+// CachedImage wraps any other Image with the cache.  With write-through, written sectors go to
+// the image straight away and the cache is updated; with write-back, they are only written to
+// the image when evicted, when the CachedImage is destroyed, or by SectorCache::flush( NULL ),
+// as the server does on its way out.
+//
+// The cache lock is not held over disk access: a miss is read from the image first and then
+// inserted, and an entry being written back stays in place, marked as writing, until it is on
+// disk, so that it is neither taken over nor written back twice at once.
+//
+
+#ifndef CACHEDIMAGE_H_INCLUDED
+#define CACHEDIMAGE_H_INCLUDED
+
+#include "Library.h"
+#include <string.h>
+#include <stdlib.h>
+
+struct sectorCacheEntry {
+	Image *image;                   // NULL if the entry is free
+	unsigned long lba;
+	int hashNext;
+	int lruPrev, lruNext;
+	unsigned short crc;
+	unsigned char dirty;
+	unsigned char writing;          // being written back, with the cache unlocked
+	unsigned short data[256];
+};
+
+class SectorCache
+{
+private:
+	struct sectorCacheEntry *entries;
+	int *buckets;
+	unsigned long bucketMask;
+	int lruHead, lruTail;
+	Condition written;
+
+	unsigned long hash( Image *image, unsigned long lba )
+	{
+		unsigned long h = (unsigned long) image ^ (lba * 0x9e3779b1UL);
+
+		return( (h ^ (h >> 15)) & bucketMask );
+	}
+
+	void lruUnlink( int e )
+	{
+		if( entries[e].lruPrev >= 0 )
+			entries[ entries[e].lruPrev ].lruNext = entries[e].lruNext;
+		else
+			lruHead = entries[e].lruNext;
+
+		if( entries[e].lruNext >= 0 )
+			entries[ entries[e].lruNext ].lruPrev = entries[e].lruPrev;
+		else
+			lruTail = entries[e].lruPrev;
+	}
+
+	void lruPushFront( int e )
+	{
+		entries[e].lruPrev = -1;
+		entries[e].lruNext = lruHead;
+		if( lruHead >= 0 )
+			entries[ lruHead ].lruPrev = e;
+		lruHead = e;
+		if( lruTail < 0 )
+			lruTail = e;
+	}
+
+	void hashUnlink( int e )
+	{
+		int *p;
+
+		for( p = &buckets[ hash( entries[e].image, entries[e].lba ) ]; *p != e; p = &entries[ *p ].hashNext ) ;
+		*p = entries[e].hashNext;
+	}
+
+	int lookup( Image *image, unsigned long lba )
+	{
+		int e;
+
+		for( e = buckets[ hash( image, lba ) ]; e >= 0; e = entries[e].hashNext )
+			if( entries[e].image == image && entries[e].lba == lba )
+				break;
+
+		return( e );
+	}
+
+	void touch( int e )
+	{
+		if( e != lruHead )
+		{
+			lruUnlink( e );
+			lruPushFront( e );
+		}
+	}
+
+	//
+	// Called and returns with the lock held, but releases it while the sector is written
+	//
+	void writeBack( int e )
+	{
+		unsigned short data[256];
+		Image *image = entries[e].image;
+		unsigned long lba = entries[e].lba;
+
+		memcpy( data, entries[e].data, 512 );
+		entries[e].dirty = 0;
+		entries[e].writing = 1;
+
+		lock.unlock();
+		image->writeSectors( lba, 1, data );
+		lock.lock();
+
+		entries[e].writing = 0;
+		writeBacks++;
+		written.broadcast();
+	}
+
+	//
+	// Returns with the entry for (image, lba) no longer dirty or being written back, or no longer
+	// holding that sector at all
+	//
+	void settle( int e, Image *image )
+	{
+		while( entries[e].image == image && (entries[e].dirty || entries[e].writing) )
+		{
+			if( entries[e].writing )
+				written.wait( lock );
+			else
+				writeBack( e );
+		}
+	}
+
+public:
+	unsigned long count;
+	int writeBackPolicy;
+
+	unsigned long hits, misses, writeBacks;
+
+	//
+	// Held around every use of the cache, so that images can be shared between threads.  read()
+	// and write() take it themselves; flush() and forget() are called with it held.
+	//
+	Mutex lock;
+
+	SectorCache( unsigned long megabytes, int p_writeBackPolicy )
+	{
+		unsigned long b;
+
+		count = (megabytes << 20) / sizeof(struct sectorCacheEntry);
+		if( count < 64 )
+			count = 64;
+
+		for( b = 1; b < count; b <<= 1 ) ;
+		bucketMask = b - 1;
+
+		entries = (struct sectorCacheEntry *) malloc( count * sizeof(struct sectorCacheEntry) );
+		buckets = (int *) malloc( b * sizeof(int) );
+		if( !entries || !buckets )
+			log( -1, "Out of memory for a %lu MB sector cache", megabytes );
+
+		for( unsigned long t = 0; t < b; t++ )
+			buckets[t] = -1;
+
+		lruHead = lruTail = -1;
+		for( unsigned long t = 0; t < count; t++ )
+		{
+			entries[t].image = NULL;
+			entries[t].dirty = 0;
+			entries[t].writing = 0;
+			lruPushFront( t );
+		}
+
+		writeBackPolicy = p_writeBackPolicy;
+		hits = misses = writeBacks = 0;
+
+		log( 0, "Sector cache: %lu MB, %lu sectors, %s", megabytes, count, writeBackPolicy ? "write-back" : "write-through" );
+	}
+
+	~SectorCache()
+	{
+		lock.lock();
+		flush( NULL );
+		lock.unlock();
+
+		free( buckets );
+		free( entries );
+	}
+
+	//
+	// Returns the entry for (image, lba), or NULL if not cached
+	//
+	struct sectorCacheEntry *find( Image *image, unsigned long lba )
+	{
+		int e;
+
+		if( (e = lookup( image, lba )) < 0 )
+		{
+			misses++;
+			return( NULL );
+		}
+
+		touch( e );
+		hits++;
+		return( &entries[e] );
+	}
+
+	//
+	// Takes over the least recently used entry for (image, lba), writing it back first if needed,
+	// and sets *fresh; the caller then fills in the data and checksum.  As the lock is released
+	// for write-backs, another thread may have cached the sector meanwhile, in which case that
+	// entry is returned with *fresh clear.
+	//
+	struct sectorCacheEntry *insert( Image *image, unsigned long lba, int *fresh )
+	{
+		unsigned long h;
+		int e;
+
+		for( ;; )
+		{
+			if( (e = lookup( image, lba )) >= 0 )
+			{
+				touch( e );
+				*fresh = 0;
+				return( &entries[e] );
+			}
+
+			for( e = lruTail; e >= 0 && entries[e].writing; e = entries[e].lruPrev ) ;
+
+			if( e < 0 )
+				written.wait( lock );
+			else if( entries[e].image && entries[e].dirty )
+				writeBack( e );
+			else
+				break;
+		}
+
+		if( entries[e].image )
+			hashUnlink( e );
+
+		touch( e );
+
+		h = hash( image, lba );
+		entries[e].image = image;
+		entries[e].lba = lba;
+		entries[e].dirty = 0;
+		entries[e].hashNext = buckets[h];
+		buckets[h] = e;
+
+		*fresh = 1;
+		return( &entries[e] );
+	}
+
+	//
+	// Reads one sector and its checksum through the cache.  A miss is read from the image with the
+	// lock released.
+	//
+	void read( Image *image, unsigned long lba, void *buff, unsigned short *crc )
+	{
+		struct sectorCacheEntry *entry;
+		int fresh;
+
+		lock.lock();
+
+		if( !(entry = find( image, lba )) )
+		{
+			lock.unlock();
+			image->readSectors( lba, 1, buff );
+			*crc = checksum( (unsigned short *) buff, 256 );
+			lock.lock();
+
+			entry = insert( image, lba, &fresh );
+			if( fresh )
+			{
+				memcpy( entry->data, buff, 512 );
+				entry->crc = *crc;
+			}
+		}
+
+		memcpy( buff, entry->data, 512 );
+		*crc = entry->crc;
+
+		lock.unlock();
+	}
+
+	//
+	// Writes one sector through the cache.  With write-through, it goes to the image once the
+	// cache is updated and unlocked.
+	//
+	void write( Image *image, unsigned long lba, void *buff, unsigned short crc )
+	{
+		struct sectorCacheEntry *entry;
+		int fresh;
+
+		lock.lock();
+
+		if( !(entry = find( image, lba )) )
+			entry = insert( image, lba, &fresh );
+
+		memcpy( entry->data, buff, 512 );
+		entry->crc = crc;
+		if( writeBackPolicy )
+			entry->dirty = 1;
+
+		lock.unlock();
+
+		if( !writeBackPolicy )
+			image->writeSectors( lba, 1, buff );
+	}
+
+	//
+	// Writes back all dirty sectors of one image, or of all images if image is NULL, and waits
+	// for any write-backs already under way
+	//
+	void flush( Image *image )
+	{
+		for( unsigned long t = 0; t < count; t++ )
+			if( entries[t].image && (!image || entries[t].image == image) )
+				settle( t, entries[t].image );
+	}
+
+	//
+	// Drops every sector of an image that is going away, writing back those that are dirty.  The
+	// entries are the first to be taken over.
+	//
+	void forget( Image *image )
+	{
+		for( unsigned long t = 0; t < count; t++ )
+		{
+			settle( t, image );
+			if( entries[t].image != image )
+				continue;
+
+			hashUnlink( t );
+			entries[t].image = NULL;
+
+			lruUnlink( t );
+			entries[t].lruNext = -1;
+			entries[t].lruPrev = lruTail;
+			if( lruTail >= 0 )
+				entries[ lruTail ].lruNext = t;
+			else
+				lruHead = t;
+			lruTail = t;
+		}
+	}
+
+	void report( void )
+	{
+		unsigned long lookups = hits + misses;
+
+		log( 1, "Sector cache: %lu hits, %lu misses (%.1lf%% hit rate), %lu write-backs",
+			 hits, misses, lookups ? hits * 100.0 / lookups : 0.0, writeBacks );
+	}
+};
+
+class CachedImage : public Image
+{
+private:
+	Image *image;
+	SectorCache *cache;
+
+public:
+	CachedImage( Image *p_image, SectorCache *p_cache )   :   Image( p_image->shortFileName, p_image->readOnly, p_image->drive )
+	{
+		image = p_image;
+		cache = p_cache;
+
+		cyl = image->cyl;
+		sect = image->sect;
+		head = image->head;
+		floppy = image->floppy;
+		floppyType = image->floppyType;
+		useCHS = image->useCHS;
+		totallba = image->totallba;
+		shortFileName = image->shortFileName;
+		readOnly = image->readOnly;
+		drive = image->drive;
+	}
+
+	~CachedImage()
+	{
+		flush();
+
+		cache->lock.lock();
+		cache->forget( image );
+		cache->lock.unlock();
+	}
+
+	int readSectorChecksum( unsigned long lba, void *buff, unsigned short *crc )
+	{
+		cache->read( image, lba, buff, crc );
+
+		return( 1 );
+	}
+
+	void readSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		unsigned short crc;
+
+		for( ; count; count--, lba++, buff = (char *) buff + 512 )
+			readSectorChecksum( lba, buff, &crc );
+	}
+
+	void writeSectorChecksum( unsigned long lba, void *buff, unsigned short crc )
+	{
+		cache->write( image, lba, buff, crc );
+	}
+
+	void writeSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		for( ; count; count--, lba++, buff = (char *) buff + 512 )
+			writeSectorChecksum( lba, buff, checksum( (unsigned short *) buff, 256 ) );
+	}
+
+	void flush( void )
+	{
+		cache->lock.lock();
+		cache->flush( image );
+		cache->lock.unlock();
+
+		image->flush();
+	}
+};
+
+#endif
@@ -33,14 +33,94 @@
 // 16-bit accumulators results in poorer error detection behavior.  Folding as described here results in error
 // detection on par with Fletcher's 16-bit Checksum.
 //
-// With #define CHECKSUM_TEST, this file becomes a self-contained command line program that runs
-// some statistical tests comparing various checksum algorithms with random 512-byte sectors and various
-// levels of errors introduced.
+// With #define CHECKSUM_TEST, this file becomes a self-contained command line program (make checksum_test)
+// that runs some statistical tests comparing various checksum algorithms with random 512-byte sectors and
+// various levels of errors introduced, and measures the throughput of each algorithm, including each vector
+// version of our checksum.  The trials are spread across all processors, and for a given seed the
+// statistics are the same no matter how many threads run them.
 //
 
 #include "Library.h"
 
-unsigned short checksum( unsigned short *wbuff, int wlen )
+//
+// Sectors are checksummed with vector instructions where the host has them: SSE2 or AVX2 on x86,
+// and NEON on ARM (always there on AArch64, and on 32-bit ARM Linux when the processor has it).  The vector code computes the same
+// two Fletcher accumulators as the scalar loop, just rearranged:
+//
+//     a = 0xffff + sum( w[i] )
+//     b = n * 0xffff + sum( (n-i) * w[i] )          for i = 0 .. n-1
+//
+// Words are processed in blocks of L lanes.  For each lane k, S[k] is the running sum of that lane's
+// words, and P[k] has S[k] added into it once per block before the block is accumulated, so that
+// at the end P[k] = sum over blocks j of (m-1-j) * w[L*j+k], where m is the number of blocks.  Then
+// since n-i = L*(m-1-j) + (L-k),
+//
+//     sum( (n-i) * w[i] ) = L * sum( P[k] ) + sum( (L-k) * S[k] )
+//
+// With n limited to CHECKSUM_VECTOR_MAXWORDS, no 32-bit lane can overflow, and a and b come out
+// exactly as the scalar loop computes them, so the folded results are bit-identical.  The vector
+// routines are only used for the 256 word sectors; short buffers such as command headers, and any
+// length that is not a multiple of 16 words, use the scalar loop.  The version in use is picked at
+// run time on x86 and 32-bit ARM, based on what the processor supports, so a build for the baseline
+// processor (the ARM makefile passes no -mfpu) still uses the vector code where it can.
+//
+
+#if defined(__SSE2__) || defined(__x86_64__)
+#include <emmintrin.h>
+#include <immintrin.h>
+#define CHECKSUM_SSE2
+#if defined(__GNUC__)
+#define CHECKSUM_AVX2
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#define CHECKSUM_NEON
+#define CHECKSUM_NEON_TARGET
+#elif defined(__arm__) && defined(__GNUC__) && defined(__linux__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CHECKSUM_NEON
+#define CHECKSUM_NEON_HWCAP
+#define CHECKSUM_NEON_TARGET __attribute__((target("fpu=neon")))
+#endif
+
+#define CHECKSUM_VECTOR_MAXWORDS 256
+
+static unsigned short checksum_fold( unsigned long a, unsigned long b )
+{
+	a = (a & 0xffff) + (a >> 16);
+	b = (b & 0xffff) + (b >> 16);
+	a = (a & 0xffff) + (a >> 16);
+	b = (b & 0xffff) + (b >> 16);
+
+// Although tempting to use, for its simplicity and size/speed in assembly, the following folding
+// algorithm results in many undetected single bit errors and therefore should not be used.
+//	return( (unsigned short) (a ^ b) );
+
+	return( (unsigned short) (((a & 0xff) << 8) ^ (a & 0xff00)) + (((b & 0xff00) >> 8) ^ (b & 0xff)) );
+}
+
+//
+// Combines the lane sums of a vector routine (see above) into the folded checksum
+//
+static unsigned short checksum_lanes( unsigned int *S, unsigned int *P, int lanes, int wlen )
+{
+	unsigned long a = 0xffff;
+	unsigned long b = 0xffff * (unsigned long) wlen;
+
+	for( int k = 0; k < lanes; k++ )
+	{
+		a += S[k];
+		b += lanes * (unsigned long) P[k] + (lanes - k) * (unsigned long) S[k];
+	}
+
+	return( checksum_fold( a, b ) );
+}
+
+static unsigned short checksum_scalar( unsigned short *wbuff, int wlen )
 {
 	unsigned long a = 0xffff;
 	unsigned long b = 0xffff;
@@ -52,16 +132,150 @@ unsigned short checksum( unsigned short *wbuff, int wlen )
 		b += a;
 	}
 
-	a = (a & 0xffff) + (a >> 16);
-	b = (b & 0xffff) + (b >> 16);
-	a = (a & 0xffff) + (a >> 16);
-	b = (b & 0xffff) + (b >> 16);
+	return( checksum_fold( a, b ) );
+}
 
-// Although tempting to use, for its simplicity and size/speed in assembly, the following folding
-// algorithm results in many undetected single bit errors and therefore should not be used.
-//	return( (unsigned short) (a ^ b) );
+#ifdef CHECKSUM_SSE2
+static unsigned short checksum_sse2( unsigned short *wbuff, int wlen )
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i s0 = zero, s1 = zero, s2 = zero, s3 = zero;
+	__m128i p0 = zero, p1 = zero, p2 = zero, p3 = zero;
+	unsigned int S[16], P[16];
+
+	//
+	// 16 lanes, as two 8 word loads, each widened to two vectors of four 32-bit lanes
+	//
+	for( int t = 0; t < wlen; t += 16 )
+	{
+		__m128i w0 = _mm_loadu_si128( (__m128i *) &wbuff[t] );
+		__m128i w1 = _mm_loadu_si128( (__m128i *) &wbuff[t+8] );
+
+		p0 = _mm_add_epi32( p0, s0 );
+		p1 = _mm_add_epi32( p1, s1 );
+		p2 = _mm_add_epi32( p2, s2 );
+		p3 = _mm_add_epi32( p3, s3 );
+
+		s0 = _mm_add_epi32( s0, _mm_unpacklo_epi16( w0, zero ) );
+		s1 = _mm_add_epi32( s1, _mm_unpackhi_epi16( w0, zero ) );
+		s2 = _mm_add_epi32( s2, _mm_unpacklo_epi16( w1, zero ) );
+		s3 = _mm_add_epi32( s3, _mm_unpackhi_epi16( w1, zero ) );
+	}
 
-	return( (unsigned short) (((a & 0xff) << 8) ^ (a & 0xff00)) + (((b & 0xff00) >> 8) ^ (b & 0xff)) );
+	_mm_storeu_si128( (__m128i *) &S[0], s0 );
+	_mm_storeu_si128( (__m128i *) &S[4], s1 );
+	_mm_storeu_si128( (__m128i *) &S[8], s2 );
+	_mm_storeu_si128( (__m128i *) &S[12], s3 );
+	_mm_storeu_si128( (__m128i *) &P[0], p0 );
+	_mm_storeu_si128( (__m128i *) &P[4], p1 );
+	_mm_storeu_si128( (__m128i *) &P[8], p2 );
+	_mm_storeu_si128( (__m128i *) &P[12], p3 );
+
+	return( checksum_lanes( S, P, 16, wlen ) );
+}
+#endif
+
+#ifdef CHECKSUM_AVX2
+__attribute__((target("avx2")))
+static unsigned short checksum_avx2( unsigned short *wbuff, int wlen )
+{
+	__m256i s0 = _mm256_setzero_si256(), s1 = s0;
+	__m256i p0 = s0, p1 = s0;
+	unsigned int S[16], P[16];
+
+	//
+	// 16 lanes, one 16 word load widened to two vectors of eight 32-bit lanes
+	//
+	for( int t = 0; t < wlen; t += 16 )
+	{
+		__m128i w0 = _mm_loadu_si128( (__m128i *) &wbuff[t] );
+		__m128i w1 = _mm_loadu_si128( (__m128i *) &wbuff[t+8] );
+
+		p0 = _mm256_add_epi32( p0, s0 );
+		p1 = _mm256_add_epi32( p1, s1 );
+
+		s0 = _mm256_add_epi32( s0, _mm256_cvtepu16_epi32( w0 ) );
+		s1 = _mm256_add_epi32( s1, _mm256_cvtepu16_epi32( w1 ) );
+	}
+
+	_mm256_storeu_si256( (__m256i *) &S[0], s0 );
+	_mm256_storeu_si256( (__m256i *) &S[8], s1 );
+	_mm256_storeu_si256( (__m256i *) &P[0], p0 );
+	_mm256_storeu_si256( (__m256i *) &P[8], p1 );
+
+	return( checksum_lanes( S, P, 16, wlen ) );
+}
+#endif
+
+#ifdef CHECKSUM_NEON
+CHECKSUM_NEON_TARGET
+static unsigned short checksum_neon( unsigned short *wbuff, int wlen )
+{
+	uint32x4_t s0 = vdupq_n_u32( 0 ), s1 = s0, s2 = s0, s3 = s0;
+	uint32x4_t p0 = s0, p1 = s0, p2 = s0, p3 = s0;
+	unsigned int S[16], P[16];
+
+	//
+	// 16 lanes, as two 8 word loads, each widened to two vectors of four 32-bit lanes
+	//
+	for( int t = 0; t < wlen; t += 16 )
+	{
+		uint16x8_t w0 = vld1q_u16( &wbuff[t] );
+		uint16x8_t w1 = vld1q_u16( &wbuff[t+8] );
+
+		p0 = vaddq_u32( p0, s0 );
+		p1 = vaddq_u32( p1, s1 );
+		p2 = vaddq_u32( p2, s2 );
+		p3 = vaddq_u32( p3, s3 );
+
+		s0 = vaddw_u16( s0, vget_low_u16( w0 ) );
+		s1 = vaddw_u16( s1, vget_high_u16( w0 ) );
+		s2 = vaddw_u16( s2, vget_low_u16( w1 ) );
+		s3 = vaddw_u16( s3, vget_high_u16( w1 ) );
+	}
+
+	vst1q_u32( &S[0], s0 );
+	vst1q_u32( &S[4], s1 );
+	vst1q_u32( &S[8], s2 );
+	vst1q_u32( &S[12], s3 );
+	vst1q_u32( &P[0], p0 );
+	vst1q_u32( &P[4], p1 );
+	vst1q_u32( &P[8], p2 );
+	vst1q_u32( &P[12], p3 );
+
+	return( checksum_lanes( S, P, 16, wlen ) );
+}
+#endif
+
+typedef unsigned short (*checksumFunction)( unsigned short *wbuff, int wlen );
+
+static checksumFunction checksum_select( void )
+{
+#ifdef CHECKSUM_AVX2
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx2" ) )
+		return( checksum_avx2 );
+#endif
+#ifdef CHECKSUM_SSE2
+	return( checksum_sse2 );
+#endif
+#ifdef CHECKSUM_NEON
+#ifdef CHECKSUM_NEON_HWCAP
+	if( getauxval( AT_HWCAP ) & HWCAP_NEON )
+#endif
+		return( checksum_neon );
+#endif
+	return( checksum_scalar );
+}
+
+static checksumFunction checksum_vector = checksum_select();
+
+unsigned short checksum( unsigned short *wbuff, int wlen )
+{
+	if( wlen <= CHECKSUM_VECTOR_MAXWORDS && (wlen & 15) == 0 )
+		return( checksum_vector( wbuff, wlen ) );
+
+	return( checksum_scalar( wbuff, wlen ) );
 }
 
 #ifdef CHECKSUM_TEST
@@ -73,11 +287,15 @@ unsigned short checksum( unsigned short *wbuff, int wlen )
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define BUCKETS 65536
 #define BITTEST 16
+#define SHARDS 256
 
 unsigned char bit[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
 
@@ -86,6 +304,7 @@ class algorithm
 public:
 	virtual unsigned short checksum( unsigned char *data, int len ) = 0;
 	char *title;
+	int index;
 	unsigned long *found;
 	unsigned long zero;
 	unsigned long total;
@@ -93,7 +312,7 @@ public:
 	unsigned long min;
 	unsigned long max;
 	double stdev;
-	unsigned long bittest[ BITTEST ];
+	double gbps;
 	unsigned long missed[ BITTEST ];
 	algorithm *next;
 	algorithm( algorithm *last, char *new_title );
@@ -102,13 +321,14 @@ public:
 algorithm::algorithm( algorithm *last, char *new_title )
 {
 	zero = total = empty = min = max = 0;
-	stdev = 0.0;
+	stdev = gbps = 0.0;
 	for( int t = 0; t < BITTEST; t++ )
 	{
-		bittest[t] = missed[t] = 0;
+		missed[t] = 0;
 	}
 	title = new_title;
 	next = last;
+	index = last ? last->index + 1 : 0;
 }
 
 //----------------------------------------------------------------------------------------------------
@@ -228,57 +448,321 @@ unsigned short folded_fletcher32_algorithm::checksum( unsigned char* data, int c
 	return( ::checksum( (unsigned short *) data, count/2 ) );
 }
 
+//----------------------------------------------------------------------------------------------------
+//
+// Vector versions of the folded Fletcher's Checksum, same results as above, only faster
+//
+
+class vector_algorithm : public algorithm
+{
+public:
+	unsigned short checksum( unsigned char *data, int len ) { return( function( (unsigned short *) data, len/2 ) ); }
+	vector_algorithm( algorithm *last, const char *new_title, checksumFunction p_function ) : algorithm( last, (char *) new_title ) { function = p_function; }
+private:
+	checksumFunction function;
+};
+
 //----------------------------------------------------------------------------------------------------
 //
 // Test Driver and Support routines
 //
 
-void randomize_buff( unsigned char *bbuff, int blen )
+//
+// Every shard of trials has its own generator, seeded from the run's seed and the shard number,
+// so the outcome of a shard does not depend on which thread runs it (splitmix64)
+//
+struct rng {
+	unsigned long long state;
+};
+
+unsigned long long rng_next( struct rng *r )
+{
+	unsigned long long z = (r->state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return( z ^ (z >> 31) );
+}
+
+void rng_seed( struct rng *r, unsigned long long seed, unsigned long shard )
+{
+	r->state = seed ^ (0x632be59bd9b4e019ULL * (shard + 1));
+	rng_next( r );
+}
+
+void randomize_buff( struct rng *r, unsigned char *bbuff, int blen )
 {
 	int i;
 	for( i = 0; i < blen; i++ )
-		bbuff[i] = rand() % 255;
+		bbuff[i] = rng_next( r ) % 255;
 }
 
 #define BBUFF_LENGTH 512
 
-unsigned char bbuff[ BBUFF_LENGTH ];
+//
+// Checks that each vector checksum routine available on this machine gives exactly the same
+// result as the scalar loop, for random data, all-ones data (the largest sums), and every
+// length the vector routines accept
+//
+struct vectorVariant {
+	const char *title;
+	checksumFunction function;
+	int available;
+} vectorVariants[] = {
+#ifdef CHECKSUM_SSE2
+	{ "sse2", checksum_sse2, 1 },
+#endif
+#ifdef CHECKSUM_AVX2
+	{ "avx2", checksum_avx2, -1 },
+#endif
+#ifdef CHECKSUM_NEON
+#ifdef CHECKSUM_NEON_HWCAP
+	{ "neon", checksum_neon, -1 },
+#else
+	{ "neon", checksum_neon, 1 },
+#endif
+#endif
+	{ NULL, NULL, 0 }
+};
+
+void verify_vector( unsigned long iterations, unsigned long long seed )
+{
+	unsigned short wbuff[ CHECKSUM_VECTOR_MAXWORDS ];
+	struct vectorVariant *v;
+	unsigned long mismatches;
+	struct rng r;
+
+	for( v = vectorVariants; v->title; v++ )
+	{
+#ifdef CHECKSUM_AVX2
+		if( v->function == checksum_avx2 )
+			v->available = __builtin_cpu_supports( "avx2" );
+#endif
+#ifdef CHECKSUM_NEON_HWCAP
+		if( v->function == checksum_neon )
+			v->available = (getauxval( AT_HWCAP ) & HWCAP_NEON) != 0;
+#endif
+		if( !v->available )
+		{
+			printf( "%s: not supported on this processor\n", v->title );
+			continue;
+		}
+
+		rng_seed( &r, seed, 0 );
+		mismatches = 0;
+		for( unsigned long t = 0; t < iterations; t++ )
+		{
+			int wlen = 16 * (1 + rng_next( &r ) % (CHECKSUM_VECTOR_MAXWORDS / 16));
+
+			for( int i = 0; i < CHECKSUM_VECTOR_MAXWORDS; i++ )
+				wbuff[i] = (t & 1) ? 0xffff : (unsigned short) rng_next( &r );
+
+			if( v->function( wbuff, wlen ) != checksum_scalar( wbuff, wlen ) )
+				mismatches++;
+		}
+
+		printf( "%s: %lu mismatches against the scalar checksum in %lu buffers%s\n",
+				v->title, mismatches, iterations, v->function == checksum_vector ? " (in use)" : "" );
+		if( mismatches )
+			exit( 1 );
+	}
+}
+
+//
+// Work shared by the threads.  Each thread pulls shard numbers from nextShard and adds its
+// results into its own counters, which are summed once all threads are done.
+//
+struct testRun {
+	algorithm *algorithms;
+	int count;
+	unsigned long iterations;
+	unsigned long long seed;
+	int test;                            // 0: distribution, 1: bit change
+	unsigned long nextShard;
+	pthread_mutex_t lock;
+};
+
+struct testThread {
+	pthread_t thread;
+	struct testRun *run;
+	unsigned long *found;                // [count][BUCKETS]
+	unsigned long *missed;               // [count][BITTEST]
+};
+
+int takeShard( struct testRun *run, unsigned long *shard )
+{
+	pthread_mutex_lock( &run->lock );
+	*shard = run->nextShard++;
+	pthread_mutex_unlock( &run->lock );
+
+	return( *shard < SHARDS );
+}
+
+void *testWorker( void *arg )
+{
+	struct testThread *th = (struct testThread *) arg;
+	struct testRun *run = th->run;
+	unsigned char bbuff[ BBUFF_LENGTH ];
+	unsigned short bittest[ 32 ][ BITTEST ];
+	unsigned long shard, first, last;
+	algorithm *a;
+	struct rng r;
+
+	while( takeShard( run, &shard ) )
+	{
+		rng_seed( &r, run->seed + run->test, shard );
+
+		first = run->iterations * shard / SHARDS;
+		last = run->iterations * (shard+1) / SHARDS;
+
+		for( unsigned long t = first; t < last; t++ )
+		{
+			randomize_buff( &r, bbuff, BBUFF_LENGTH );
+
+			if( run->test == 0 )
+			{
+				for( a = run->algorithms; a; a = a->next )
+					th->found[ a->index * BUCKETS + a->checksum( bbuff, BBUFF_LENGTH ) ]++;
+				continue;
+			}
+
+			for( int b = 0; b < BITTEST; b++ )
+			{
+				for( a = run->algorithms; a; a = a->next )
+					bittest[ a->index ][ b ] = a->checksum( bbuff, BBUFF_LENGTH );
+
+				bbuff[ rng_next( &r ) % 512 ] ^= bit[ rng_next( &r ) % 8 ];
+
+				if( b > 0 )
+				{
+					for( a = run->algorithms; a; a = a->next )
+						if( bittest[ a->index ][ 0 ] == bittest[ a->index ][ b ] )
+							th->missed[ a->index * BITTEST + b ]++;
+				}
+			}
+		}
+	}
+
+	return( NULL );
+}
+
+void runTest( struct testRun *run, struct testThread *threads, int threadCount )
+{
+	run->nextShard = 0;
+
+	for( int t = 0; t < threadCount; t++ )
+		if( pthread_create( &threads[t].thread, NULL, testWorker, &threads[t] ) )
+		{
+			fprintf( stderr, "could not create thread\n" );
+			exit( 1 );
+		}
+
+	for( int t = 0; t < threadCount; t++ )
+		pthread_join( threads[t].thread, NULL );
+}
+
+double now_seconds( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+//
+// Single thread throughput, over a set of sectors small enough to stay in the cache
+//
+#define THROUGHPUT_SECTORS 1024
+
+double throughput( algorithm *a, unsigned char *sectors )
+{
+	volatile unsigned short sink = 0;
+	unsigned long passes = 0;
+	double start, elapsed;
+
+	start = now_seconds();
+	do
+	{
+		for( int s = 0; s < THROUGHPUT_SECTORS; s++ )
+			sink += a->checksum( &sectors[ s * BBUFF_LENGTH ], BBUFF_LENGTH );
+		passes++;
+	}
+	while( (elapsed = now_seconds() - start) < 0.25 );
+
+	return( passes * THROUGHPUT_SECTORS * (double) BBUFF_LENGTH / elapsed / 1e9 );
+}
 
 int main( int argc, char *argv[] )
 {
 	algorithm *a, *algorithms;
 
-	unsigned short c;
-
 	double p;
 	double average;
 
 	unsigned long iterations;
+	unsigned long long seed;
+	int threadCount;
+
+	struct testRun run;
+	struct testThread *threads;
+	unsigned char *sectors;
+	unsigned char bbuff[ BBUFF_LENGTH ];
+	struct rng r;
 
-	time_t now;
+	if( argc < 2 || argc > 4 )
+	{
+		fprintf( stderr, "usage: checksum_test number_of_iterations [seed [threads]]\n" );
+		exit( 1 );
+	}
+
+	iterations = atol( argv[1] );
+	seed = argc > 2 ? strtoull( argv[2], NULL, 0 ) : (unsigned long long) time( NULL );
+	threadCount = argc > 3 ? atoi( argv[3] ) : (int) sysconf( _SC_NPROCESSORS_ONLN );
+	if( threadCount < 1 )
+		threadCount = 1;
+
+	verify_vector( iterations < 100000 ? iterations : 100000, seed );
+
+	algorithms = new vector_algorithm( NULL, "f-32/loop", checksum_scalar );
+	for( struct vectorVariant *v = vectorVariants; v->title; v++ )
+		if( v->available )
+		{
+			static char titles[ 8 ][ 16 ];
+			char *title = titles[ v - vectorVariants ];
 
-	algorithms = new folded_fletcher32_algorithm( NULL );
+			sprintf( title, "f-32/%s", v->title );
+			algorithms = new vector_algorithm( algorithms, title, v->function );
+		}
+	algorithms = new folded_fletcher32_algorithm( algorithms );
 	algorithms = new fletcher16_algorithm( algorithms );
 	algorithms = new crc16_algorithm( algorithms );
 	algorithms = new basic_algorithm( algorithms );
 
-	time( &now );
-	srand((unsigned int)now);
+	run.algorithms = algorithms;
+	run.count = algorithms->index + 1;
+	run.iterations = iterations;
+	run.seed = seed;
+	pthread_mutex_init( &run.lock, NULL );
 
-	if( argc != 2 )
+	threads = (struct testThread *) calloc( threadCount, sizeof(struct testThread) );
+	for( int t = 0; t < threadCount; t++ )
 	{
-		fprintf( stderr, "usage: checksum number_of_iterations\n" );
-		exit( 1 );
+		threads[t].run = &run;
+		threads[t].found = (unsigned long *) calloc( run.count * BUCKETS, sizeof(long) );
+		threads[t].missed = (unsigned long *) calloc( run.count * BITTEST, sizeof(long) );
+		if( !threads[t].found || !threads[t].missed )
+		{
+			fprintf( stderr, "out of memory\n" );
+			exit( 1 );
+		}
 	}
-	else
-		iterations = atol( argv[1] );
 
 #define PRINTROW( E, F, G ) { printf( E ); for( a = algorithms; a; a = a->next ) printf( F, G ); printf( "\n" ); }
 
-	printf( "\nnumber of iterations: %d\n\n", iterations );
+	printf( "\nnumber of iterations: %lu, seed: %llu, threads: %d\n\n", iterations, seed, threadCount );
 	PRINTROW( "       ", "%10s  ", a->title );
 	PRINTROW( "=======", "============", NULL );
 
+	memset( bbuff, 0, BBUFF_LENGTH );
 	for( a = algorithms; a; a = a->next )
 	{
 		a->found = (unsigned long *) calloc( BUCKETS, sizeof(long) );
@@ -289,15 +773,15 @@ int main( int argc, char *argv[] )
 	}
 
 	printf( "\n" );
-	PRINTROW( "zero   ", "%10d  ", a->zero );
+	PRINTROW( "zero   ", "%10lu  ", a->zero );
 
-	for( int t = 0; t < iterations; t++ )
-	{
-		randomize_buff( bbuff, BBUFF_LENGTH );
+	run.test = 0;
+	runTest( &run, threads, threadCount );
 
-		for( a = algorithms; a; a = a->next )
-			a->found[ a->checksum( bbuff, BBUFF_LENGTH ) ]++;
-	}
+	for( a = algorithms; a; a = a->next )
+		for( int th = 0; th < threadCount; th++ )
+			for( int t = 0; t < BUCKETS; t++ )
+				a->found[ t ] += threads[th].found[ a->index * BUCKETS + t ];
 
 	average = iterations / 65536.0;
 
@@ -326,47 +810,39 @@ int main( int argc, char *argv[] )
 	}
 
 	printf( "\nchecksum distribution test:\n" );
-	PRINTROW( "empty  ", "%10d  ", a->empty );
-	PRINTROW( "min    ", "%10d  ", a->min );
-	PRINTROW( "max    ", "%10d  ", a->max );
+	PRINTROW( "empty  ", "%10lu  ", a->empty );
+	PRINTROW( "min    ", "%10lu  ", a->min );
+	PRINTROW( "max    ", "%10lu  ", a->max );
 	PRINTROW( "stdev  ", "%10.4lf  ", a->stdev );
 
-	for( int t = 0; t < iterations; t++ )
-	{
-		randomize_buff( bbuff, BBUFF_LENGTH );
-
-		for( int b = 0; b < BITTEST; b++ )
-		{
-			for( a = algorithms; a; a = a->next )
-			{
-			  a->bittest[ b ] = (a->checksum)( bbuff, BBUFF_LENGTH );
-			}
-
-			bbuff[ rand() % 512 ] ^= bit[ rand() % 8 ];
+	run.test = 1;
+	runTest( &run, threads, threadCount );
 
-			if( b > 0 )
-			{
-				for( a = algorithms; a; a = a->next )
-				{
-					if( a->bittest[ 0 ] == a->bittest[ b ] )
-						a->missed[ b ]++;
-				}
-			}
-		}
-	}
+	for( a = algorithms; a; a = a->next )
+		for( int th = 0; th < threadCount; th++ )
+			for( int b = 0; b < BITTEST; b++ )
+				a->missed[ b ] += threads[th].missed[ a->index * BITTEST + b ];
 
 	printf( "\nbit change test:\n" );
 	for( int t = 1; t < BITTEST; t++ )
 	{
 		printf( "%2d        ", t );
 		for( a = algorithms; a; a = a->next )
-			printf( "%7d     ", a->missed[ t ] );
+			printf( "%7lu     ", a->missed[ t ] );
 		printf( "\n" );
 	}
-}
 
-#endif
+	sectors = (unsigned char *) malloc( THROUGHPUT_SECTORS * BBUFF_LENGTH );
+	rng_seed( &r, seed, SHARDS );
+	randomize_buff( &r, sectors, THROUGHPUT_SECTORS * BBUFF_LENGTH );
 
+	for( a = algorithms; a; a = a->next )
+		a->gbps = throughput( a, sectors );
 
+	printf( "\nthroughput, single thread:\n" );
+	PRINTROW( "GB/s   ", "%10.3lf  ", a->gbps );
 
+	return( 0 );
+}
 
+#endif
@@ -0,0 +1,374 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        CompressedImage.h - Block compressed, read-only disk images
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// The image is split into chunks of chunkSectors sectors, and each chunk is compressed with zlib
+// on its own.  File layout, in 512-byte sectors:
+//
+//     0                      header (struct compressedHeader)
+//     1 .. indexSectors      chunk index, one struct compressedChunk per chunk
+//     dataStart ..           compressed chunks, each starting on a sector boundary
+//
+// A chunk with length 0 is all zeros and takes no space; a chunk with length equal to the chunk size
+// is stored uncompressed.  Only the index is read when the image is opened.  Chunks are decompressed
+// on demand into a small LRU cache, so a multi-sector read usually decompresses each chunk once.
+//
+// Compressed images are read-only, use an overlay (-o) on a flat image for a writable disk.
+// CompressedImage::convert creates a compressed image from a flat image.
+//
+
+#ifndef COMPRESSEDIMAGE_H_INCLUDED
+#define COMPRESSEDIMAGE_H_INCLUDED
+
+#include "Library.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#define COMPRESSED_MAGIC "SerDriveCompress"
+#define COMPRESSED_VERSION 1
+#define COMPRESSED_CHUNKSECTORS 64             // 32 KB chunks
+#define COMPRESSED_MAXCHUNKSECTORS 2048        // largest chunks accepted when opening, 1 MB
+#define COMPRESSED_CACHECHUNKS 64              // 2 MB of decompressed chunks per image
+
+struct compressedHeader {
+	char magic[16];
+	unsigned int version;
+	unsigned int totallba;
+	unsigned int chunkSectors;
+	unsigned int chunkCount;
+	unsigned int indexSectors;
+	unsigned int dataStart;
+};
+
+struct compressedChunk {
+	unsigned int sector;
+	unsigned int length;
+};
+
+class CompressedImage : public Image
+{
+private:
+	class FileAccess fp;
+
+	struct compressedHeader header;
+	struct compressedChunk *chunks;
+
+	//
+	// LRU cache of decompressed chunks: cacheOf[chunk] is the cache entry holding it, or -1.
+	// Entries are kept in a doubly linked list, most recently used at the head.
+	//
+	struct cacheEntry {
+		unsigned long chunk;
+		int prev, next;
+		unsigned char *data;
+	} cache[ COMPRESSED_CACHECHUNKS ];
+	int *cacheOf;
+	int cacheHead, cacheTail;
+
+	unsigned char *compressed;
+	Mutex lock;                         // the chunk cache, and the buffer for compressed data
+
+	void cacheUnlink( int e )
+	{
+		if( cache[e].prev >= 0 )
+			cache[ cache[e].prev ].next = cache[e].next;
+		else
+			cacheHead = cache[e].next;
+
+		if( cache[e].next >= 0 )
+			cache[ cache[e].next ].prev = cache[e].prev;
+		else
+			cacheTail = cache[e].prev;
+	}
+
+	void cachePushFront( int e )
+	{
+		cache[e].prev = -1;
+		cache[e].next = cacheHead;
+		if( cacheHead >= 0 )
+			cache[ cacheHead ].prev = e;
+		cacheHead = e;
+		if( cacheTail < 0 )
+			cacheTail = e;
+	}
+
+	unsigned char *loadChunk( unsigned long chunk )
+	{
+		struct compressedChunk *c = &chunks[ chunk ];
+		unsigned long chunkBytes = header.chunkSectors << 9;
+		uLongf outLen = chunkBytes;
+		int e;
+
+		if( (e = cacheOf[ chunk ]) >= 0 )
+		{
+			if( e != cacheHead )
+			{
+				cacheUnlink( e );
+				cachePushFront( e );
+			}
+			return( cache[e].data );
+		}
+
+		//
+		// Reuse the least recently used entry
+		//
+		e = cacheTail;
+		cacheUnlink( e );
+		if( cache[e].chunk != (unsigned long) -1 )
+			cacheOf[ cache[e].chunk ] = -1;
+
+		if( c->length == 0 )
+			memset( cache[e].data, 0, chunkBytes );
+		else if( c->length == chunkBytes )
+			fp.ReadAt( cache[e].data, c->sector, header.chunkSectors );
+		else
+		{
+			fp.ReadAt( compressed, c->sector, (c->length + 511) >> 9 );
+			if( uncompress( cache[e].data, &outLen, compressed, c->length ) != Z_OK || outLen != chunkBytes )
+				log( -1, "'%s', chunk %lu is corrupt", shortFileName, chunk );
+		}
+
+		cache[e].chunk = chunk;
+		cacheOf[ chunk ] = e;
+		cachePushFront( e );
+
+		return( cache[e].data );
+	}
+
+public:
+	CompressedImage( char *name, int p_readOnly, int p_drive, unsigned long p_cyl, unsigned long p_head, unsigned long p_sect, int p_useCHS )   :   Image( name, p_readOnly, p_drive, 0, p_cyl, p_head, p_sect, p_useCHS )
+	{
+		unsigned char sector[512];
+		unsigned long chunkBytes, fileSectors;
+
+		fp.Open( name, 1 );
+		fileSectors = fp.SizeSectors();
+		fp.SeekSectors( 0 );
+		fp.Read( &sector[0], 512 );
+		memcpy( &header, &sector[0], sizeof(header) );
+
+		if( memcmp( header.magic, COMPRESSED_MAGIC, sizeof(header.magic) ) || header.version != COMPRESSED_VERSION )
+			log( -1, "'%s', not a SerDrive compressed image", name );
+
+		//
+		// Everything in the header and index is checked before it is used, so that a damaged file
+		// is turned away here rather than read out of bounds later
+		//
+		if( header.chunkSectors == 0 || header.chunkSectors > COMPRESSED_MAXCHUNKSECTORS ||
+			header.chunkCount != ((unsigned long long) header.totallba + header.chunkSectors - 1) / header.chunkSectors ||
+			header.indexSectors > fileSectors - 1 ||
+			((unsigned long long) header.indexSectors << 9) < (unsigned long long) header.chunkCount * sizeof(struct compressedChunk) )
+			log( -1, "'%s', compressed image header is corrupt", name );
+
+		chunkBytes = header.chunkSectors << 9;
+		chunks = (struct compressedChunk *) malloc( header.indexSectors << 9 );
+		cacheOf = (int *) malloc( header.chunkCount * sizeof(int) );
+		compressed = (unsigned char *) malloc( chunkBytes + 512 );
+		if( !chunks || !cacheOf || !compressed )
+			log( -1, "'%s', out of memory for compressed image index", name );
+
+		fp.Read( chunks, header.indexSectors << 9 );           // gives up on a short read
+
+		for( unsigned long t = 0; t < header.chunkCount; t++ )
+		{
+			if( chunks[t].length > chunkBytes ||
+				(chunks[t].length && (chunks[t].sector < 1 + header.indexSectors || chunks[t].sector > fileSectors ||
+									  (chunks[t].length + 511) >> 9 > fileSectors - chunks[t].sector)) )
+				log( -1, "'%s', compressed image index is corrupt", name );
+			cacheOf[t] = -1;
+		}
+
+		cacheHead = cacheTail = -1;
+		for( int e = 0; e < COMPRESSED_CACHECHUNKS; e++ )
+		{
+			if( !(cache[e].data = (unsigned char *) malloc( chunkBytes )) )
+				log( -1, "'%s', out of memory for compressed image cache", name );
+			cache[e].chunk = (unsigned long) -1;
+			cachePushFront( e );
+		}
+
+		totallba = header.totallba;
+
+		if( !p_readOnly )
+			log( 1, "%s: Compressed images are read only", name );
+
+		init( name, 1, p_drive, p_cyl, p_head, p_sect, p_useCHS );
+	}
+
+	~CompressedImage()
+	{
+		for( int e = 0; e < COMPRESSED_CACHECHUNKS; e++ )
+			free( cache[e].data );
+		free( compressed );
+		free( cacheOf );
+		free( chunks );
+		fp.Close();
+	}
+
+	//
+	// Checks the start of a file for the compressed image signature
+	//
+	static int isCompressed( const char *name )
+	{
+		char magic[ sizeof(COMPRESSED_MAGIC) ];
+		FILE *f;
+		int match = 0;
+
+		if( (f = fopen( name, "rb" )) )
+		{
+			match = fread( magic, 1, sizeof(COMPRESSED_MAGIC) - 1, f ) == sizeof(COMPRESSED_MAGIC) - 1 &&
+				!memcmp( magic, COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC) - 1 );
+			fclose( f );
+		}
+
+		return( match );
+	}
+
+	void writeSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		log( -1, "'%s', compressed images can't be written", shortFileName );
+	}
+
+	void readSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		unsigned long n;
+
+		if( lba >= totallba || count > totallba - lba )
+			log( -1, "'%s', Failed to read beyond lba=%lu", shortFileName, totallba );
+
+		lock.lock();
+
+		for( ; count; count -= n, lba += n, buff = (char *) buff + (n << 9) )
+		{
+			n = header.chunkSectors - lba % header.chunkSectors;
+			if( n > count )
+				n = count;
+
+			memcpy( buff, loadChunk( lba / header.chunkSectors ) + ((lba % header.chunkSectors) << 9), n << 9 );
+		}
+
+		lock.unlock();
+	}
+
+	//
+	// Converts flat image 'flatName' into a new compressed image 'name'
+	//
+	static void convert( char *flatName, char *name )
+	{
+		FileAccess in, out;
+		struct compressedHeader h;
+		struct compressedChunk *index;
+		unsigned char *data, *packed, *sector;
+		unsigned long chunkBytes, packedMax, next, zeros, stored;
+		double sizef;
+
+		in.Open( flatName, 1 );
+
+		memset( &h, 0, sizeof(h) );
+		memcpy( h.magic, COMPRESSED_MAGIC, sizeof(h.magic) );
+		h.version = COMPRESSED_VERSION;
+		h.totallba = in.SizeSectors();
+		h.chunkSectors = COMPRESSED_CHUNKSECTORS;
+		h.chunkCount = (h.totallba + h.chunkSectors - 1) / h.chunkSectors;
+		h.indexSectors = (h.chunkCount * sizeof(struct compressedChunk) + 511) >> 9;
+		h.dataStart = 1 + h.indexSectors;
+
+		chunkBytes = h.chunkSectors << 9;
+		packedMax = compressBound( chunkBytes );
+		index = (struct compressedChunk *) calloc( h.indexSectors, 512 );
+		data = (unsigned char *) malloc( chunkBytes );
+		packed = (unsigned char *) malloc( packedMax + 512 );
+		sector = (unsigned char *) calloc( 1, 512 );
+		if( !index || !data || !packed || !sector )
+			log( -1, "'%s', out of memory for conversion", name );
+
+		if( !out.Create( name ) )
+			log( -1, "'%s', won't overwrite an existing file", name );
+
+		next = h.dataStart;
+		zeros = stored = 0;
+		out.SetSizeSectors( next );
+
+		for( unsigned long c = 0; c < h.chunkCount; c++ )
+		{
+			unsigned long sectors = h.totallba - c * h.chunkSectors;
+			uLongf len = packedMax;
+			unsigned long t;
+
+			if( sectors > h.chunkSectors )
+				sectors = h.chunkSectors;
+
+			//
+			// The last chunk may be short, pad it out with zeros
+			//
+			memset( data, 0, chunkBytes );
+			in.SeekSectors( c * h.chunkSectors );
+			in.Read( data, sectors << 9 );
+
+			for( t = 0; t < chunkBytes && !data[t]; t++ ) ;
+			if( t == chunkBytes )
+			{
+				index[c].sector = 0;
+				index[c].length = 0;
+				zeros++;
+				continue;
+			}
+
+			if( compress2( packed, &len, data, chunkBytes, Z_BEST_COMPRESSION ) != Z_OK || len >= chunkBytes )
+			{
+				memcpy( packed, data, chunkBytes );
+				len = chunkBytes;
+				stored++;
+			}
+			else
+				memset( packed + len, 0, 512 - (len & 511) );
+
+			index[c].sector = next;
+			index[c].length = len;
+
+			out.SeekSectors( next );
+			out.Write( packed, (len + 511) & ~511 );
+			next += (len + 511) >> 9;
+		}
+
+		memcpy( sector, &h, sizeof(h) );
+		out.SeekSectors( 0 );
+		out.Write( sector, 512 );
+		out.Write( index, h.indexSectors << 9 );
+		out.Close();
+		in.Close();
+
+		sizef = (double) h.totallba / next;
+		log( 0, "Converted '%s' to '%s', %lu chunks (%lu zero, %lu uncompressed), %.2lf:1 compression",
+			 flatName, name, (unsigned long) h.chunkCount, zeros, stored, sizef );
+
+		free( sector );
+		free( packed );
+		free( data );
+		free( index );
+	}
+};
+
+#endif
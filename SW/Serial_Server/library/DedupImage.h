@@ -0,0 +1,695 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        DedupImage.h - Disk images sharing a store of deduplicated sectors
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// Many near-identical images (DOS boot disks, for instance) can share one block store, where each
+// distinct sector is kept only once.  Each image is then just a map from its LBAs to blocks in the
+// store.  DedupImage::import adds a flat image to a store, and writes its map.
+//
+// Store file layout, in 512-byte sectors:
+//
+//     0                      header (struct dedupStoreHeader)
+//     1 ..                   blocks, block n in sector n, in the order they were first stored
+//
+// Map file layout, in 512-byte sectors:
+//
+//     0                      header (struct dedupMapHeader), which names the store
+//     1 .. indexSectors      one 32-bit entry per LBA: 0 for a sector of zeros, which takes no
+//                            block, otherwise the block number, with DEDUP_PRIVATE set if no
+//                            other map can point at that block
+//
+// Blocks from an import may be shared, so writing to one of them is copy-on-write: the new data
+// goes into a new block, marked private in the map, and later writes to that LBA go to it in
+// place.  Blocks are never freed, a store only grows.  A store that is written to must only be
+// served by one server at a time.
+//
+// As private blocks change in place, an import must never share them.  They are also marked in a
+// bitmap next to the store (the store's name with ".private" added, one bit per block, created
+// with the first private block), and left out of the import's index.
+//
+// All images using the same store share one BlockStore.  With the sector cache (-s), sectors are
+// cached by block rather than by image and LBA, so a sector that many images have in common takes
+// one cache entry, however many clients are booting from them.
+//
+
+#ifndef DEDUPIMAGE_H_INCLUDED
+#define DEDUPIMAGE_H_INCLUDED
+
+#include "Library.h"
+#include "CachedImage.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define DEDUP_STORE_MAGIC "SerDriveBlocks"
+#define DEDUP_MAP_MAGIC "SerDriveDedupMap"
+#define DEDUP_VERSION 1
+#define DEDUP_ENTRIES_PER_SECTOR 128
+#define DEDUP_PRIVATE 0x80000000
+#define DEDUP_RUN 128                       // sectors read from a flat image at a time when importing
+
+struct dedupStoreHeader {
+	char magic[16];
+	unsigned int version;
+};
+
+struct dedupMapHeader {
+	char magic[16];
+	unsigned int version;
+	unsigned int totallba;
+	unsigned int indexSectors;
+	char store[ 512 - 28 ];                 // full path
+};
+
+//
+// The block store, as an Image whose LBAs are block numbers, so that the sector cache can hold
+// blocks under the store's name
+//
+class BlockStore : public Image
+{
+private:
+	class FileAccess fp;
+	char *path;
+	int users;
+
+	//
+	// Bitmap of the private blocks, all of it in memory, and in privateFp once there are any
+	//
+	class FileAccess privateFp;
+	char *privatePath;
+	int privateOpen;
+	unsigned char *privateBits;
+	unsigned long privateSectors;
+
+	//
+	// Hash index of the blocks, only built for importing
+	//
+	unsigned long long *hashes;
+	unsigned int *hashBlocks;
+	unsigned long hashMask, hashCount;
+
+	BlockStore *next;
+
+	static BlockStore *&all( void )
+	{
+		static BlockStore *stores = NULL;
+
+		return( stores );
+	}
+
+	BlockStore( char *p_path, int p_readOnly, int create )   :   Image( p_path, p_readOnly, 0 )
+	{
+		unsigned char sector[512];
+		struct dedupStoreHeader *h = (struct dedupStoreHeader *) &sector[0];
+		FILE *exists;
+
+		path = strdup( p_path );
+		shortFileName = path;
+		readOnly = p_readOnly;
+		users = 0;
+		hashes = NULL;
+		hashBlocks = NULL;
+		hashMask = hashCount = 0;
+		privateOpen = 0;
+		privateBits = NULL;
+		privateSectors = 0;
+
+		if( create && (exists = fopen( path, "rb" )) )
+			fclose( exists );
+		else if( create && fp.Create( path ) )
+		{
+			memset( &sector[0], 0, 512 );
+			memcpy( h->magic, DEDUP_STORE_MAGIC, sizeof(DEDUP_STORE_MAGIC) );
+			h->version = DEDUP_VERSION;
+			fp.Write( &sector[0], 512 );
+			fp.Close();
+
+			log( 0, "Created block store '%s'", path );
+		}
+
+		fp.Open( path, readOnly );
+		fp.SeekSectors( 0 );
+		fp.Read( &sector[0], 512 );
+
+		if( memcmp( h->magic, DEDUP_STORE_MAGIC, sizeof(DEDUP_STORE_MAGIC) ) || h->version != DEDUP_VERSION )
+			log( -1, "'%s', not a SerDrive block store", path );
+
+		totallba = fp.SizeSectors();
+
+		if( !(privatePath = (char *) malloc( strlen( path ) + 9 )) )
+			log( -1, "'%s', out of memory", path );
+		sprintf( privatePath, "%s.private", path );
+
+		if( (exists = fopen( privatePath, "rb" )) )
+		{
+			fclose( exists );
+
+			privateFp.Open( privatePath, readOnly );
+			privateOpen = 1;
+			privateSectors = privateFp.SizeSectors();
+			if( !(privateBits = (unsigned char *) malloc( privateSectors << 9 )) && privateSectors )
+				log( -1, "'%s', out of memory for the private block bitmap", privatePath );
+			privateFp.ReadAt( privateBits, 0, privateSectors );
+		}
+	}
+
+	~BlockStore()
+	{
+		fp.Close();
+		if( privateOpen )
+			privateFp.Close();
+		free( privateBits );
+		free( privatePath );
+		free( hashes );
+		free( hashBlocks );
+		free( path );
+	}
+
+	int isPrivate( unsigned long block )
+	{
+		return( (block >> 12) < privateSectors && (privateBits[ block >> 3 ] & (1 << (block & 7))) );
+	}
+
+	//
+	// Sets the bit of a private block, and writes out the sector of the bitmap holding it
+	//
+	void markPrivate( unsigned long block )
+	{
+		unsigned long sector = block >> 12;
+
+		if( sector >= privateSectors )
+		{
+			if( !privateOpen )
+			{
+				privateFp.Create( privatePath );
+				privateOpen = 1;
+			}
+
+			if( !(privateBits = (unsigned char *) realloc( privateBits, (sector + 1) << 9 )) )
+				log( -1, "'%s', out of memory for the private block bitmap", privatePath );
+			memset( &privateBits[ privateSectors << 9 ], 0, (sector + 1 - privateSectors) << 9 );
+			privateSectors = sector + 1;
+		}
+
+		privateBits[ block >> 3 ] |= 1 << (block & 7);
+		privateFp.WriteAt( &privateBits[ sector << 9 ], sector, 1 );
+	}
+
+	static unsigned long long hash( unsigned short *data )
+	{
+		unsigned long long h = 0x9e3779b97f4a7c15ULL;
+		unsigned long long *w = (unsigned long long *) data;
+
+		for( int t = 0; t < 64; t++ )
+		{
+			h = (h ^ w[t]) * 0xff51afd7ed558ccdULL;
+			h ^= h >> 32;
+		}
+
+		return( h );
+	}
+
+	void hashInsert( unsigned long long h, unsigned int block )
+	{
+		unsigned long i;
+
+		for( i = h & hashMask; hashBlocks[i]; i = (i + 1) & hashMask ) ;
+
+		hashes[i] = h;
+		hashBlocks[i] = block;
+		hashCount++;
+	}
+
+	void hashGrow( void )
+	{
+		unsigned long long *oldHashes = hashes;
+		unsigned int *oldBlocks = hashBlocks;
+		unsigned long oldSize = hashMask + 1;
+
+		hashMask = hashMask ? hashMask * 2 + 1 : 65535;
+		hashCount = 0;
+		hashes = (unsigned long long *) malloc( (hashMask + 1) * sizeof(unsigned long long) );
+		hashBlocks = (unsigned int *) calloc( hashMask + 1, sizeof(unsigned int) );
+		if( !hashes || !hashBlocks )
+			log( -1, "'%s', out of memory for the block index", path );
+
+		for( unsigned long t = 0; oldBlocks && t < oldSize; t++ )
+			if( oldBlocks[t] )
+				hashInsert( oldHashes[t], oldBlocks[t] );
+
+		free( oldHashes );
+		free( oldBlocks );
+	}
+
+public:
+	//
+	// Mutex for appending blocks
+	//
+	Mutex lock;
+
+	//
+	// Returns the store at 'path', opening it if no image is using it yet
+	//
+	static BlockStore *open( char *p_path, int p_readOnly, int create = 0 )
+	{
+		BlockStore *s;
+
+		for( s = all(); s && (strcmp( s->path, p_path ) || s->readOnly != p_readOnly); s = s->next ) ;
+
+		if( !s )
+		{
+			s = new BlockStore( p_path, p_readOnly, create );
+			s->next = all();
+			all() = s;
+		}
+
+		s->users++;
+
+		return( s );
+	}
+
+	void close( void )
+	{
+		BlockStore **p;
+
+		if( --users )
+			return;
+
+		for( p = &all(); *p != this; p = &(*p)->next ) ;
+		*p = next;
+
+		delete this;
+	}
+
+	const char *name( void )
+	{
+		return( path );
+	}
+
+	void readSectors( unsigned long block, unsigned long count, void *buff )
+	{
+		fp.ReadAt( buff, block, count );
+	}
+
+	//
+	// Rewrites blocks in place, only for blocks private to one map
+	//
+	void writeSectors( unsigned long block, unsigned long count, void *buff )
+	{
+		fp.WriteAt( buff, block, count );
+	}
+
+	//
+	// Adds a block to the end of the store, returns its number.  A private block is marked as
+	// such before it is written, and is never found by find().
+	//
+	unsigned int append( void *buff, int shared = 1 )
+	{
+		unsigned int block;
+
+		lock.lock();
+
+		block = totallba++;
+		if( block & DEDUP_PRIVATE )
+			log( -1, "'%s', the block store is full", path );
+		if( !shared )
+			markPrivate( block );
+		fp.WriteAt( buff, block, 1 );
+
+		if( hashBlocks && shared )
+		{
+			if( hashCount * 2 > hashMask )
+				hashGrow();
+			hashInsert( hash( (unsigned short *) buff ), block );
+		}
+
+		lock.unlock();
+
+		return( block );
+	}
+
+	//
+	// Returns a shared block holding the same data, or 0 if there isn't one.  The first call
+	// reads the whole store to build the index.
+	//
+	unsigned int find( void *buff )
+	{
+		unsigned short candidate[256];
+		unsigned long long h = hash( (unsigned short *) buff );
+		unsigned long i;
+
+		if( !hashBlocks )
+		{
+			hashGrow();
+			while( hashCount * 2 > hashMask || (hashMask + 1) / 2 < totallba )
+				hashGrow();
+
+			for( unsigned long b = 1; b < totallba; b++ )
+			{
+				if( isPrivate( b ) )
+					continue;
+
+				fp.ReadAt( candidate, b, 1 );
+				if( hashCount * 2 > hashMask )
+					hashGrow();
+				hashInsert( hash( candidate ), b );
+			}
+		}
+
+		for( i = h & hashMask; hashBlocks[i]; i = (i + 1) & hashMask )
+		{
+			if( hashes[i] != h )
+				continue;
+
+			fp.ReadAt( candidate, hashBlocks[i], 1 );
+			if( !memcmp( candidate, buff, 512 ) )
+				return( hashBlocks[i] );
+		}
+
+		return( 0 );
+	}
+
+	void flush( void )
+	{
+		fp.Flush();
+		if( privateOpen )
+			privateFp.Flush();
+	}
+};
+
+class DedupImage : public Image
+{
+private:
+	class FileAccess map;
+	BlockStore *store;
+	SectorCache *cache;
+
+	unsigned int *entries;
+	unsigned long indexSectors;
+	unsigned short zeroCrc;
+
+	Mutex lock;                             // the map
+
+	unsigned int entry( unsigned long p_lba )
+	{
+		unsigned int e;
+
+		lock.lock();
+		e = entries[ p_lba ];
+		lock.unlock();
+
+		return( e );
+	}
+
+	//
+	// Reads one block through the shared sector cache
+	//
+	void readCached( unsigned int block, void *buff, unsigned short *crc )
+	{
+		cache->read( store, block, buff, crc );
+	}
+
+public:
+	DedupImage( char *name, int p_readOnly, int p_drive, unsigned long p_cyl, unsigned long p_head, unsigned long p_sect, int p_useCHS )   :   Image( name, p_readOnly, p_drive, 0, p_cyl, p_head, p_sect, p_useCHS )
+	{
+		unsigned char sector[512];
+		struct dedupMapHeader *h = (struct dedupMapHeader *) &sector[0];
+		unsigned short zeros[256];
+
+		map.Open( name, p_readOnly );
+		map.SeekSectors( 0 );
+		map.Read( &sector[0], 512 );
+
+		if( memcmp( h->magic, DEDUP_MAP_MAGIC, sizeof(h->magic) ) || h->version != DEDUP_VERSION )
+			log( -1, "'%s', not a SerDrive deduplicated image map", name );
+
+		totallba = h->totallba;
+		indexSectors = h->indexSectors;
+		if( indexSectors != (totallba + DEDUP_ENTRIES_PER_SECTOR - 1) / DEDUP_ENTRIES_PER_SECTOR )
+			log( -1, "'%s', image map header is corrupt", name );
+
+		if( !(entries = (unsigned int *) malloc( indexSectors << 9 )) )
+			log( -1, "'%s', out of memory for the image map", name );
+		map.Read( entries, indexSectors << 9 );
+
+		h->store[ sizeof(h->store) - 1 ] = 0;
+		store = BlockStore::open( h->store, p_readOnly );
+
+		for( unsigned long t = 0; t < totallba; t++ )
+			if( (entries[t] & ~DEDUP_PRIVATE) >= store->totallba )
+				log( -1, "'%s', points beyond the end of block store '%s'", name, store->name() );
+
+		cache = NULL;
+		memset( zeros, 0, sizeof(zeros) );
+		zeroCrc = checksum( zeros, 256 );
+
+		log( 1, "%s: Deduplicated image in block store '%s'", name, store->name() );
+
+		init( name, p_readOnly, p_drive, p_cyl, p_head, p_sect, p_useCHS );
+	}
+
+	~DedupImage()
+	{
+		map.Close();
+		store->close();
+		free( entries );
+	}
+
+	//
+	// Checks the start of a file for the map signature
+	//
+	static int isDedupMap( const char *name )
+	{
+		char magic[ sizeof(DEDUP_MAP_MAGIC) ];
+		FILE *f;
+		int match = 0;
+
+		if( (f = fopen( name, "rb" )) )
+		{
+			match = fread( magic, 1, sizeof(DEDUP_MAP_MAGIC) - 1, f ) == sizeof(DEDUP_MAP_MAGIC) - 1 &&
+				!memcmp( magic, DEDUP_MAP_MAGIC, sizeof(DEDUP_MAP_MAGIC) - 1 );
+			fclose( f );
+		}
+
+		return( match );
+	}
+
+	int attachCache( SectorCache *p_cache )
+	{
+		cache = p_cache;
+
+		return( 1 );
+	}
+
+	int readSectorChecksum( unsigned long lba, void *buff, unsigned short *crc )
+	{
+		unsigned int block;
+
+		if( lba >= totallba )
+			log( -1, "'%s', Failed to read beyond lba=%lu", shortFileName, totallba );
+
+		if( !(block = entry( lba ) & ~DEDUP_PRIVATE) )
+		{
+			memset( buff, 0, 512 );
+			*crc = zeroCrc;
+			return( 1 );
+		}
+
+		if( !cache )
+		{
+			store->readSectors( block, 1, buff );
+			return( 0 );
+		}
+
+		readCached( block, buff, crc );
+		return( 1 );
+	}
+
+	void readSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		unsigned int first;
+		unsigned long run;
+		unsigned short crc;
+
+		if( lba >= totallba || count > totallba - lba )
+			log( -1, "'%s', Failed to read beyond lba=%lu", shortFileName, totallba );
+
+		while( count )
+		{
+			//
+			// Without the cache, sectors that were stored one after the other are read together
+			//
+			lock.lock();
+			first = entries[ lba ] & ~DEDUP_PRIVATE;
+			for( run = 1; run < count && first && !cache && (entries[ lba + run ] & ~DEDUP_PRIVATE) == first + run; run++ ) ;
+			lock.unlock();
+
+			if( !first )
+				memset( buff, 0, 512 );
+			else if( cache )
+				readCached( first, buff, &crc );
+			else
+				store->readSectors( first, run, buff );
+
+			lba += run;
+			count -= run;
+			buff = (char *) buff + run * 512;
+		}
+	}
+
+	void writeSectorChecksum( unsigned long lba, void *buff, unsigned short crc )
+	{
+		unsigned int *e;
+		unsigned int block;
+
+		if( lba >= totallba )
+			log( -1, "'%s', Failed to write beyond lba=%lu", shortFileName, totallba );
+
+		lock.lock();
+
+		e = &entries[ lba ];
+
+		if( *e & DEDUP_PRIVATE )
+		{
+			block = *e & ~DEDUP_PRIVATE;
+
+			if( cache )
+				cache->write( store, block, buff, crc );
+			else
+				store->writeSectors( block, 1, buff );
+		}
+		else
+		{
+			//
+			// Copy on write: the old block may be shared, so the data goes into a new one, and only
+			// then is the map pointed at it
+			//
+			*e = store->append( buff, 0 ) | DEDUP_PRIVATE;
+			map.WriteAt( &entries[ lba & ~(DEDUP_ENTRIES_PER_SECTOR-1) ], 1 + lba / DEDUP_ENTRIES_PER_SECTOR, 1 );
+		}
+
+		lock.unlock();
+	}
+
+	void writeSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		for( ; count; count--, lba++, buff = (char *) buff + 512 )
+			writeSectorChecksum( lba, buff, checksum( (unsigned short *) buff, 256 ) );
+	}
+
+	void flush( void )
+	{
+		if( cache )
+		{
+			cache->lock.lock();
+			cache->flush( store );
+			cache->lock.unlock();
+		}
+
+		store->flush();
+		map.Flush();
+	}
+
+	//
+	// Adds flat image 'flatName' to the block store 'storeName', creating the store if needed, and
+	// writes the image's map to 'flatName' with ".map" added
+	//
+	static void import( char *flatName, char *storeName )
+	{
+		FileAccess in, out;
+		BlockStore *store;
+		unsigned char sector[512];
+		struct dedupMapHeader *h = (struct dedupMapHeader *) &sector[0];
+		unsigned short *data;
+		unsigned int *index;
+		unsigned long shared = 0, added = 0, zeros = 0, n, t;
+		char *storePath, *mapName;
+
+		in.Open( flatName, 1 );
+
+		store = BlockStore::open( storeName, 0, 1 );
+		if( !(storePath = realpath( storeName, NULL )) || strlen( storePath ) >= sizeof(h->store) )
+			log( -1, "'%s', block store path is too long", storeName );
+
+		memset( &sector[0], 0, 512 );
+		memcpy( h->magic, DEDUP_MAP_MAGIC, sizeof(h->magic) );
+		h->version = DEDUP_VERSION;
+		h->totallba = in.SizeSectors();
+		h->indexSectors = (h->totallba + DEDUP_ENTRIES_PER_SECTOR - 1) / DEDUP_ENTRIES_PER_SECTOR;
+		strcpy( h->store, storePath );
+
+		mapName = (char *) malloc( strlen( flatName ) + 5 );
+		index = (unsigned int *) calloc( h->indexSectors, 512 );
+		data = (unsigned short *) malloc( DEDUP_RUN * 512 );
+		if( !mapName || !index || !data )
+			log( -1, "'%s', out of memory for import", flatName );
+		sprintf( mapName, "%s.map", flatName );
+
+		if( !out.Create( mapName ) )
+			log( -1, "'%s', won't overwrite an existing file", mapName );
+
+		for( unsigned long lba = 0; lba < h->totallba; lba += n )
+		{
+			n = h->totallba - lba < DEDUP_RUN ? h->totallba - lba : DEDUP_RUN;
+			in.ReadAt( data, lba, n );
+
+			for( unsigned long s = 0; s < n; s++ )
+			{
+				unsigned short *d = &data[ s * 256 ];
+
+				for( t = 0; t < 256 && !d[t]; t++ ) ;
+
+				if( t == 256 )
+				{
+					index[ lba + s ] = 0;
+					zeros++;
+				}
+				else if( (index[ lba + s ] = store->find( d )) )
+					shared++;
+				else
+				{
+					index[ lba + s ] = store->append( d );
+					added++;
+				}
+			}
+		}
+
+		out.Write( &sector[0], 512 );
+		out.Write( index, h->indexSectors << 9 );
+		out.Close();
+		in.Close();
+
+		log( 0, "Imported '%s' into '%s' as '%s': %lu sectors already stored, %lu added, %lu zero; the store has %lu blocks",
+			 flatName, storeName, mapName, shared, added, zeros, store->totallba - 1 );
+
+		store->flush();
+		store->close();
+
+		free( storePath );
+		free( mapName );
+		free( index );
+		free( data );
+	}
+};
+
+#endif
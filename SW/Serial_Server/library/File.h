@@ -29,6 +29,7 @@
 //
 
 #include <stdio.h>
+#include "Mutex.h"
 
 class FileAccess
 {
@@ -52,9 +53,9 @@ public:
 		return( 1 );
 	}
 
-	void Open( char *p_name )
+	void Open( char *p_name, int readOnly = 0 )
 	{
-		fp = fopen( p_name, "r+" );
+		fp = fopen( p_name, readOnly ? "r" : "r+" );
 		if( !fp )
 			log( -1, "Could not Open '%s'", p_name );
 		name = p_name;
@@ -83,6 +84,18 @@ public:
 		return( filesize >> 9 );     // 512 bytes per sector
 	}
 
+	//
+	// Extends the file to the given length by writing only its last byte, the gap reads back as zeros
+	//
+	void SetSizeSectors( unsigned long sectors )
+	{
+		if( !sectors )
+			return;
+
+		if( fseek( fp, sectors * 512 - 1, SEEK_SET ) || fputc( 0, fp ) == EOF )
+			log( -1, "'%s', could not set file size to %lu sectors", name, sectors );
+	}
+
 	void SeekSectors( unsigned long lba )
 	{
 		if( fseek( fp, lba * 512, SEEK_SET ) )
@@ -91,16 +104,54 @@ public:
 
 	void Read( void *buff, unsigned long len )
 	{
-		if( fread( buff, 1, 512, fp ) != 512 )
+		if( fread( buff, 1, len, fp ) != len )
 			log( -1, "'%s', Failed to read sector", name );
 	}
 
 	void Write( void *buff, unsigned long len )
 	{
-		if( fwrite( buff, 1, 512, fp ) != 512 )
+		if( fwrite( buff, 1, len, fp ) != len )
 			log( -1, "'%s', Failed to write sector", name );
 	}
 
+	//
+	// Positional access, here a seek and a read or write made under a lock
+	//
+	void ReadAt( void *buff, unsigned long lba, unsigned long sectors )
+	{
+		positionLock.lock();
+		SeekSectors( lba );
+		Read( buff, sectors * 512 );
+		positionLock.unlock();
+	}
+
+	void WriteAt( void *buff, unsigned long lba, unsigned long sectors )
+	{
+		positionLock.lock();
+		SeekSectors( lba );
+		Write( buff, sectors * 512 );
+		positionLock.unlock();
+	}
+
+	void ReadVectorAt( void *buffs[], unsigned long lba, int count )
+	{
+		positionLock.lock();
+		SeekSectors( lba );
+		for( int t = 0; t < count; t++ )
+			Read( buffs[t], 512 );
+		positionLock.unlock();
+	}
+
+	static void RegisterBuffer( void *buff, unsigned long len )
+	{
+	}
+
+	void Flush()
+	{
+		if( fflush( fp ) )
+			log( 0, "'%s', Failed to flush", name );
+	}
+
 	FileAccess()
 	{
 		fp = NULL;
@@ -112,6 +163,7 @@ public:
 
 private:
 	FILE *fp;
+	Mutex positionLock;
 	char *name;
 };
 
@@ -21,12 +21,15 @@
 // Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
 //
 
+#ifndef FLATIMAGE_H_INCLUDED
+#define FLATIMAGE_H_INCLUDED
+
 #include "Library.h"
 #include <string.h>
 
 class FlatImage : public Image
 {
-private:
+protected:
 	class FileAccess fp;
 
 public:
@@ -36,7 +39,6 @@ public:
 
 		if( p_create )
 		{
-			char buff[512];
 			unsigned long size;
 			double sizef;
 			FileAccess cf;
@@ -55,9 +57,11 @@ public:
 
 			if( cf.Create( name ) )
 			{
-				memset( &buff[0], 0, 512 );
-				while( size-- )
-					cf.Write( &buff[0], 512 );
+				//
+				// The new disk is all zeros, so just set the file size (sparse where the file system allows it)
+				// rather than writing out every sector
+				//
+				cf.SetSizeSectors( size );
 
 				if( p_cyl > 1024 )
 					log( 0, "Created file '%s', size %.2lf %cB", name, sizef, sizeChar );
@@ -67,7 +71,7 @@ public:
 			}
 		}
 
-		fp.Open( name );
+		fp.Open( name, p_readOnly );
 
 		totallba = fp.SizeSectors();
 
@@ -79,19 +83,26 @@ public:
 		fp.Close();
 	}
 
-	void seekSector( unsigned long lba )
+	void readSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		fp.ReadAt( buff, lba, count );
+	}
+
+	void writeSectors( unsigned long lba, unsigned long count, void *buff )
 	{
-		fp.SeekSectors( lba );
+		fp.WriteAt( buff, lba, count );
 	}
 
-	void writeSector( void *buff )
+	int readSectorsVector( unsigned long lba, unsigned short *buffs[], int count )
 	{
-		fp.Write( buff, 512 );
+		fp.ReadVectorAt( (void **) buffs, lba, count );
+		return( 1 );
 	}
 
-	void readSector( void *buff )
+	void flush( void )
 	{
-		fp.Read( buff, 512 );
+		fp.Flush();
 	}
 };
 
+#endif
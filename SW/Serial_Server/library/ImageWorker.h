@@ -0,0 +1,176 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        ImageWorker.h - A thread carrying out the reads and writes for one image
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// When several ports are served from one thread, a read or write that takes a long time (an image
+// on a network mount, a compressed block to inflate, a copy-on-write) would hold up every port.
+// Instead, each image gets an ImageWorker, and the ports hand it their jobs.  The worker takes
+// them in order, from all the ports using the image, runs them with runDriveJob, and calls 'notify'
+// after each one, so that the server can carry on with the port it belongs to.  A port waiting on
+// one image doesn't keep the others from being served.
+//
+// Jobs are kept in a list through driveJob::next, and belong to the port that submitted them, so
+// nothing is allocated here.
+//
+
+#ifndef IMAGEWORKER_H_INCLUDED
+#define IMAGEWORKER_H_INCLUDED
+
+#include "Library.h"
+#include "Mutex.h"
+#include <pthread.h>
+
+class ImageWorker : public DriveWorker
+{
+public:
+	ImageWorker( Image *p_image, void (*p_notify)( void *arg ), void *p_notifyArg )
+	{
+		image = p_image;
+		notify = p_notify;
+		notifyArg = p_notifyArg;
+
+		head = tail = NULL;
+		running = stopping = 0;
+		jobs = 0;
+
+		if( pthread_create( &thread, NULL, workerThread, this ) )
+			log( -1, "'%s', could not start the image worker", image->shortFileName );
+	}
+
+	//
+	// Finishes the jobs already submitted, and stops the thread.  Used once the image is no
+	// longer behind any drive (see LinuxControl.h).
+	//
+	~ImageWorker()
+	{
+		lock.lock();
+		stopping = 1;
+		work.signal();
+		lock.unlock();
+
+		pthread_join( thread, NULL );
+	}
+
+	void submit( struct driveJob *job )
+	{
+		lock.lock();
+
+		job->busy = 1;
+		job->next = NULL;
+		if( tail )
+			tail->next = job;
+		else
+			head = job;
+		tail = job;
+
+		work.signal();
+		lock.unlock();
+	}
+
+	int busy( struct driveJob *job )
+	{
+		int b;
+
+		lock.lock();
+		b = job->busy;
+		lock.unlock();
+
+		return( b );
+	}
+
+	void wait( struct driveJob *job )
+	{
+		lock.lock();
+		while( job->busy )
+			done.wait( lock );
+		lock.unlock();
+	}
+
+	void drain( void )
+	{
+		lock.lock();
+		while( head || running )
+			done.wait( lock );
+		lock.unlock();
+	}
+
+	//
+	// Jobs carried out so far
+	//
+	unsigned long jobs;
+
+private:
+	Image *image;
+	void (*notify)( void *arg );
+	void *notifyArg;
+
+	struct driveJob *head, *tail;
+	int running, stopping;
+
+	pthread_t thread;
+	Mutex lock;                             // the queue, and the busy flag of the jobs on it
+	Condition work, done;
+
+	static void *workerThread( void *arg )
+	{
+		ImageWorker *w = (ImageWorker *) arg;
+		struct driveJob *job;
+
+		w->lock.lock();
+
+		for( ;; )
+		{
+			while( !w->head && !w->stopping )
+				w->work.wait( w->lock );
+
+			if( !w->head )
+				break;
+
+			job = w->head;
+			if( !(w->head = job->next) )
+				w->tail = NULL;
+			w->running = 1;
+
+			w->lock.unlock();
+
+			runDriveJob( job );
+
+			w->lock.lock();
+			job->busy = 0;
+			w->running = 0;
+			w->jobs++;
+			w->done.broadcast();
+			w->lock.unlock();
+
+			w->notify( w->notifyArg );
+
+			w->lock.lock();
+		}
+
+		w->lock.unlock();
+
+		return( NULL );
+	}
+};
+
+#endif
@@ -28,11 +28,25 @@
 #define SERIAL_SERVER_MINORVERSION 0
 
 #include <termios.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Stats.h"
+#include "Mutex.h"
 
 void log( int level, const char *message, ... );
 
+//
+// Messages above the reporting level (-v) are not reported.  Where working out what to log costs
+// something, check logging( level ) first.
+//
+extern int verbose;
+
+inline int logging( int level ) { return( level <= verbose ); }
+
 unsigned long GetTime(void);
-unsigned long GetTime_Timeout(void);
+unsigned long long GetTime_Microseconds(void);
 
 unsigned short checksum( unsigned short *wbuff, int wlen );
 
@@ -47,14 +61,46 @@ struct floppyInfo {
 
 struct floppyInfo *FindFloppyInfoBySize( double size );
 
+class SectorCache;
+
 class Image
 {
 public:
-	virtual void seekSector( unsigned long lba ) = 0;
+	//
+	// Sectors are addressed by LBA on every call, there is no current position.  All images can
+	// be used by several threads at once, and reads and writes can span any number of sectors.
+	//
+	virtual void readSectors( unsigned long lba, unsigned long count, void *buff ) = 0;
+
+	virtual void writeSectors( unsigned long lba, unsigned long count, void *buff ) = 0;
 
-	virtual void writeSector( void *buff ) = 0;
+	// Images that hold their sectors in memory can return a pointer to the sector data,
+	// avoiding the copy through readSectors.  NULL means use readSectors.
+	//
+	virtual unsigned short *mapSector( unsigned long lba ) { return( NULL ); }
 
-	virtual void readSector( void *buff ) = 0;
+	// Same as reading one sector, but also returns the checksum of the sector if the image already
+	// has it (for example, from a cache).  Returns 0 if the caller must calculate the checksum itself.
+	//
+	virtual int readSectorChecksum( unsigned long lba, void *buff, unsigned short *crc ) { readSectors( lba, 1, buff ); return( 0 ); }
+
+	// Same as writing one sector, with the checksum of the sector as received from the client
+	//
+	virtual void writeSectorChecksum( unsigned long lba, void *buff, unsigned short crc ) { writeSectors( lba, 1, buff ); }
+
+	// Reads 'count' consecutive sectors starting at 'lba', each into its own buffer, in one request
+	// to the disk.  Returns 0 if the image can't do this, and the caller must use readSectors instead.
+	//
+	virtual int readSectorsVector( unsigned long lba, unsigned short *buffs[], int count ) { return( 0 ); }
+
+	// Waits until all sectors written so far have reached the disk
+	//
+	virtual void flush( void ) {}
+
+	// Images that can use the shared sector cache themselves, rather than through a CachedImage,
+	// return 1 (see DedupImage)
+	//
+	virtual int attachCache( SectorCache *cache ) { return( 0 ); }
 
 	Image( const char *name, int p_readOnly, int p_drive );
 	Image( const char *name, int p_readOnly, int p_drive, int p_create, unsigned long p_lba );
@@ -88,6 +134,18 @@ struct baudRate {
 struct baudRate *baudRateMatchString( const char *str );
 struct baudRate *baudRateMatchDivisor( unsigned char divisor );
 
+//
+// A frame is queued as segments and handed to the serial port in one write, as soon as it is
+// ready: a read frame is two segments, sector and checksum.  The client acknowledges each frame
+// before the next is due, so there is never more than one to send.
+//
+#define SEND_SEGMENTS 2
+
+struct sendSegment {
+	void *data;
+	unsigned long len;
+};
+
 #ifdef WIN32
 #include "../win32/win32serial.h"
 #elif defined(linux)
@@ -104,6 +162,374 @@ struct baudRate *baudRateMatchDivisor( unsigned char divisor );
 #include "File.h"
 #endif
 
-void processRequests( SerialAccess *serial, Image *image0, Image *image1, int timeoutEnabled, int verboseLevel );
+//
+// Serial command, or one sector with its checksum
+//
+union processBuffer {
+	struct {
+		unsigned char command;
+		unsigned char driveAndHead;
+		unsigned char count;
+		unsigned char sector;
+		unsigned short cylinder;
+	} chs;
+	struct {
+		unsigned char command;
+		unsigned char bits24;
+		unsigned char count;
+		unsigned char bits00;
+		unsigned char bits08;
+		unsigned char bits16;
+	} lba;
+	struct {
+		unsigned char command;
+		unsigned char driveAndHead;
+		unsigned char count;
+		unsigned char scan;
+		unsigned char port;
+		unsigned char baud;
+	} inquire;
+	struct {
+		unsigned char command;
+		unsigned char driveAndHead;
+		unsigned char count;
+		unsigned char scan;
+		unsigned short PackedPortAndBaud;
+	} inquirePacked;
+	unsigned char b[514];
+	unsigned short w[257];
+};
+
+//
+// Read-ahead ring for multi-sector reads.  While one frame (512 bytes of sector data followed by
+// its checksum) is draining out of the serial port, the following sectors of the same command are
+// read from the image and checksummed into this ring, so that the next frame can be sent the moment
+// the continuation ACK arrives.
+//
+// For images that can map their sectors (Image::mapSector), the frame points at the image's own copy
+// of the sector and only the checksum is kept in the frame.
+//
+#define READAHEAD_FRAMES 16
+
+#define RECEIVE_BUFFER 4096
+
+//
+// How long the client is given for each part of a command, before the command is given up on and
+// the server goes back to looking for a command header.  Each allowance, in microseconds, is on
+// top of the time the characters take on the wire at the baud rate of the connection, both those
+// still to come and those still going out to the client.  An allowance of 0 leaves that part of
+// a command to take as long as it takes.
+//
+#define TIMEOUT_HEADER 0                  // the rest of an 8 byte command header
+#define TIMEOUT_PAYLOAD 1                 // a sector for Write Sector
+#define TIMEOUT_ACK 2                     // a continuation ACK, after a sector or checksum was sent
+#define TIMEOUT_PHASES 3
+
+struct processTimeouts {
+	unsigned long allowance[ TIMEOUT_PHASES ];
+};
+
+extern const struct processTimeouts processTimeoutsDefault;
+
+struct readAheadFrame {
+	unsigned short *data;
+	unsigned short w[257];
+};
+
+//
+// A read or write for one serial connection, carried out by runDriveJob, either straight away or
+// by the drive's worker.  A read fills 'count' read-ahead frames with sectors and their checksums,
+// a write writes one sector.
+//
+#define DRIVEJOB_READ 0
+#define DRIVEJOB_WRITE 1
+
+struct driveJob {
+	int type;
+	Image *image;
+	unsigned long lba;
+	int count;
+	struct readAheadFrame *frames[ READAHEAD_FRAMES ];
+	unsigned short *data;
+	unsigned short crc;
+
+	unsigned long long diskTime, checksumTime;    // microseconds, for the connection's statistics
+	volatile int busy;                              // submitted, and not yet done
+	struct driveJob *next;
+};
+
+void runDriveJob( struct driveJob *job );
+
+//
+// Services the reads and writes for one image, in the order they are submitted, so that a slow
+// image only holds up the connections using it (see ImageWorker.h).  Once a job is done, the
+// worker lets the server know, and it calls ProcessState::resume for the connections waiting.
+//
+class DriveWorker
+{
+public:
+	virtual void submit( struct driveJob *job ) = 0;
+
+	virtual int busy( struct driveJob *job ) = 0;
+
+	virtual void wait( struct driveJob *job ) = 0;
+
+	// Waits until everything submitted so far is done
+	//
+	virtual void drain( void ) = 0;
+
+	virtual ~DriveWorker() {};
+};
+
+//
+// Which image is behind each drive of each port.  The client picks one of two drives with the
+// drive bit of its commands, so a port has at most two, but the table holds any number of ports.
+// An image may be behind drives of several ports, and each image has at most one worker.
+//
+// The image behind a drive may be changed while serving (see LinuxControl.h), so connections
+// look it up again at the start of each command.
+//
+struct driveSlot {
+	Image *image;
+	DriveWorker *worker;
+
+	unsigned long commands[ STATS_COMMANDS ];     // completed, whichever image was behind the drive
+	unsigned long sectors[ STATS_COMMANDS ];
+	unsigned long changes;                          // images swapped, ejected or inserted
+};
+
+class DriveTable
+{
+public:
+	DriveTable() { slots = NULL; ports = 0; }
+
+	//
+	// Puts the image behind the next free drive of the port.  Returns 0 if the port already has two.
+	//
+	int add( int port, Image *image )
+	{
+		struct driveSlot *s;
+
+		if( port >= ports )
+		{
+			if( !(slots = (struct driveSlot *) realloc( slots, (port + 1) * 2 * sizeof(struct driveSlot) )) )
+				log( -1, "Out of memory for the drive table" );
+			memset( &slots[ ports * 2 ], 0, (port + 1 - ports) * 2 * sizeof(struct driveSlot) );
+			ports = port + 1;
+		}
+
+		s = &slots[ port * 2 ];
+		if( s[1].image )
+			return( 0 );
+
+		//
+		// Floppy disks must come after any hard disks
+		//
+		if( !s[0].image )
+			s[0].image = image;
+		else if( s[0].image->floppy && !image->floppy )
+		{
+			s[1] = s[0];
+			s[0].image = image;
+			s[0].worker = NULL;
+		}
+		else
+			s[1].image = image;
+
+		return( 1 );
+	}
+
+	struct driveSlot *slot( int port, int drive )
+	{
+		return( port < ports ? &slots[ port * 2 + drive ] : NULL );
+	}
+
+	Image *image( int port, int drive )
+	{
+		return( port < ports ? slots[ port * 2 + drive ].image : NULL );
+	}
+
+	int drives( int port )
+	{
+		return( port >= ports ? 0 : !!slots[ port * 2 ].image + !!slots[ port * 2 + 1 ].image );
+	}
+
+	//
+	// Every image behind a drive, and anything else using the same image, is replaced with 'to'
+	//
+	void replace( Image *from, Image *to )
+	{
+		for( int t = 0; t < ports * 2; t++ )
+			if( slots[t].image == from )
+				slots[t].image = to;
+	}
+
+	//
+	// Number of drives the image is behind
+	//
+	int uses( Image *image )
+	{
+		int n = 0;
+
+		for( int t = 0; t < ports * 2; t++ )
+			n += slots[t].image == image;
+
+		return( n );
+	}
+
+	//
+	// Returns the worker of another drive with the same image, if there is one yet
+	//
+	DriveWorker *findWorker( Image *image )
+	{
+		for( int t = 0; t < ports * 2; t++ )
+			if( slots[t].image == image && slots[t].worker )
+				return( slots[t].worker );
+
+		return( NULL );
+	}
+
+	int ports;
+
+private:
+	struct driveSlot *slots;
+};
+
+//
+// Protocol state for one serial connection.  Characters are read into receiveBuffer(), at most
+// receiveLength() at a time, and then handed to received().  Each connection has its own state,
+// so one process can serve several serial ports.
+//
+// When the drives have workers, received() and resume() return PROCESS_WAITING while a read or
+// write is with a worker.  No more characters are to be handed over until resume() has been called
+// after the job is done, and has returned something else.
+//
+#define PROCESS_WAITING 2
+
+class ProcessState
+{
+public:
+	ProcessState( SerialAccess *p_serial, DriveTable *p_drives, int p_port, const struct processTimeouts *p_timeouts,
+				  int p_verboseLevel, struct processStats *p_stats = NULL );
+
+	unsigned char *receiveBuffer( void ) { return( &rx[0] ); }
+	unsigned long receiveLength( void ) { return( sizeof(rx) ); }
+
+	int received( unsigned long len );
+
+	//
+	// Carries on once the job being waited for is done, returns PROCESS_WAITING if it isn't yet
+	//
+	int resume( void );
+
+	int waiting( void ) { return( parked != 0 ); }
+
+	//
+	// The time (see GetTime_Microseconds) by which more characters are due from the client, or 0
+	// if none are, and what to do once it has passed without them: forget the partial command
+	//
+	unsigned long long deadline( void );
+	void timedOut( void );
+
+	//
+	// How long sending may wait on a client that isn't reading, beyond the time the characters
+	// take on the wire, before the connection is given up on
+	//
+	unsigned long long writeAllowance( void );
+
+	//
+	// Forgets any command in progress, for a new connection on the same port
+	//
+	void reset( void );
+
+	//
+	// Before the image behind a drive is changed: returns 1 while a command on 'image' is in
+	// progress, otherwise lets go of the image.  abandon() gives up on the command instead.
+	//
+	int release( Image *image );
+	void abandon( void );
+
+	SerialAccess *serial;
+	DriveTable *drives;
+	int port;
+	struct processStats *stats;
+
+private:
+	struct processTimeouts timeouts;
+	int verboseLevel;
+
+	union processBuffer buff;
+
+	//
+	// Characters are read in as large blocks as the serial port will give us, and split into
+	// frames by received().  Everything read is consumed before the next read, though this may
+	// be put off while waiting on a worker.
+	//
+	unsigned char rx[ RECEIVE_BUFFER ];
+	unsigned char *rxNext;
+	unsigned long rxLength;
+
+	int frameInput( void );
+	int processFrame( void );
+	void resync( int from, int length );
+
+	struct sendSegment sendQueue[ SEND_SEGMENTS ];
+	int sendCount;
+
+	int sendQueued( void );
+	unsigned long long wireTime( unsigned long characters );
+
+	unsigned char workCommand;
+	int workOffset, workCount;
+
+	unsigned long mylba;
+	unsigned long readto;
+	unsigned long buffoffset;
+	unsigned long long lastInput;         // when characters were last received
+	unsigned long long wireFree;          // when what has been sent will be through the serial line
+	Image *img;
+	DriveWorker *worker;
+	int drive;
+	unsigned long cyl, sect, head;
+	unsigned long perfTimer;
+	unsigned char lastScan;
+
+	struct readAheadFrame readAhead[ READAHEAD_FRAMES ];
+	int readAheadHead, readAheadCount;
+	unsigned long readAheadLba, readAheadRemaining;
+
+	void readAheadReset( unsigned long lba, unsigned long count );
+	void readAheadFill( int maxFrames );
+	struct readAheadFrame *readAheadNext( void );
+
+	//
+	// Jobs with the worker: the read filling frames after the read-ahead ones, and a write
+	//
+	struct driveJob readJob, writeJob;
+	DriveWorker *readWorker;
+	int parked;                           // PARKED_READ or PARKED_WRITE, waiting on the job
+
+	void readJobDone( void );
+	void drainJobs( void );
+
+	int writeDone( void );
+	int sendNext( void );
+
+	void logBuff( const char *message, unsigned char *b, unsigned long buffoffset, unsigned long readto );
+
+	//
+	// Time spent on the current command, in microseconds, see Stats.h
+	//
+	unsigned long long commandStart, waitStart;
+	unsigned long long phaseTime[ STATS_PHASES ];
+
+	void commandDone( void );
+};
+
+void processRequests( SerialAccess *serial, Image *image0, Image *image1, const struct processTimeouts *timeouts, int verboseLevel,
+					  struct processStats *stats = NULL );
+
+void processRequests( SerialAccess *serial, DriveTable *drives, int port, const struct processTimeouts *timeouts, int verboseLevel,
+					  struct processStats *stats = NULL );
 
 #endif
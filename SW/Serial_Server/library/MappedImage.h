@@ -0,0 +1,123 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        MappedImage.h - Flat disk image accessed through a memory mapping
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// Same file format as FlatImage, but the whole image is mapped into memory when it is opened.
+// Reads hand out pointers straight into the mapping (see Image::mapSector), so a sector is checksummed
+// and transmitted without a system call or a copy.  Writes are copied into the mapping in place.
+//
+// The size of the image is fixed at open time.  If the mapping can't be made (for example, an image
+// larger than the address space of a 32-bit host), FlatImage's read/write access is used instead.
+//
+// syncEvery controls when written sectors are flushed to the file:
+//     0     left to the kernel, plus a full flush when the image is closed
+//     1     each written sector is flushed synchronously before the write is acknowledged
+//     n     the whole mapping is scheduled for an asynchronous flush every n sector writes
+//
+
+#ifndef MAPPEDIMAGE_H_INCLUDED
+#define MAPPEDIMAGE_H_INCLUDED
+
+#include "FlatImage.h"
+
+class MappedImage : public FlatImage
+{
+private:
+	unsigned char *map;
+	unsigned long syncEvery;
+	unsigned long unsynced;
+
+public:
+	MappedImage( char *name, int p_readOnly, int p_drive, int p_create, unsigned long p_cyl, unsigned long p_head, unsigned long p_sect, int p_useCHS, unsigned long p_syncEvery )   :   FlatImage( name, p_readOnly, p_drive, p_create, p_cyl, p_head, p_sect, p_useCHS )
+	{
+		unsynced = 0;
+		syncEvery = p_syncEvery;
+
+		map = (unsigned char *) fp.Map( totallba, readOnly );
+
+		if( map )
+			log( 1, "%s: Memory mapped, %s", shortFileName,
+				 syncEvery == 0 ? "flushed by the kernel" : syncEvery == 1 ? "flushed on every write" : "flushed periodically" );
+	}
+
+	~MappedImage()
+	{
+		fp.Unmap();
+	}
+
+	unsigned short *mapSector( unsigned long p_lba )
+	{
+		return( map && p_lba < totallba ? (unsigned short *) &map[ ((size_t) p_lba) << 9 ] : NULL );
+	}
+
+	void readSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		if( !map )
+		{
+			FlatImage::readSectors( lba, count, buff );
+			return;
+		}
+
+		if( lba >= totallba || count > totallba - lba )
+			log( -1, "'%s', Failed to read beyond lba=%lu", shortFileName, totallba );
+
+		memcpy( buff, &map[ ((size_t) lba) << 9 ], ((size_t) count) << 9 );
+	}
+
+	void writeSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		if( !map )
+		{
+			FlatImage::writeSectors( lba, count, buff );
+			return;
+		}
+
+		if( lba >= totallba || count > totallba - lba )
+			log( -1, "'%s', Failed to write beyond lba=%lu", shortFileName, totallba );
+
+		memcpy( &map[ ((size_t) lba) << 9 ], buff, ((size_t) count) << 9 );
+
+		if( syncEvery == 1 )
+			fp.Sync( lba << 9, count << 9, 1 );
+		else if( syncEvery && __sync_add_and_fetch( &unsynced, count ) >= syncEvery )
+		{
+			unsynced = 0;
+			fp.Sync( 0, 0, 0 );
+		}
+	}
+
+	int readSectorsVector( unsigned long lba, unsigned short *buffs[], int count )
+	{
+		return( map ? 0 : FlatImage::readSectorsVector( lba, buffs, count ) );
+	}
+
+	void flush( void )
+	{
+		if( !map )
+			FlatImage::flush();
+		else
+			fp.Sync( 0, 0, 1 );
+	}
+};
+
+#endif
@@ -0,0 +1,90 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        Mutex.h - Locks and conditions for data shared between threads
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+#ifndef MUTEX_H_INCLUDED
+#define MUTEX_H_INCLUDED
+
+#ifdef WIN32
+#include <windows.h>
+
+class Mutex
+{
+	friend class Condition;
+
+public:
+	Mutex() { InitializeCriticalSection( &cs ); }
+	~Mutex() { DeleteCriticalSection( &cs ); }
+
+	void lock( void ) { EnterCriticalSection( &cs ); }
+	void unlock( void ) { LeaveCriticalSection( &cs ); }
+
+private:
+	CRITICAL_SECTION cs;
+};
+
+class Condition
+{
+public:
+	Condition() { InitializeConditionVariable( &cv ); }
+
+	void wait( Mutex &m ) { SleepConditionVariableCS( &cv, &m.cs, INFINITE ); }
+	void signal( void ) { WakeConditionVariable( &cv ); }
+	void broadcast( void ) { WakeAllConditionVariable( &cv ); }
+
+private:
+	CONDITION_VARIABLE cv;
+};
+#else
+#include <pthread.h>
+
+class Mutex
+{
+	friend class Condition;
+
+public:
+	Mutex() { pthread_mutex_init( &m, NULL ); }
+	~Mutex() { pthread_mutex_destroy( &m ); }
+
+	void lock( void ) { pthread_mutex_lock( &m ); }
+	void unlock( void ) { pthread_mutex_unlock( &m ); }
+
+private:
+	pthread_mutex_t m;
+};
+
+class Condition
+{
+public:
+	Condition() { pthread_cond_init( &c, NULL ); }
+	~Condition() { pthread_cond_destroy( &c ); }
+
+	void wait( Mutex &m ) { pthread_cond_wait( &c, &m.m ); }
+	void signal( void ) { pthread_cond_signal( &c ); }
+	void broadcast( void ) { pthread_cond_broadcast( &c ); }
+
+private:
+	pthread_cond_t c;
+};
+#endif
+
+#endif
@@ -0,0 +1,220 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        OverlayImage.h - Copy-on-write overlay over a read-only base image
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// The base image is a flat image that is only ever opened for reading, so that it can be shared
+// between many servers.  Sectors written by the client are stored in a delta file, and read back
+// from there from then on.  Deleting the delta file discards all writes.
+//
+// Delta file layout, in 512-byte sectors:
+//
+//     0                      header (struct overlayHeader)
+//     1 .. indexSectors      sector index, one 32-bit entry per base image sector: 0 if the sector
+//                            has not been written, otherwise the slot number of its data plus one
+//     dataStart ..           data slots, in the order sectors were first written
+//
+// The index is created as a sparse hole.  Index sectors are only read into memory when a sector
+// they cover is first accessed, so memory use follows the part of the image in use.
+//
+
+#ifndef OVERLAYIMAGE_H_INCLUDED
+#define OVERLAYIMAGE_H_INCLUDED
+
+#include "Library.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define OVERLAY_MAGIC "SerDriveOverlay"
+#define OVERLAY_VERSION 1
+#define OVERLAY_ENTRIES_PER_SECTOR 128
+
+struct overlayHeader {
+	char magic[16];
+	unsigned int version;
+	unsigned int totallba;
+	unsigned int indexSectors;
+	unsigned int dataStart;
+};
+
+class OverlayImage : public Image
+{
+private:
+	class FileAccess base;
+	class FileAccess delta;
+
+	unsigned int **index;
+	unsigned long indexSectors;
+	unsigned long dataStart;
+	unsigned long slots;
+
+	Mutex lock;                         // the index, and appending slots
+
+	unsigned int *indexSector( unsigned long p_lba )
+	{
+		unsigned long i = p_lba / OVERLAY_ENTRIES_PER_SECTOR;
+
+		if( p_lba >= totallba )
+			log( -1, "'%s', Failed to seek to lba=%lu", shortFileName, p_lba );
+
+		if( !index[i] )
+		{
+			if( !(index[i] = (unsigned int *) malloc( 512 )) )
+				log( -1, "'%s', out of memory for overlay index", shortFileName );
+
+			delta.ReadAt( index[i], 1 + i, 1 );
+		}
+
+		return( index[i] );
+	}
+
+public:
+	OverlayImage( char *name, char *deltaName, int p_readOnly, int p_drive, unsigned long p_cyl, unsigned long p_head, unsigned long p_sect, int p_useCHS )   :   Image( name, p_readOnly, p_drive, 0, p_cyl, p_head, p_sect, p_useCHS )
+	{
+		unsigned char sector[512];
+		struct overlayHeader *h = (struct overlayHeader *) &sector[0];
+		FILE *exists;
+
+		base.Open( name, 1 );
+		totallba = base.SizeSectors();
+
+		indexSectors = (totallba + OVERLAY_ENTRIES_PER_SECTOR - 1) / OVERLAY_ENTRIES_PER_SECTOR;
+		dataStart = 1 + indexSectors;
+
+		if( (exists = fopen( deltaName, "rb" )) )
+		{
+			fclose( exists );
+
+			delta.Open( deltaName );
+			delta.SeekSectors( 0 );
+			delta.Read( &sector[0], 512 );
+
+			if( memcmp( h->magic, OVERLAY_MAGIC, sizeof(h->magic) ) || h->version != OVERLAY_VERSION )
+				log( -1, "'%s', not a SerDrive overlay file", deltaName );
+
+			if( h->totallba != totallba || h->indexSectors != indexSectors || h->dataStart != dataStart )
+				log( -1, "'%s', overlay was not created for base image '%s'", deltaName, name );
+
+			slots = delta.SizeSectors() - dataStart;
+
+			log( 0, "%s: Using overlay '%s', %lu sectors written", name, deltaName, slots );
+		}
+		else
+		{
+			if( !delta.Create( deltaName ) )
+				log( -1, "'%s', could not create overlay file", deltaName );
+
+			memset( &sector[0], 0, 512 );
+			memcpy( h->magic, OVERLAY_MAGIC, sizeof(h->magic) );
+			h->version = OVERLAY_VERSION;
+			h->totallba = totallba;
+			h->indexSectors = indexSectors;
+			h->dataStart = dataStart;
+
+			delta.Write( &sector[0], 512 );
+			delta.SetSizeSectors( dataStart );
+			delta.Close();
+
+			delta.Open( deltaName );
+			slots = 0;
+
+			log( 0, "%s: Created overlay '%s'", name, deltaName );
+		}
+
+		if( !(index = (unsigned int **) calloc( indexSectors, sizeof(unsigned int *) )) )
+			log( -1, "'%s', out of memory for overlay index", deltaName );
+
+		init( name, p_readOnly, p_drive, p_cyl, p_head, p_sect, p_useCHS );
+	}
+
+	~OverlayImage()
+	{
+		for( unsigned long t = 0; t < indexSectors; t++ )
+			free( index[t] );
+		free( index );
+
+		delta.Close();
+		base.Close();
+	}
+
+	void writeSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		lock.lock();
+
+		for( ; count; count--, lba++, buff = (char *) buff + 512 )
+		{
+			unsigned int *entries = indexSector( lba );
+			unsigned int *entry = &entries[ lba % OVERLAY_ENTRIES_PER_SECTOR ];
+
+			if( *entry )
+				delta.WriteAt( buff, dataStart + *entry - 1, 1 );
+			else
+			{
+				//
+				// First write to this sector, append a new slot and only then point the index at it
+				//
+				delta.WriteAt( buff, dataStart + slots, 1 );
+
+				*entry = ++slots;
+				delta.WriteAt( entries, 1 + lba / OVERLAY_ENTRIES_PER_SECTOR, 1 );
+			}
+		}
+
+		lock.unlock();
+	}
+
+	void readSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		unsigned int slot;
+		unsigned long run;
+
+		while( count )
+		{
+			//
+			// Sectors not in the overlay are read from the base image a run at a time
+			//
+			lock.lock();
+			for( run = 0; run < count && !(slot = indexSector( lba + run )[ (lba + run) % OVERLAY_ENTRIES_PER_SECTOR ]); run++ ) ;
+			lock.unlock();
+
+			if( !run )
+			{
+				delta.ReadAt( buff, dataStart + slot - 1, 1 );
+				run = 1;
+			}
+			else
+				base.ReadAt( buff, lba, run );
+
+			lba += run;
+			count -= run;
+			buff = (char *) buff + run * 512;
+		}
+	}
+
+	void flush( void )
+	{
+		delta.Flush();
+	}
+};
+
+#endif
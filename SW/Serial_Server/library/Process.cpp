@@ -26,41 +26,6 @@
 #include <string.h>
 #include <stdio.h>
 
-union _buff {
-	struct {
-		unsigned char command;
-		unsigned char driveAndHead;
-		unsigned char count;
-		unsigned char sector;
-		unsigned short cylinder;
-	} chs;
-	struct {
-		unsigned char command;
-		unsigned char bits24;
-		unsigned char count;
-		unsigned char bits00;
-		unsigned char bits08;
-		unsigned char bits16;
-	} lba;
-	struct {
-		unsigned char command;
-		unsigned char driveAndHead;
-		unsigned char count;
-		unsigned char scan;
-		unsigned char port;
-		unsigned char baud;
-	} inquire;
-	struct {
-		unsigned char command;
-		unsigned char driveAndHead;
-		unsigned char count;
-		unsigned char scan;
-		unsigned short PackedPortAndBaud;
-	} inquirePacked;
-	unsigned char b[514];
-	unsigned short w[257];
-} buff;
-
 #define SERIAL_COMMAND_HEADER 0xa0
 
 #define SERIAL_COMMAND_WRITE 1
@@ -76,9 +41,207 @@ union _buff {
 
 #define ATA_DriveAndHead_Drive 0x10
 
-void logBuff( const char *message, unsigned long buffoffset, unsigned long readto, int verboseLevel )
+#define PARKED_READ 1
+#define PARKED_WRITE 2
+
+//
+// Defaults for the timeouts, see processTimeouts in Library.h.  The client sends its header and
+// sectors in tight loops, so little more than the wire time is needed for those.  The ACK follows
+// the client checking the sector it has just received.
+//
+const struct processTimeouts processTimeoutsDefault = { { 50000, 100000, 250000 } };
+
+static const char *timeoutNames[ TIMEOUT_PHASES ] = { "command header", "sector", "continuation ACK" };
+
+static int timeoutPhase( unsigned long readto )
+{
+	return( readto == 8 ? TIMEOUT_HEADER : readto == 514 ? TIMEOUT_PAYLOAD : TIMEOUT_ACK );
+}
+
+//
+// Carries out a job for a connection, see driveJob in Library.h
+//
+void runDriveJob( struct driveJob *job )
+{
+	struct readAheadFrame *f;
+	unsigned long long t0, t1;
+	unsigned short *buffs[ READAHEAD_FRAMES ];
+	int n;
+
+	job->diskTime = job->checksumTime = 0;
+
+	if( job->type == DRIVEJOB_WRITE )
+	{
+		t0 = GetTime_Microseconds();
+		job->image->writeSectorChecksum( job->lba, job->data, job->crc );
+		job->diskTime = GetTime_Microseconds() - t0;
+		return;
+	}
+
+	for( int t = 0; t < job->count; t += n )
+	{
+		f = job->frames[t];
+		n = 1;
+
+		t0 = GetTime_Microseconds();
+		if( (f->data = job->image->mapSector( job->lba + t )) )
+		{
+			t1 = t0;
+			f->w[256] = checksum( f->data, 256 );
+		}
+		else
+		{
+			//
+			// Images that support it read the rest of the frames in one go
+			//
+			for( n = 0; n < job->count - t; n++ )
+				buffs[n] = &job->frames[t+n]->w[0];
+
+			if( n > 1 && job->image->readSectorsVector( job->lba + t, buffs, n ) )
+			{
+				t1 = GetTime_Microseconds();
+
+				for( int i = 0; i < n; i++ )
+				{
+					f = job->frames[t+i];
+					f->data = &f->w[0];
+					f->w[256] = checksum( &f->w[0], 256 );
+				}
+			}
+			else
+			{
+				n = 1;
+				if( job->image->readSectorChecksum( job->lba + t, &f->w[0], &f->w[256] ) )
+					t1 = GetTime_Microseconds();
+				else
+				{
+					t1 = GetTime_Microseconds();
+					f->w[256] = checksum( &f->w[0], 256 );
+				}
+				f->data = &f->w[0];
+			}
+		}
+		job->diskTime += t1 - t0;
+		job->checksumTime += GetTime_Microseconds() - t1;
+	}
+}
+
+void ProcessState::readAheadReset( unsigned long lba, unsigned long count )
+{
+	//
+	// The frames of an earlier read may still be being filled
+	//
+	if( readWorker )
+	{
+		readWorker->wait( &readJob );
+		readWorker = NULL;
+	}
+
+	readAheadHead = readAheadCount = 0;
+	readAheadLba = lba;
+	readAheadRemaining = count;
+}
+
+void ProcessState::readJobDone( void )
 {
-	char logBuff[ 514*9 + 10 ];
+	readAheadCount += readJob.count;
+	phaseTime[STATS_DISK] += readJob.diskTime;
+	phaseTime[STATS_CHECKSUM] += readJob.checksumTime;
+	readWorker = NULL;
+}
+
+//
+// Reads the following sectors of the command into the free frames of the ring, up to 'maxFrames'
+// ready.  With a worker, they are only ready once it has done the job, and until then the ring
+// is left as it is.  Must not be called with frames waiting in sendQueue.
+//
+void ProcessState::readAheadFill( int maxFrames )
+{
+	int n;
+
+	if( readWorker )
+	{
+		if( readWorker->busy( &readJob ) )
+			return;
+		readJobDone();
+	}
+
+	if( readAheadCount >= maxFrames || !readAheadRemaining )
+		return;
+
+	n = maxFrames - readAheadCount;
+	if( (unsigned long) n > readAheadRemaining )
+		n = readAheadRemaining;
+
+	readJob.type = DRIVEJOB_READ;
+	readJob.image = img;
+	readJob.lba = readAheadLba;
+	readJob.count = n;
+	for( int t = 0; t < n; t++ )
+		readJob.frames[t] = &readAhead[ (readAheadHead + readAheadCount + t) % READAHEAD_FRAMES ];
+
+	readAheadLba += n;
+	readAheadRemaining -= n;
+
+	if( worker )
+	{
+		readWorker = worker;
+		worker->submit( &readJob );
+	}
+	else
+	{
+		runDriveJob( &readJob );
+		readJobDone();
+	}
+}
+
+//
+// Returns NULL if the next frame is still with the worker
+//
+struct readAheadFrame *ProcessState::readAheadNext( void )
+{
+	struct readAheadFrame *f;
+
+	if( !readAheadCount )
+		readAheadFill( 1 );
+
+	if( !readAheadCount )
+		return( NULL );
+
+	f = &readAhead[ readAheadHead ];
+	readAheadHead = (readAheadHead + 1) % READAHEAD_FRAMES;
+	readAheadCount--;
+
+	return( f );
+}
+
+//
+// Waits for any jobs with a worker, before the frames and buffer they use are reused
+//
+void ProcessState::drainJobs( void )
+{
+	if( readWorker )
+	{
+		readWorker->wait( &readJob );
+		readWorker = NULL;
+	}
+
+	if( parked == PARKED_WRITE )
+		worker->wait( &writeJob );
+
+	parked = 0;
+}
+
+//
+// Each byte is shown as "[offset:hex] ", formatted by hand as this runs for every frame at the
+// higher reporting levels.  For an exact record of the bytes on the wire, use a trace instead
+// (-x on Linux).
+//
+void ProcessState::logBuff( const char *message, unsigned char *b, unsigned long buffoffset, unsigned long readto )
+{
+	static const char hex[] = "0123456789abcdef";
+	char logBuffer[ 514*9 + 10 ];
+	char *o;
 	int logCount;
 
 	if( verboseLevel == 5 || (verboseLevel >= 3 && buffoffset == readto) )
@@ -89,316 +252,689 @@ void logBuff( const char *message, unsigned long buffoffset, unsigned long readt
 			logCount = buffoffset;
 
 		for( int t = 0; t < logCount; t++ )
-			sprintf( &logBuff[t*9], "[%3d:%02x] ", t, buff.b[t] );
+		{
+			o = &logBuffer[t*9];
+			o[0] = '[';
+			o[1] = t >= 100 ? '0' + t / 100 : ' ';
+			o[2] = t >= 10 ? '0' + (t / 10) % 10 : ' ';
+			o[3] = '0' + t % 10;
+			o[4] = ':';
+			o[5] = hex[ b[t] >> 4 ];
+			o[6] = hex[ b[t] & 0xf ];
+			o[7] = ']';
+			o[8] = ' ';
+		}
+		logBuffer[logCount*9] = 0;
 		if( logCount != buffoffset )
-			sprintf( &logBuff[logCount*9], "... " );
+			strcpy( &logBuffer[logCount*9], "... " );
 
-		log( 3, "%s%s", message, logBuff );
+		log( 3, "%s%s", message, logBuffer );
 	}
 }
 
-void processRequests( SerialAccess *serial, Image *image0, Image *image1, int timeoutEnabled, int verboseLevel )
+ProcessState::ProcessState( SerialAccess *p_serial, DriveTable *p_drives, int p_port, const struct processTimeouts *p_timeouts,
+							int p_verboseLevel, struct processStats *p_stats )
 {
-	unsigned char workCommand;
-	int workOffset, workCount;
-
-	unsigned long mylba;
-	unsigned long readto;
-	unsigned long buffoffset;
-	unsigned long lasttick;
-	unsigned short crc;
-	unsigned long GetTime_Timeout_Local;
-	unsigned long len;
-	Image *img;
-	unsigned long cyl, sect, head;
-	unsigned long perfTimer;
-	unsigned char lastScan;
+	serial = p_serial;
+	drives = p_drives;
+	port = p_port;
+	timeouts = *p_timeouts;
+	verboseLevel = p_verboseLevel;
+	stats = p_stats;
+
+	img = NULL;
+	worker = readWorker = NULL;
+	drive = 0;
+	parked = 0;
+	perfTimer = 0;
+
+	reset();
+	FileAccess::RegisterBuffer( readAhead, sizeof(readAhead) );
+}
 
-	GetTime_Timeout_Local = GetTime_Timeout();
+void ProcessState::reset( void )
+{
+	drainJobs();
 
 	buffoffset = 0;
 	readto = 0;
 	workCount = workOffset = workCommand = 0;
 	lastScan = 0;
 
-	//
-	// Floppy disks must come after any hard disks
-	//
-	if( (image0 && image0->floppy) && (image1 && !image1->floppy) )
+	readAheadReset( 0, 0 );
+
+	commandStart = waitStart = 0;
+	rxLength = 0;
+	sendCount = 0;
+	lastInput = wireFree = 0;
+	memset( phaseTime, 0, sizeof(phaseTime) );
+}
+
+int ProcessState::release( Image *image )
+{
+	if( img != image )
+		return( 0 );
+
+	if( workCount || parked )
+		return( 1 );
+
+	drainJobs();                          // a read left behind by a Continue Fault
+
+	img = NULL;
+	worker = NULL;
+
+	return( 0 );
+}
+
+void ProcessState::abandon( void )
+{
+	log( 0, "'%s', command abandoned for a change of image", serial->deviceName );
+
+	reset();
+
+	img = NULL;
+	worker = NULL;
+}
+
+//
+// Called as the last sector of a command goes out, or the inquire response has been sent
+//
+void ProcessState::commandDone( void )
+{
+	int c;
+	unsigned long long now;
+	struct driveSlot *slot;
+
+	if( workOffset > 100 && logging( 1 ) )
+		log( 1, "    Performance: %.2lf bytes per second", (512.0 * workOffset) / (GetTime() - perfTimer) * 1000.0 );
+
+	c = workCommand == SERIAL_COMMAND_INQUIRE ? STATS_INQUIRE :
+		(workCommand & SERIAL_COMMAND_WRITE) ? STATS_WRITE : STATS_READ;
+
+	if( (slot = drives->slot( port, drive )) )
 	{
-		img = image0;
-		image0 = image1;
-		image1 = img;
+		slot->commands[c]++;
+		slot->sectors[c] += workOffset;
 	}
 
-	lasttick = GetTime();
+	if( !stats )
+		return;
 
-	while( (len = serial->readCharacters( &buff.b[buffoffset], (readto ? readto-buffoffset : 1) )) )
-	{
-		buffoffset += len;
+	now = GetTime_Microseconds();
 
-		//
-		// For debugging, look at the incoming packet
-		//
-		if( verboseLevel >= 3 )
-			logBuff( "    Received: ", buffoffset, readto, verboseLevel );
+	phaseTime[STATS_TOTAL] = now - commandStart;
+	for( int p = 0; p < STATS_PHASES; p++ )
+		histogramAdd( &stats->latency[c][p], phaseTime[p] );
+	stats->sectors[c] += workOffset;
+}
 
-		if( timeoutEnabled && readto && GetTime() > lasttick + GetTime_Timeout_Local )
-		{
-			log( 1, "Timeout waiting on data from client, aborting previous command" );
+//
+// Processes 'len' characters that have just been read into receiveBuffer().  Returns 0 if the
+// connection should be dropped, because a response could not be written.
+//
+int ProcessState::received( unsigned long len )
+{
+	lastInput = GetTime_Microseconds();
 
-			workCount = workOffset = workCommand = 0;
-			readto = 0;
+	rxNext = &rx[0];
+	rxLength = len;
 
-			if( len <= 8 && (buff.b[buffoffset-len] & SERIAL_COMMAND_HEADERMASK) == SERIAL_COMMAND_HEADER )
-			{
-				// assume that we are at the front of a new command
-				//
-				memcpy( &buff.b[0], &buff.b[buffoffset-len], len );
-				buffoffset = len;
-				readto = 8;
-				// fall through to normal processing
-			}
-			else if( len == 1 )
-			{
-				// one new character, treat it like any other new character received, discarding the buffer
-				//
-				buff.b[0] = buff.b[buffoffset-1];
-				buffoffset = 1;
-				// fall through to normal processing
-			}
-			else
-			{
-				// discard even the newly received data and start listening anew
-				//
-				buffoffset = 0;
-				continue;
-			}
-		}
+	return( frameInput() );
+}
+
+//
+// Microseconds for 'characters' to go over the serial line, at 10 bits each (8N1)
+//
+unsigned long long ProcessState::wireTime( unsigned long characters )
+{
+	if( !serial->baudRate || !serial->baudRate->rate )
+		return( 0 );
 
-		lasttick = GetTime();
+	return( characters * 10000000ULL / serial->baudRate->rate );
+}
+
+//
+// Counted from the last characters received, or from when the characters sent since will have
+// gone out, whichever is later.  Nothing is due while waiting on a worker, or between commands.
+//
+unsigned long long ProcessState::deadline( void )
+{
+	unsigned long long from;
+	int phase;
+
+	if( !readto || parked )
+		return( 0 );
+
+	phase = timeoutPhase( readto );
+	if( !timeouts.allowance[phase] )
+		return( 0 );
+
+	from = wireFree > lastInput ? wireFree : lastInput;
+
+	return( from + wireTime( readto - buffoffset ) + timeouts.allowance[phase] );
+}
+
+//
+// The continuation ACK allowance, as the client is reading a sector while it is sent.  Even with
+// timeouts turned off there is a limit, so that one client can't hold up a server's other ports.
+//
+unsigned long long ProcessState::writeAllowance( void )
+{
+	if( timeouts.allowance[TIMEOUT_ACK] )
+		return( timeouts.allowance[TIMEOUT_ACK] );
+
+	return( processTimeoutsDefault.allowance[TIMEOUT_ACK] );
+}
+
+void ProcessState::timedOut( void )
+{
+	log( 1, "Timeout waiting on the %s from client, aborting command", timeoutNames[ timeoutPhase( readto ) ] );
+	if( stats )
+		stats->timeouts++;
+
+	//
+	// Discard the partial frame and anything still queued for the client, the next characters
+	// are scanned for a command header
+	//
+	sendCount = 0;
+	workCount = workOffset = workCommand = 0;
+	buffoffset = readto = 0;
+}
+
+//
+// Carries on from where the connection was left waiting on a worker
+//
+int ProcessState::resume( void )
+{
+	int r;
+
+	if( parked == PARKED_READ )
+	{
+		if( readWorker && readWorker->busy( &readJob ) )
+			return( PROCESS_WAITING );
+		parked = 0;
+		r = sendNext();
+	}
+	else if( parked == PARKED_WRITE )
+	{
+		if( worker->busy( &writeJob ) )
+			return( PROCESS_WAITING );
+		parked = 0;
+		r = writeDone();
+	}
+	else
+		return( 1 );
+
+	if( r != 1 )
+		return( r );
+
+	return( frameInput() );
+}
+
+//
+// The characters are split into frames here: command headers, sectors for Write Sector, and
+// continuation ACKs, each gathered in buff and handed to processFrame() once complete.  While no
+// command is in progress, everything up to the next command header byte is skipped in one go.
+//
+int ProcessState::frameInput( void )
+{
+	unsigned long n;
+	int r;
 
+	while( rxLength )
+	{
 		//
-		// No work currently to do, look at each character as they come in...
+		// No work currently to do, look for our command header byte to start a command sequence
 		//
 		if( !readto )
 		{
-			if( (buff.b[0] & SERIAL_COMMAND_HEADERMASK) == SERIAL_COMMAND_HEADER )
-			{
-				//
-				// Found our command header byte to start a commnad sequence, read the next 7 and evaluate
-				//
-				readto = 8;
-				continue;
-			}
-			else
+			for( n = 0; n < rxLength && (rxNext[n] & SERIAL_COMMAND_HEADERMASK) != SERIAL_COMMAND_HEADER; n++ )
 			{
 				//
 				// Spurious characters, discard
 				//
+				if( stats )
+					stats->spurious++;
 				if( verboseLevel >= 2 )
 				{
-					if( buff.b[0] >= 0x20 && buff.b[0] <= 0x7e )
-						log( 2, "Spurious: [%d:%c]", buff.b[0], buff.b[0] );
+					if( rxNext[n] >= 0x20 && rxNext[n] <= 0x7e )
+						log( 2, "Spurious: [%d:%c]", rxNext[n], rxNext[n] );
 					else
-						log( 2, "Spurious: [%d]", buff.b[0] );
+						log( 2, "Spurious: [%d]", rxNext[n] );
 				}
-				buffoffset = 0;
-				continue;
 			}
+
+			rxNext += n;
+			rxLength -= n;
+			if( !rxLength )
+				break;
+
+			buffoffset = 0;
+			readto = 8;
+			commandStart = GetTime_Microseconds();
+			memset( phaseTime, 0, sizeof(phaseTime) );
 		}
 
+		n = readto - buffoffset;
+		if( n > rxLength )
+			n = rxLength;
+
+		memcpy( &buff.b[buffoffset], rxNext, n );
+		buffoffset += n;
+		rxNext += n;
+		rxLength -= n;
+
 		//
-		// Partial packet received, keep reading...
+		// For debugging, look at the incoming packet
 		//
-		if( readto && buffoffset < readto )
-			continue;
+		if( verboseLevel >= 3 )
+			logBuff( "    Received: ", &buff.b[0], buffoffset, readto );
+
+		if( buffoffset == readto && (r = processFrame()) != 1 )
+			return( r );
+	}
+
+	return( 1 );
+}
+
+//
+// A frame of 'length' characters in buff wasn't what was expected, such as a command header
+// spoiled by line noise, or a new command where a continuation ACK should have been.  Rather
+// than throwing the frame away, a command header is looked for in it from 'from' on.
+//
+void ProcessState::resync( int from, int length )
+{
+	int n;
+
+	for( n = from; n < length && (buff.b[n] & SERIAL_COMMAND_HEADERMASK) != SERIAL_COMMAND_HEADER; n++ )
+		;
+
+	if( n == length )
+		return;
+
+	memmove( &buff.b[0], &buff.b[n], length - n );
+	buffoffset = length - n;
+	readto = 8;
+	commandStart = GetTime_Microseconds();
+	memset( phaseTime, 0, sizeof(phaseTime) );
+}
+
+//
+// Sends the frames that have been queued up
+//
+int ProcessState::sendQueued( void )
+{
+	unsigned long long t0;
+	unsigned long characters = 0;
+
+	if( !sendCount )
+		return( 1 );
+
+	t0 = GetTime_Microseconds();
+
+	if( !serial->writeSegments( sendQueue, sendCount ) )
+		return( 0 );
+
+	phaseTime[STATS_WIRE] += GetTime_Microseconds() - t0;
+
+	//
+	// The serial port takes the characters well before they are all out on the line, which is
+	// when the client can start on its reply
+	//
+	for( int t = 0; t < sendCount; t++ )
+		characters += sendQueue[t].len;
+	wireFree = (wireFree > t0 ? wireFree : t0) + wireTime( characters );
+
+	sendCount = 0;
+
+	return( 1 );
+}
+
+//
+// A complete frame of 'readto' characters is in buff
+//
+int ProcessState::processFrame( void )
+{
+	unsigned short crc;
+	unsigned long long t0;
+	struct driveSlot *slot;
+
+	//
+	// Read 512 bytes from serial port, only one command reads that many characters: Write Sector
+	//
+	if( buffoffset == readto && readto == 514 )
+	{
+		buffoffset = readto = 0;
+
+		t0 = GetTime_Microseconds();
+		phaseTime[STATS_ACK] += t0 - waitStart;
+
+		crc = checksum( &buff.w[0], 256 );
+
+		phaseTime[STATS_CHECKSUM] += GetTime_Microseconds() - t0;
+
+		if( crc != buff.w[256] )
+		{
+			log( 0, "Bad Write Sector Checksum" );
+			if( stats )
+				stats->checksumFailures++;
+			return( 1 );
+		}
+
+		if( img->readOnly )
+		{
+			log( 1, "Attempt to write to read-only image" );
+			return( 1 );
+		}
+
+		writeJob.type = DRIVEJOB_WRITE;
+		writeJob.image = img;
+		writeJob.lba = mylba + workOffset;
+		writeJob.count = 1;
+		writeJob.data = &buff.w[0];
+		writeJob.crc = crc;
 
 		//
-		// Read 512 bytes from serial port, only one command reads that many characters: Write Sector
+		// No more is read into buff until the worker is done with it
 		//
-		if( buffoffset == readto && readto == 514 )
+		if( worker )
+		{
+			worker->submit( &writeJob );
+			parked = PARKED_WRITE;
+			return( PROCESS_WAITING );
+		}
+
+		runDriveJob( &writeJob );
+
+		return( writeDone() );
+	}
+
+	//
+	// 8 byte command received, or a continuation of the previous command
+	//
+	else if( (buffoffset == readto && readto == 8) ||
+			 (buffoffset == readto && readto == 1 && workCount) )
+	{
+		buffoffset = readto = 0;
+		if( workCount )
+		{
+			phaseTime[STATS_ACK] += GetTime_Microseconds() - waitStart;
+
+			if( verboseLevel > 1 )
+				log( 2, "    Continuation: Offset=%u, Checksum=%04x", workOffset-1, buff.w[256] );
+
+			//
+			// Continuation...
+			//
+			if( buff.b[0] != (workCount-0) )
+			{
+				log( 0, "Continue Fault: Received=%d, Expected=%d", buff.b[0], workCount );
+				if( stats )
+					stats->continueFaults++;
+				sendCount = 0;
+				workCount = 0;
+				resync( 0, 1 );
+				return( 1 );
+			}
+		}
+		else
 		{
-			buffoffset = readto = 0;
-			if( (crc = checksum( &buff.w[0], 256 )) != buff.w[256] )
+			//
+			// New Command...
+			//
+			if( (crc = checksum( &buff.w[0], 3 )) != buff.w[3] )
+			{
+				log( 0, "Bad Command Checksum: %02x %02x %02x %02x %02x %02x %02x %02x, Checksum=%04x",
+					 buff.b[0], buff.b[1], buff.b[2], buff.b[3], buff.b[4], buff.b[5], buff.b[6], buff.b[7], crc);
+				if( stats )
+					stats->checksumFailures++;
+				resync( 1, 8 );
+				return( 1 );
+			}
+
+			drive = (buff.inquire.driveAndHead & ATA_DriveAndHead_Drive) ? 1 : 0;
+			slot = drives->slot( port, drive );
+			img = slot ? slot->image : NULL;
+			worker = slot ? slot->worker : NULL;
+
+			workCommand = buff.chs.command & SERIAL_COMMAND_RWMASK;
+
+			if( (workCommand != SERIAL_COMMAND_INQUIRE) && (buff.chs.driveAndHead & ATA_COMMAND_LBA) )
+			{
+				mylba = ((((unsigned long) buff.lba.bits24) & ATA_COMMAND_HEADMASK) << 24)
+					| (((unsigned long) buff.lba.bits16) << 16)
+					| (((unsigned long) buff.lba.bits08) << 8)
+					| ((unsigned long) buff.lba.bits00);
+			}
+			else
+			{
+				cyl = buff.chs.cylinder;
+				sect = buff.chs.sector;
+				head = (buff.chs.driveAndHead & ATA_COMMAND_HEADMASK);
+				mylba = img ? (((cyl*img->head + head)*img->sect) + sect-1) : 0;
+			}
+
+			workOffset = 0;
+			workCount = buff.chs.count;
+
+			if( verboseLevel > 0 )
+			{
+				const char *comStr = (workCommand & SERIAL_COMMAND_WRITE ? "Write" : "Read");
+
+				if( workCommand == SERIAL_COMMAND_INQUIRE )
+					log( 1, "Inquire %d: Client Port=0x%x, Client Baud=%s", drive,
+						 ((unsigned short) buff.inquire.port) << 2,
+						 baudRateMatchDivisor( buff.inquire.baud )->display );
+				else if( buff.chs.driveAndHead & ATA_COMMAND_LBA )
+					log( 1, "%s %d: LBA=%u, Count=%u", comStr, drive,
+						 mylba, workCount );
+				else
+					log( 1, "%s %d: Cylinder=%u, Sector=%u, Head=%u, Count=%u, LBA=%u", comStr, drive,
+						 cyl, sect, head, workCount, mylba );
+			}
+
+			if( !img )
 			{
-				log( 0, "Bad Write Sector Checksum" );
-				continue;
+				log( 1, "    No slave drive provided" );
+				workCount = 0;
+				return( 1 );
 			}
 
-			if( img->readOnly )
+			if( (workCommand & SERIAL_COMMAND_WRITE) && img->readOnly )
 			{
-				log( 1, "Attempt to write to read-only image" );
-				continue;
+				log( 1, "    Write attempt to Read Only disk" );
+				workCount = 0;
+				return( 1 );
 			}
 
-			img->seekSector( mylba + workOffset );
-			img->writeSector( &buff.w[0] );
+			if( verboseLevel > 0 && workCount > 100 )
+				perfTimer = GetTime();
 
+			if( workCommand == SERIAL_COMMAND_READWRITE )
+				readAheadReset( mylba, workCount );
+		}
+
+		if( workCount && (workCommand == (SERIAL_COMMAND_WRITE | SERIAL_COMMAND_READWRITE)) )
+		{
 			//
-			// Echo back the CRC
+			// Write command...   Setup to receive a sector
 			//
-			if( !serial->writeCharacters( &buff.w[256], 2 ) )
-				break;
+			readto = 514;
+			waitStart = GetTime_Microseconds();
+		}
+		else
+			return( sendNext() );
+	}
 
-			workOffset++;
-			workCount--;
+	return( 1 );
+}
 
-			if( workCount )
-				readto = 1;           // looking for continuation ACK
-		}
+//
+// The sector of a Write Sector has been written
+//
+int ProcessState::writeDone( void )
+{
+	phaseTime[STATS_DISK] += writeJob.diskTime;
+
+	//
+	// Echo back the CRC
+	//
+	sendQueue[ sendCount ].data = &buff.w[256];
+	sendQueue[ sendCount++ ].len = 2;
+	if( !sendQueued() )
+		return( 0 );
+
+	waitStart = GetTime_Microseconds();
+
+	workOffset++;
+	workCount--;
+
+	if( workCount )
+		readto = 1;           // looking for continuation ACK
+	else
+		commandDone();
+
+	return( 1 );
+}
+
+//
+// Sends the Inquire response, or the next sector of a read
+//
+int ProcessState::sendNext( void )
+{
+	unsigned long long t0;
+
+	//
+	// Inquire command...
+	//
+	if( workCommand == SERIAL_COMMAND_INQUIRE )
+	{
+		unsigned char localScan;
 
 		//
-		// 8 byte command received, or a continuation of the previous command
+		// Rates that need a hardware multiplier on the client can be reached from more than one
+		// divisor, so those are taken as they come
 		//
-		else if( (buffoffset == readto && readto == 8) ||
-				 (buffoffset == readto && readto == 1 && workCount) )
+		if( serial->speedEmulation && serial->baudRate->divisor != 0xff &&
+			buff.inquire.baud != serial->baudRate->divisor )
 		{
-			buffoffset = readto = 0;
-			if( workCount )
-			{
-				if( verboseLevel > 1 )
-					log( 2, "    Continuation: Offset=%u, Checksum=%04x", workOffset-1, buff.w[256] );
+			log( 1, "    Ignoring Inquire with wrong baud rate" );
+			workCount = 0;
+			return( 1 );
+		}
 
-				//
-				// Continuation...
-				//
-				if( buff.b[0] != (workCount-0) )
-				{
-					log( 0, "Continue Fault: Received=%d, Expected=%d", buff.b[0], workCount );
-					workCount = 0;
-					continue;
-				}
-			}
-			else
-			{
-				//
-				// New Command...
-				//
-				if( (crc = checksum( &buff.w[0], 3 )) != buff.w[3] )
-				{
-					log( 0, "Bad Command Checksum: %02x %02x %02x %02x %02x %02x %02x %02x, Checksum=%04x",
-						 buff.b[0], buff.b[1], buff.b[2], buff.b[3], buff.b[4], buff.b[5], buff.b[6], buff.b[7], crc);
-					continue;
-				}
+		localScan = buff.inquire.scan;         // need to do this before the call to
+		                                       // img->respondInquire, as it will clear the buff
+		img->respondInquire( &buff.w[0], buff.inquirePacked.PackedPortAndBaud,
+							 serial->baudRate,
+							 ((unsigned short) buff.inquire.port) << 2,
+							 (drive == 1 && lastScan) || buff.inquire.scan );
+		lastScan = localScan;
 
-				img = (buff.inquire.driveAndHead & ATA_DriveAndHead_Drive) ? image1 : image0;
+		t0 = GetTime_Microseconds();
+		buff.w[256] = checksum( &buff.w[0], 256 );
 
-				workCommand = buff.chs.command & SERIAL_COMMAND_RWMASK;
+		phaseTime[STATS_CHECKSUM] += GetTime_Microseconds() - t0;
 
-				if( (workCommand != SERIAL_COMMAND_INQUIRE) && (buff.chs.driveAndHead & ATA_COMMAND_LBA) )
-				{
-					mylba = ((((unsigned long) buff.lba.bits24) & ATA_COMMAND_HEADMASK) << 24)
-						| (((unsigned long) buff.lba.bits16) << 16)
-						| (((unsigned long) buff.lba.bits08) << 8)
-						| ((unsigned long) buff.lba.bits00);
-				}
-				else
-				{
-					cyl = buff.chs.cylinder;
-					sect = buff.chs.sector;
-					head = (buff.chs.driveAndHead & ATA_COMMAND_HEADMASK);
-					mylba = img ? (((cyl*img->head + head)*img->sect) + sect-1) : 0;
-				}
+		sendQueue[ sendCount ].data = &buff.w[0];
+		sendQueue[ sendCount++ ].len = 514;
+		if( !sendQueued() )
+			return( 0 );
 
-				workOffset = 0;
-				workCount = buff.chs.count;
+		if( verboseLevel >= 3 )
+			logBuff( "    Sending: ", &buff.b[0], 514, 514 );
+	}
+	//
+	// Read command...   Sector comes from the read-ahead ring, already checksummed
+	//
+	else
+	{
+		struct readAheadFrame *f;
 
-				if( verboseLevel > 0 )
-				{
-					const char *comStr = (workCommand & SERIAL_COMMAND_WRITE ? "Write" : "Read");
+		if( !(f = readAheadNext()) )
+		{
+			parked = PARKED_READ;
+			return( PROCESS_WAITING );
+		}
 
-					if( workCommand == SERIAL_COMMAND_INQUIRE )
-						log( 1, "Inquire %d: Client Port=0x%x, Client Baud=%s", img == image0 ? 0 : 1,
-							 ((unsigned short) buff.inquire.port) << 2,
-							 baudRateMatchDivisor( buff.inquire.baud )->display );
-					else if( buff.chs.driveAndHead & ATA_COMMAND_LBA )
-						log( 1, "%s %d: LBA=%u, Count=%u", comStr, img == image0 ? 0 : 1,
-							 mylba, workCount );
-					else
-						log( 1, "%s %d: Cylinder=%u, Sector=%u, Head=%u, Count=%u, LBA=%u", comStr, img == image0 ? 0 : 1,
-							 cyl, sect, head, workCount, mylba );
-				}
+		if( f->data == &f->w[0] )
+		{
+			sendQueue[ sendCount ].data = &f->w[0];
+			sendQueue[ sendCount++ ].len = 514;
+		}
+		else
+		{
+			sendQueue[ sendCount ].data = f->data;
+			sendQueue[ sendCount++ ].len = 512;
+			sendQueue[ sendCount ].data = &f->w[256];
+			sendQueue[ sendCount++ ].len = 2;
+		}
 
-				if( !img )
-				{
-					log( 1, "    No slave drive provided" );
-					workCount = 0;
-					continue;
-				}
+		if( !sendQueued() )
+			return( 0 );
 
-				if( (workCommand & SERIAL_COMMAND_WRITE) && img->readOnly )
-				{
-					log( 1, "    Write attempt to Read Only disk" );
-					workCount = 0;
-					continue;
-				}
+		if( verboseLevel >= 3 )
+			logBuff( "    Sending: ", (unsigned char *) f->data, 512, 512 );
 
-				if( verboseLevel > 0 && workCount > 100 )
-					perfTimer = GetTime();
-			}
+		lastScan = 0;
+	}
 
-			if( workCount && (workCommand == (SERIAL_COMMAND_WRITE | SERIAL_COMMAND_READWRITE)) )
-			{
-				//
-				// Write command...   Setup to receive a sector
-				//
-				readto = 514;
-			}
-			else
-			{
-				//
-				// Inquire command...
-				//
-				if( workCommand == SERIAL_COMMAND_INQUIRE )
-				{
-					unsigned char localScan;
-
-					if( serial->speedEmulation &&
-						buff.inquire.baud != serial->baudRate->divisor )
-					{
-						log( 1, "    Ignoring Inquire with wrong baud rate" );
-						workCount = 0;
-						continue;
-					}
-
-					localScan = buff.inquire.scan;         // need to do this before the call to
-					                                       // img->respondInquire, as it will clear the buff
-					img->respondInquire( &buff.w[0], buff.inquirePacked.PackedPortAndBaud,
-										 serial->baudRate,
-										 ((unsigned short) buff.inquire.port) << 2,
-										 (img == image1 && lastScan) || buff.inquire.scan );
-					lastScan = localScan;
-				}
-				//
-				// Read command...
-				//
-				else
-				{
-					img->seekSector( mylba + workOffset );
-					img->readSector( &buff.w[0] );
-					lastScan = 0;
-				}
+	workCount--;
+	workOffset++;
 
-				buff.w[256] = checksum( &buff.w[0], 256 );
+	if( workCount )
+	{
+		readto = 1;           // looking for continuation ACK
 
-				if( !serial->writeCharacters( &buff.w[0], 514 ) )
-					break;
+		//
+		// While this frame is on the wire, prepare the ones that follow
+		//
+		if( workCommand == SERIAL_COMMAND_READWRITE )
+			readAheadFill( READAHEAD_FRAMES );
 
-				if( verboseLevel >= 3 )
-					logBuff( "    Sending: ", 514, 514, verboseLevel );
+		waitStart = GetTime_Microseconds();
+	}
+	else
+		commandDone();
 
-				workCount--;
-				workOffset++;
+	return( 1 );
+}
 
-				if( workCount )
-					readto = 1;           // looking for continuation ACK
-			}
+//
+// Serves one port on its own, from drives without workers
+//
+void processRequests( SerialAccess *serial, DriveTable *drives, int port, const struct processTimeouts *timeouts, int verboseLevel,
+					  struct processStats *stats )
+{
+	ProcessState state( serial, drives, port, timeouts, verboseLevel, stats );
+	unsigned long long until;
+	unsigned long len;
+
+	for( ;; )
+	{
+		//
+		// Part way through a command, the client only has until the deadline to carry on
+		//
+		if( (until = state.deadline()) && !serial->waitCharacters( until ) )
+		{
+			state.timedOut();
+			continue;
 		}
 
-		if( workCount == 0 && workOffset > 100 )
-			log( 1, "    Performance: %.2lf bytes per second", (512.0 * workOffset) / (GetTime() - perfTimer) * 1000.0 );
+		if( !(len = serial->readCharacters( state.receiveBuffer(), state.receiveLength() )) ||
+			!state.received( len ) )
+			break;
 	}
 }
 
+void processRequests( SerialAccess *serial, Image *image0, Image *image1, const struct processTimeouts *timeouts, int verboseLevel,
+					  struct processStats *stats )
+{
+	DriveTable drives;
+
+	drives.add( 0, image0 );
+	if( image1 )
+		drives.add( 0, image1 );
 
+	processRequests( serial, &drives, 0, timeouts, verboseLevel, stats );
+}
@@ -0,0 +1,161 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        Stats.cpp - Protocol latency histograms and error counters
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+#include "Library.h"
+#include "Stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+const char *statsCommandNames[ STATS_COMMANDS ] = { "inquire", "read", "write" };
+const char *statsPhaseNames[ STATS_PHASES ] = { "total", "disk", "checksum", "wire", "ack" };
+
+//
+// New ports are only ever added at the end of the list, so it can be walked while it grows
+//
+struct processStats *statsList = NULL;
+
+void histogramAdd( struct histogram *h, unsigned long long us )
+{
+	int b;
+
+	for( b = 0; b < STATS_BUCKETS-1 && (us >> b) > 1; b++ ) ;
+
+	h->buckets[b]++;
+	h->count++;
+	h->sum += us;
+	if( us > h->max )
+		h->max = us;
+}
+
+//
+// Upper bound of the bucket holding the given percentile
+//
+unsigned long long histogramPercentile( struct histogram *h, double percentile )
+{
+	unsigned long target, seen = 0;
+	unsigned long long bound;
+
+	if( !h->count )
+		return( 0 );
+
+	target = (unsigned long) (h->count * percentile / 100.0);
+	if( target >= h->count )
+		target = h->count - 1;
+
+	for( int b = 0; b < STATS_BUCKETS; b++ )
+	{
+		seen += h->buckets[b];
+		if( seen > target )
+		{
+			bound = (2ULL << b) - 1;
+			return( b == STATS_BUCKETS-1 || bound > h->max ? h->max : bound );
+		}
+	}
+
+	return( h->max );
+}
+
+struct processStats *statsForPort( const char *name )
+{
+	struct processStats *s, **last;
+
+	for( last = &statsList; (s = *last); last = &s->next )
+		if( !strcmp( s->name, name ) )
+			return( s );
+
+	if( !(s = (struct processStats *) calloc( 1, sizeof(struct processStats) )) )
+		log( -1, "Out of memory for statistics" );
+
+	s->name = strdup( name );
+	*last = s;
+
+	return( s );
+}
+
+void statsReport( void )
+{
+	struct processStats *s;
+	struct histogram *h;
+
+	for( s = statsList; s; s = s->next )
+	{
+		log( 0, "Statistics for %s: checksum failures %lu, timeouts %lu, spurious bytes %lu, continue faults %lu",
+			 s->name, s->checksumFailures, s->timeouts, s->spurious, s->continueFaults );
+
+		for( int c = 0; c < STATS_COMMANDS; c++ )
+		{
+			if( !s->latency[c][STATS_TOTAL].count )
+				continue;
+
+			log( 0, "    %s: %lu commands, %lu sectors", statsCommandNames[c], s->latency[c][STATS_TOTAL].count, s->sectors[c] );
+			log( 0, "        %-10s %10s %10s %10s %10s", "", "p50 us", "p99 us", "max us", "mean us" );
+
+			for( int p = 0; p < STATS_PHASES; p++ )
+			{
+				h = &s->latency[c][p];
+				log( 0, "        %-10s %10llu %10llu %10llu %10llu", statsPhaseNames[p],
+					 histogramPercentile( h, 50 ), histogramPercentile( h, 99 ), h->max,
+					 h->count ? h->sum / h->count : 0ULL );
+			}
+		}
+	}
+
+	fflush( stdout );
+}
+
+void statsReportJSON( FILE *out )
+{
+	struct processStats *s;
+	struct histogram *h;
+
+	fprintf( out, "{\"time\":%llu,\"ports\":[", GetTime_Microseconds() );
+
+	for( s = statsList; s; s = s->next )
+	{
+		fprintf( out, "%s{\"port\":\"%s\",\"checksumFailures\":%lu,\"timeouts\":%lu,\"spurious\":%lu,\"continueFaults\":%lu",
+				 s == statsList ? "" : ",", s->name, s->checksumFailures, s->timeouts, s->spurious, s->continueFaults );
+
+		for( int c = 0; c < STATS_COMMANDS; c++ )
+		{
+			fprintf( out, ",\"%s\":{\"commands\":%lu,\"sectors\":%lu", statsCommandNames[c],
+					 s->latency[c][STATS_TOTAL].count, s->sectors[c] );
+
+			for( int p = 0; p < STATS_PHASES; p++ )
+			{
+				h = &s->latency[c][p];
+				fprintf( out, ",\"%s\":{\"p50\":%llu,\"p99\":%llu,\"max\":%llu,\"sum\":%llu,\"buckets\":[",
+						 statsPhaseNames[p], histogramPercentile( h, 50 ), histogramPercentile( h, 99 ), h->max, h->sum );
+				for( int b = 0; b < STATS_BUCKETS; b++ )
+					fprintf( out, "%s%lu", b ? "," : "", h->buckets[b] );
+				fprintf( out, "]}" );
+			}
+
+			fprintf( out, "}" );
+		}
+
+		fprintf( out, "}" );
+	}
+
+	fprintf( out, "]}\n" );
+	fflush( out );
+}
@@ -0,0 +1,85 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        Stats.h - Protocol latency histograms and error counters
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// Each serial port has a processStats, found by port name so that it survives reconnections.
+// For every completed command, its total latency and the time spent in each phase are added to
+// histograms for that command type.  The phases are:
+//
+//     disk       reading or writing the image
+//     checksum   calculating checksums of sectors
+//     wire       handing data to the serial port
+//     ack        waiting for the client: continuation ACKs, and the sector data of write commands
+//
+// Histograms have power of two buckets in microseconds.  The stats are only updated by the thread
+// serving the port, and are read without locking when reported, which is good enough for diagnostics.
+//
+
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+#include <stdio.h>
+
+#define STATS_BUCKETS 28                    // up to 2^27 us, a little over two minutes
+
+#define STATS_INQUIRE 0
+#define STATS_READ 1
+#define STATS_WRITE 2
+#define STATS_COMMANDS 3
+
+#define STATS_TOTAL 0
+#define STATS_DISK 1
+#define STATS_CHECKSUM 2
+#define STATS_WIRE 3
+#define STATS_ACK 4
+#define STATS_PHASES 5
+
+struct histogram {
+	unsigned long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned long buckets[ STATS_BUCKETS ];
+};
+
+struct processStats {
+	const char *name;
+	struct histogram latency[ STATS_COMMANDS ][ STATS_PHASES ];
+	unsigned long sectors[ STATS_COMMANDS ];
+
+	unsigned long checksumFailures;
+	unsigned long timeouts;
+	unsigned long spurious;
+	unsigned long continueFaults;
+
+	struct processStats *next;
+};
+
+void histogramAdd( struct histogram *h, unsigned long long us );
+unsigned long long histogramPercentile( struct histogram *h, double percentile );
+
+struct processStats *statsForPort( const char *name );
+
+void statsReport( void );
+void statsReportJSON( FILE *out );
+
+#endif
@@ -0,0 +1,346 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        WriteBehindImage.h - Written sectors are queued and written by a background thread
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// WriteBehindImage wraps another Image, so that a Write Sector can be acknowledged without waiting
+// on the disk.  Written sectors collect in the pending batch, where a sector written again simply
+// replaces the earlier data.  The flusher thread takes the whole pending batch at once, sorts it by
+// LBA, and writes each run of adjacent sectors with a single writeSectors.  Only one batch is in
+// flight at a time, and a new pending batch is started when it is taken, so a sector written while
+// an older copy is on its way to the disk is always written after it.
+//
+// Reads look at the pending batch first, then the one in flight, and only then at the image.
+//
+// durable selects when a write is acknowledged:
+//     0     as soon as it has been queued
+//     1     once its batch has been written and flushed to disk with Image::flush
+//
+// Queued sectors are written out when the program exits normally, but are lost if it is killed.
+//
+
+#ifndef WRITEBEHINDIMAGE_H_INCLUDED
+#define WRITEBEHINDIMAGE_H_INCLUDED
+
+#include "Library.h"
+#include "Mutex.h"
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define WRITEBEHIND_SECTORS 2048            // per batch, 1 MB
+#define WRITEBEHIND_RUN 128                 // largest single write to the image, in sectors
+
+struct writeBehindSector {
+	unsigned long lba;
+	int hashNext;
+	unsigned short data[256];
+};
+
+struct writeBehindOrder {
+	unsigned long lba;
+	int sector;
+};
+
+struct writeBehindBatch {
+	struct writeBehindSector sectors[ WRITEBEHIND_SECTORS ];
+	int buckets[ WRITEBEHIND_SECTORS ];
+	int count;
+	unsigned long generation;
+};
+
+class WriteBehindImage : public Image
+{
+private:
+	Image *image;
+	int durable;
+
+	struct writeBehindBatch *pending, *inflight;
+	unsigned long flushedGeneration;
+	int stopping;
+
+	pthread_t flusher;
+	Mutex lock;                         // the batches and the fields above
+	Condition work, room, done;
+
+	unsigned short run[ WRITEBEHIND_RUN * 256 ];
+	struct writeBehindOrder order[ WRITEBEHIND_SECTORS ];
+
+	WriteBehindImage *next;
+
+	static WriteBehindImage *&all( void )
+	{
+		static WriteBehindImage *images = NULL;
+
+		return( images );
+	}
+
+	static struct writeBehindSector *find( struct writeBehindBatch *batch, unsigned long p_lba )
+	{
+		for( int e = batch->buckets[ p_lba % WRITEBEHIND_SECTORS ]; e >= 0; e = batch->sectors[e].hashNext )
+			if( batch->sectors[e].lba == p_lba )
+				return( &batch->sectors[e] );
+
+		return( NULL );
+	}
+
+	static void clear( struct writeBehindBatch *batch )
+	{
+		for( int t = 0; t < WRITEBEHIND_SECTORS; t++ )
+			batch->buckets[t] = -1;
+		batch->count = 0;
+	}
+
+	static int compareLba( const void *a, const void *b )
+	{
+		unsigned long la = ((const struct writeBehindOrder *) a)->lba;
+		unsigned long lb = ((const struct writeBehindOrder *) b)->lba;
+
+		return( la < lb ? -1 : la > lb ? 1 : 0 );
+	}
+
+	//
+	// Writes the batch in flight to the image, a run of adjacent sectors at a time
+	//
+	void writeBatch( void )
+	{
+		int t, n;
+
+		for( t = 0; t < inflight->count; t++ )
+		{
+			order[t].lba = inflight->sectors[t].lba;
+			order[t].sector = t;
+		}
+
+		qsort( order, inflight->count, sizeof(struct writeBehindOrder), compareLba );
+
+		for( t = 0; t < inflight->count; t += n )
+		{
+			unsigned long first = order[t].lba;
+
+			for( n = 0; t+n < inflight->count && n < WRITEBEHIND_RUN && order[t+n].lba == first + n; n++ )
+				memcpy( &run[ n*256 ], inflight->sectors[ order[t+n].sector ].data, 512 );
+
+			image->writeSectors( first, n, run );
+		}
+
+		if( durable )
+			image->flush();
+	}
+
+	static void *flusherThread( void *arg )
+	{
+		WriteBehindImage *wb = (WriteBehindImage *) arg;
+		struct writeBehindBatch *batch;
+
+		wb->lock.lock();
+
+		for( ;; )
+		{
+			while( !wb->pending->count && !wb->stopping )
+				wb->work.wait( wb->lock );
+
+			if( !wb->pending->count )
+				break;
+
+			batch = wb->inflight;
+			wb->inflight = wb->pending;
+			wb->pending = batch;
+			wb->pending->generation = wb->inflight->generation + 1;
+			wb->room.broadcast();
+
+			wb->lock.unlock();
+			wb->writeBatch();
+			wb->lock.lock();
+
+			wb->flushedGeneration = wb->inflight->generation;
+			clear( wb->inflight );
+			wb->done.broadcast();
+		}
+
+		wb->lock.unlock();
+
+		return( NULL );
+	}
+
+	//
+	// Stops the flusher thread once everything queued has been written
+	//
+	void drain( void )
+	{
+		if( stopping )
+			return;
+
+		lock.lock();
+		stopping = 1;
+		work.signal();
+		lock.unlock();
+
+		if( !pthread_equal( pthread_self(), flusher ) )
+			pthread_join( flusher, NULL );
+	}
+
+	static void drainAll( void )
+	{
+		for( WriteBehindImage *wb = all(); wb; wb = wb->next )
+			wb->drain();
+	}
+
+public:
+	WriteBehindImage( Image *p_image, int p_durable )   :   Image( p_image->shortFileName, p_image->readOnly, p_image->drive )
+	{
+		image = p_image;
+		durable = p_durable;
+
+		cyl = image->cyl;
+		sect = image->sect;
+		head = image->head;
+		floppy = image->floppy;
+		floppyType = image->floppyType;
+		useCHS = image->useCHS;
+		totallba = image->totallba;
+		shortFileName = image->shortFileName;
+		readOnly = image->readOnly;
+		drive = image->drive;
+
+		pending = (struct writeBehindBatch *) malloc( sizeof(struct writeBehindBatch) );
+		inflight = (struct writeBehindBatch *) malloc( sizeof(struct writeBehindBatch) );
+		if( !pending || !inflight )
+			log( -1, "'%s', out of memory for the write-behind queue", shortFileName );
+
+		clear( pending );
+		clear( inflight );
+		pending->generation = 1;
+		inflight->generation = 0;
+		flushedGeneration = 0;
+		stopping = 0;
+
+		if( pthread_create( &flusher, NULL, flusherThread, this ) )
+			log( -1, "'%s', could not start the write-behind thread", shortFileName );
+
+		if( !all() )
+			atexit( drainAll );
+		next = all();
+		all() = this;
+
+		log( 1, "%s: Write-behind, acknowledged once %s", shortFileName, durable ? "flushed to disk" : "queued" );
+	}
+
+	~WriteBehindImage()
+	{
+		WriteBehindImage **p;
+
+		drain();
+
+		for( p = &all(); *p != this; p = &(*p)->next ) ;
+		*p = next;
+
+		free( pending );
+		free( inflight );
+	}
+
+	void writeSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		struct writeBehindSector *s;
+
+		if( lba >= totallba || count > totallba - lba )
+			log( -1, "'%s', Failed to write beyond lba=%lu", shortFileName, totallba );
+
+		lock.lock();
+
+		for( ; count; count--, lba++, buff = (char *) buff + 512 )
+		{
+			if( !(s = find( pending, lba )) )
+			{
+				while( pending->count == WRITEBEHIND_SECTORS )
+					room.wait( lock );
+
+				s = &pending->sectors[ pending->count ];
+				s->lba = lba;
+				s->hashNext = pending->buckets[ lba % WRITEBEHIND_SECTORS ];
+				pending->buckets[ lba % WRITEBEHIND_SECTORS ] = pending->count++;
+
+				work.signal();
+			}
+
+			memcpy( s->data, buff, 512 );
+		}
+
+		//
+		// The last sector went into the newest batch, so waiting for that covers the whole span
+		//
+		if( durable )
+		{
+			unsigned long generation = pending->generation;
+
+			while( flushedGeneration < generation )
+				done.wait( lock );
+		}
+
+		lock.unlock();
+	}
+
+	void readSectors( unsigned long lba, unsigned long count, void *buff )
+	{
+		struct writeBehindSector *s = NULL;
+		unsigned long run;
+
+		while( count )
+		{
+			//
+			// Sectors that aren't queued are read from the image a run at a time.  A sector that isn't
+			// queued now has already reached the image, even if it is written again straight after.
+			//
+			lock.lock();
+
+			for( run = 0; run < count && !(s = find( pending, lba + run )) && !(s = find( inflight, lba + run )); run++ ) ;
+
+			if( !run )
+			{
+				memcpy( buff, s->data, 512 );
+				run = 1;
+				lock.unlock();
+			}
+			else
+			{
+				lock.unlock();
+				image->readSectors( lba, run, buff );
+			}
+
+			lba += run;
+			count -= run;
+			buff = (char *) buff + run * 512;
+		}
+	}
+
+	void flush( void )
+	{
+		lock.lock();
+		while( flushedGeneration < pending->generation - (pending->count ? 0 : 1) )
+			done.wait( lock );
+		lock.unlock();
+
+		image->flush();
+	}
+};
+
+#endif
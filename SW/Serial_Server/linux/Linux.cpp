@@ -31,9 +31,22 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <time.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "../library/Library.h"
 #include "../library/FlatImage.h"
+#include "../library/MappedImage.h"
+#include "../library/OverlayImage.h"
+#include "../library/CompressedImage.h"
+#include "../library/DedupImage.h"
+#include "../library/CachedImage.h"
+#include "../library/WriteBehindImage.h"
+#include "LinuxServer.h"
+#include "LinuxControl.h"
+#include "LinuxLog.h"
 
 #include "../../XTIDE_Universal_BIOS/Inc/Version.inc"
 
@@ -55,6 +68,7 @@ const char *usageStrings[] = {
 	"serial drive usage directions.",
 	"",
 	"Usage: SerDrive [options] imagefile [[slave-options] slave-imagefile]",
+	"           [-c port [options] imagefile [[slave-options] slave-imagefile]] ...",
 	"",
 	"  -g [cyl:head:sect]  Geometry in cylinders, sectors per cylinder, and heads",
 	"                      -g also implies CHS addressing mode (default is LBA28)",
@@ -64,12 +78,21 @@ const char *usageStrings[] = {
 	"                      Floppy images can also be created, such as \"360K\"",
 	"                      (default is a 32 MB disk, with CHS geometry 65:16:63)",
 	"",
-	"  -p [pipename]       Named Pipe mode for emulators",
-	"                      (must begin with \"\\\\\", default is \"" PIPENAME "\")",
+	"  -p [socket]         Socket mode for emulators, \"tcp:port\" listens on localhost",
+	"                      and \"unix:path\" on a Unix domain socket (default is",
+	"                      \"" PIPENAME "\").  Sectors go as fast as the emulator",
+	"                      takes them, with -b Inquire is only answered at that rate",
 	"",
 	"  -c COMPortNumber    COM Port to use (default is first found)",
 	"                      Available COM ports on this system are:",
  "COM                          ",
+	"                      \"pty\" creates a pseudo-terminal for a local client.",
+	"                      A socket can also be given, as for -p.",
+	"                      Repeat -c to serve several ports from one process, each",
+	"                      with the one or two images that follow it.  An image",
+	"                      given for more than one port is opened once and shared,",
+	"                      so it must be given with the same options each time.",
+	"                      Each image is read and written by its own thread.",
 	"",
 	"  -b BaudRate         Baud rate to use on the COM port, with client machine",
 	"                      rate multiplier in effect:",
@@ -78,14 +101,71 @@ const char *usageStrings[] = {
 	"                          4x:    9600, 19200,  38400, 115.2K, 230.4K, 460.8K",
 	"                          8x:   19200, 38400, 115.2K, 230.4K, 460.8K, 921.6K",
 	"                          and for completeness:                76.8K, 153.6K",
-	"                      (default is 9600, 115.2K when in named pipe mode)",
+	"                      (default is 9600, any rate when in socket mode)",
+	"                      Applies to the current port and the ports after it",
 	"",
-	"  -t                  Disable timeout, useful for long delays when debugging",
+	"  -e [latency:fifo:errors]",
+	"                      Pace the port as an 8N1 serial line at the -b baud rate,",
+	"                      for benchmarking with an emulator or a local client.",
+	"                      latency in microseconds is added to every byte (default",
+	"                      0), fifo is the transmit FIFO depth (default 16 bytes),",
+	"                      and errors gives one bit error per that many bits on",
+	"                      average (default none).  Applies to the current port and",
+	"                      the ports after it",
+	"",
+	"  -t [header:sector:ack]",
+	"                      Milliseconds the client is given, beyond the time on the",
+	"                      wire at the -b baud rate, for the rest of a command header,",
+	"                      a sector being written, and a continuation ACK (default",
+	"                      50:100:250), before the command is given up on.  -t alone,",
+	"                      or 0 for one of them, disables the timeout, useful for long",
+	"                      delays when debugging.  Applies to the current port and the",
+	"                      ports after it",
+	"",
+	"  -s megabytes        Sector cache shared by all images and ports",
+	"  -w                  Write-back sector cache (default is write-through)",
 	"",
 	"  -r                  Read Only disk, do not allow writes",
 	"",
+	"  -m [syncEvery]      Memory map the disk image instead of using read/write",
+	"                      Written sectors are flushed: 0 - by the kernel (default),",
+	"                      1 - on every write, n - asynchronously every n writes",
+	"",
+	"  -q [durable]       Write-behind: written sectors are queued and written to the",
+	"                      image by a background thread, coalescing adjacent sectors.",
+	"                      Writes are acknowledged: 0 - once queued (default),",
+	"                      1 - once written and flushed to disk",
+	"",
+	"  -o deltafile        Copy-on-write overlay, the disk image is only read and",
+	"                      written sectors are kept in deltafile (created if needed)",
+	"",
+	"  -z compressedfile   Convert the following flat disk image into a new read-only",
+	"                      compressed image, and exit.  Compressed images are",
+	"                      recognized automatically when served",
+	"",
+	"  -i storefile        Add each following flat disk image to a deduplicated block",
+	"                      store (created if needed), where sectors that images",
+	"                      have in common are kept once, and exit.  Each image gets",
+	"                      a map, named image.map, that is served in its place",
+	"",
 	"  -v [level]          Reporting level 1-6, with increasing information",
 	"",
+	"  -j seconds          Print latency statistics as a line of JSON periodically.",
+	"                      Human readable statistics are printed on SIGUSR1",
+	"",
+	"  -u socket           Listen on a Unix domain socket for commands to eject,",
+	"                      insert or swap the image behind a drive while serving,",
+	"                      and for statistics on each drive.  For example:",
+	"                        echo \"swap 0 1 disk2.img\" | socat - UNIX-CONNECT:socket",
+	"                      swaps the image of the second drive of the first port.",
+	"                      A floppy drive only takes floppy images, and a hard disk",
+	"                      only images of the same size",
+	"",
+	"  -x tracefile        Record every byte sent and received on all ports, with",
+	"                      timestamps, to a binary trace file.  The trace is complete",
+	"                      once the server exits, on Ctrl-C or SIGTERM.  Look at it",
+	"                      or replay it with sertrace",
+	"",
 	"On the client computer, a serial port can be configured for use as a hard disk",
 	"with xtidecfg.com.  Or one can hold down the ALT key at the end of the normal",
 	"IDE hard disk scan and the XTIDE Universal BIOS will scan COM1-7, at each of",
@@ -110,33 +190,166 @@ void usagePrint( const char *strings[] )
 
 int verbose = 0;
 
-int main(int argc, char* argv[])
+struct port {
+	const char *name;
+	char nameBuff[20];
+	struct baudRate *baudRate;
+	struct linkEmulation link;
+	int emulateLink;
+	struct processTimeouts timeouts;
+	SerialAccess serial;
+};
+
+struct openedImage {
+	char *path;
+	Image *image;
+	int readOnly, mapped, writeBehind, useCHS;        // as given on the command line
+	unsigned long syncEvery, cyl, head, sect;
+};
+
+//
+// Images named for more than one port are only opened once, looked up by their real path
+//
+struct openedImage *findOpenedImage( struct openedImage *opened, int count, const char *path )
 {
-	int32_t len;
+	for( int t = 0; t < count; t++ )
+		if( !strcmp( opened[t].path, path ) )
+			return( &opened[t] );
 
-	unsigned long check;
-	unsigned char w;
+	return( NULL );
+}
 
-	unsigned short wbuff[256];
+ProtocolTrace *trace = NULL;
 
-	SerialAccess serial;
-	Image *img;
-	struct baudRate *baudRate = NULL;
+void stopTrace( void )
+{
+	trace->stop();
+}
+
+//
+// With a write-back cache, sectors the client has been told are written may only be in the
+// cache.  They are written to the images on the way out, including after SIGINT or SIGTERM (see
+// statsThread), and ahead of any write-behind queues, which are drained after this.
+//
+SectorCache *cache = NULL;
+DriveTable *cacheDrives = NULL;
+
+void flushCache( void )
+{
+	Image *image;
+
+	cache->lock.lock();
+	cache->flush( NULL );
+	cache->lock.unlock();
+
+	for( int t = 0; t < cacheDrives->ports * 2; t++ )
+		if( (image = cacheDrives->image( t / 2, t % 2 )) )
+			image->flush();
+}
+
+//
+// Once the ports are being served, messages are written out from a thread of their own (see
+// LinuxLog.h), so that reporting doesn't hold up the ports
+//
+MessageLog *messageLog = NULL;
+
+void stopLog( void )
+{
+	messageLog->stop();
+}
+
+//
+// Statistics are reported from their own thread, as the serial ports may be blocked on a read.
+// SIGUSR1 is blocked in all other threads, so that it is only ever taken here.
+//
+// SIGINT and SIGTERM are taken here too, and end the server with exit(), so that the protocol
+// trace and any write-behind queues are written out.
+//
+void *statsThread( void *arg )
+{
+	unsigned long jsonInterval = *(unsigned long *) arg;
+	struct timespec timeout;
+	sigset_t sigs;
+	int sig;
+
+	sigemptyset( &sigs );
+	sigaddset( &sigs, SIGUSR1 );
+	sigaddset( &sigs, SIGINT );
+	sigaddset( &sigs, SIGTERM );
 
-	int timeoutEnabled = 1;
+	timeout.tv_sec = jsonInterval;
+	timeout.tv_nsec = 0;
 
-	const char *ComPort = NULL;
-	char ComPortBuff[20];
+	for( ;; )
+	{
+		if( (sig = jsonInterval ? sigtimedwait( &sigs, NULL, &timeout ) : sigwaitinfo( &sigs, NULL )) == SIGUSR1 )
+			statsReport();
+		else if( sig == SIGINT || sig == SIGTERM )
+		{
+			log( 1, "Stopping" );
+			exit( 0 );
+		}
+		else if( jsonInterval && errno == EAGAIN )
+			statsReportJSON( stdout );
+	}
+
+	return( NULL );
+}
+
+int main(int argc, char* argv[])
+{
+	Image *img;
 
 	unsigned long cyl = 0, sect = 0, head = 0;
 	int readOnly = 0, createFile = 0;
 	int useCHS = 0;
+	int mapped = 0;
+	int writeBehind = -1;
+	unsigned long syncEvery = 0;
+	char *overlay = NULL;
+	char *convertTo = NULL;
+	char *importTo = NULL;
+	int imported = 0;
+	char *traceFile = NULL;
+	char *controlPath = NULL;
+	DriveControl *control = NULL;
+
+	struct port **ports;
+	struct port *cur;
+	int portcount = 1;
 
-	int imagecount = 0;
-	Image *images[2] = { NULL, NULL };
+	static DriveTable drives;
+
+	struct openedImage *opened = NULL, *o, given;
+	int openedcount = 0;
+
+	unsigned long cacheSize = 0;
+	int cacheWriteBack = 0;
+
+	static unsigned long jsonInterval = 0;
+	pthread_t statsThreadId;
+	sigset_t sigs;
+
+	ports = (struct port **) malloc( sizeof(struct port *) );
+	cur = ports[0] = new struct port();
+	cur->timeouts = processTimeoutsDefault;
 
 	usagePrint( bannerStrings );
 
+	//
+	// Before any threads are started, see statsThread
+	//
+	sigemptyset( &sigs );
+	sigaddset( &sigs, SIGUSR1 );
+	sigaddset( &sigs, SIGINT );
+	sigaddset( &sigs, SIGTERM );
+	pthread_sigmask( SIG_BLOCK, &sigs, NULL );
+
+	//
+	// An emulator closing its socket is seen as an error from write, rather than a signal
+	//
+	signal( SIGPIPE, SIG_IGN );
+
 	for( int t = 1; t < argc; t++ )
 	{
 		char *next = (t+1 < argc ? argv[t+1] : NULL );
@@ -155,15 +368,28 @@ int main(int argc, char* argv[])
 				if( !next )
 					usage();
 				t++;
+				if( cur->name )
+				{
+					//
+					// This port already has a name, start a new one
+					//
+					if( !(ports = (struct port **) realloc( ports, (portcount + 1) * sizeof(struct port *) )) )
+						log( -1, "Out of memory for the ports" );
+					cur = ports[ portcount++ ] = new struct port();
+					cur->baudRate = ports[ portcount-2 ]->baudRate;
+					cur->link = ports[ portcount-2 ]->link;
+					cur->emulateLink = ports[ portcount-2 ]->emulateLink;
+					cur->timeouts = ports[ portcount-2 ]->timeouts;
+				}
 				if (isdigit(*next)) {
 				  a = atol( next );
 				  if( a < 1 )
 				    usage();
-				  sprintf( ComPortBuff, "/dev/ttyS%d", a );
-				  ComPort = &ComPortBuff[0];
+				  sprintf( cur->nameBuff, "/dev/ttyS%d", a );
+				  cur->name = &cur->nameBuff[0];
 				}
 				else
-				  ComPort = next;
+				  cur->name = next;
 				break;
 			case 'v': case 'V':
 			    if( next && atol(next) != 0 )
@@ -177,16 +403,48 @@ int main(int argc, char* argv[])
 			case 'r': case 'R':
 				readOnly = 1;
 				break;
+			case 'o': case 'O':
+				if( !next )
+					usage();
+				t++;
+				overlay = next;
+				break;
+			case 'z': case 'Z':
+				if( !next )
+					usage();
+				t++;
+				convertTo = next;
+				break;
+			case 'i': case 'I':
+				if( !next )
+					usage();
+				t++;
+				importTo = next;
+				break;
+			case 'm': case 'M':
+				mapped = 1;
+				if( next && isdigit( next[0] ) )
+				{
+					t++;
+					syncEvery = atol(next);
+				}
+				break;
+			case 'q': case 'Q':
+				writeBehind = 0;
+				if( next && isdigit( next[0] ) )
+				{
+					t++;
+					writeBehind = atol(next);
+				}
+				break;
 			case 'p': case 'P':
-				if( next && next[0] == '\\' && next[1] == '\\' )
+				if( next && SerialAccess::isSocket( next ) )
 				{
 					t++;
-					ComPort = next;
+					cur->name = next;
 				}
 				else
-					ComPort = PIPENAME;
-				if( !baudRate )
-					baudRate = baudRateMatchString( "115200" );
+					cur->name = PIPENAME;
 				break;
 			case 'g': case 'G':
 				if( next && atol(next) != 0 )
@@ -230,63 +488,299 @@ int main(int argc, char* argv[])
 				}
 				break;
 			case 't': case 'T':
-				timeoutEnabled = 0;
+				memset( &cur->timeouts, 0, sizeof(cur->timeouts) );
+				if( next && isdigit( next[0] ) )
+				{
+					unsigned long ms[ TIMEOUT_PHASES ] = { 0, 0, 0 };
+
+					t++;
+					if( sscanf( next, "%lu:%lu:%lu", &ms[TIMEOUT_HEADER], &ms[TIMEOUT_PAYLOAD], &ms[TIMEOUT_ACK] ) != 3 )
+						log( -2, "'%s', timeouts are given as header:sector:ack", next );
+					for( int p = 0; p < TIMEOUT_PHASES; p++ )
+						cur->timeouts.allowance[p] = ms[p] * 1000;
+				}
+				break;
+			case 's': case 'S':
+				if( !next || !isdigit( next[0] ) )
+					usage();
+				t++;
+				cacheSize = atol(next);
+				break;
+			case 'w': case 'W':
+				cacheWriteBack = 1;
+				break;
+			case 'x': case 'X':
+				if( !next )
+					usage();
+				t++;
+				traceFile = next;
+				break;
+			case 'u': case 'U':
+				if( !next )
+					usage();
+				t++;
+				controlPath = next;
+				break;
+			case 'j': case 'J':
+				if( !next || !isdigit( next[0] ) || !atol( next ) )
+					usage();
+				t++;
+				jsonInterval = atol(next);
+				break;
+			case 'e': case 'E':
+				cur->emulateLink = 1;
+				cur->link.latency = cur->link.errorBits = 0;
+				cur->link.fifo = 16;
+				if( next && isdigit( next[0] ) )
+				{
+					t++;
+					sscanf( next, "%lu:%lu:%lu", &cur->link.latency, &cur->link.fifo, &cur->link.errorBits );
+				}
 				break;
 			case 'b': case 'B':
 				if( !next )
 					usage();
 				t++;
-				if( !(baudRate = baudRateMatchString( next )) || !baudRate->rate )
+				if( !(cur->baudRate = baudRateMatchString( next )) || !cur->baudRate->rate )
 					log( -2, "Unknown Baud Rate \"%s\"", next );
 				break;
 			default:
 				log( -2, "Unknown Option: \"%s\"", argv[t] );
 			}
 		}
-		else if( imagecount < 2 )
+		else if( importTo )
 		{
+			DedupImage::import( argv[t], importTo );
+			imported++;
+		}
+		else if( drives.drives( portcount-1 ) == 2 )
+			log( -2, "A port has at most two drives, give '%s' a port of its own with -c", argv[t] );
+		else
+		{
+			char *path = realpath( argv[t], NULL );
+
+			if( path && !createFile && !convertTo && !overlay && (o = findOpenedImage( opened, openedcount, path )) )
+			{
+				//
+				// The image is shared as it was first opened, so the options for it can't differ
+				//
+				if( o->readOnly != readOnly || o->mapped != mapped || o->syncEvery != syncEvery || o->writeBehind != writeBehind ||
+					o->useCHS != useCHS || o->cyl != cyl || o->head != head || o->sect != sect )
+					log( -2, "'%s' is given for more than one port with different options (-r, -m, -q or -g)", argv[t] );
+
+				log( 1, "%s: Already opened, shared with another port", argv[t] );
+				drives.add( portcount-1, o->image );
+				createFile = readOnly = cyl = sect = head = useCHS = mapped = 0;
+				syncEvery = 0;
+				writeBehind = -1;
+				overlay = NULL;
+				free( path );
+				continue;
+			}
+
+			given.readOnly = readOnly;
+			given.mapped = mapped;
+			given.syncEvery = syncEvery;
+			given.writeBehind = writeBehind;
+			given.useCHS = useCHS;
+			given.cyl = cyl;
+			given.head = head;
+			given.sect = sect;
+
 			if( createFile && cyl == 0 )
 			{
 				cyl = 65;
 				sect = 63;
 				head = 16;
 			}
-			images[imagecount] = new FlatImage( argv[t], readOnly, imagecount, createFile, cyl, head, sect, useCHS );
-			imagecount++;
-			createFile = readOnly = cyl = sect = head = useCHS = 0;
+			if( convertTo )
+			{
+				CompressedImage::convert( argv[t], convertTo );
+				exit( 0 );
+			}
+
+			if( overlay )
+			{
+				if( createFile )
+					log( -2, "Can't create a new disk image for use under an overlay" );
+				img = new OverlayImage( argv[t], overlay, readOnly, drives.drives( portcount-1 ), cyl, head, sect, useCHS );
+			}
+			else if( DedupImage::isDedupMap( argv[t] ) )
+			{
+				if( createFile )
+					log( -2, "'%s' already exists as a deduplicated disk image", argv[t] );
+				img = new DedupImage( argv[t], readOnly, drives.drives( portcount-1 ), cyl, head, sect, useCHS );
+			}
+			else if( CompressedImage::isCompressed( argv[t] ) )
+			{
+				if( createFile )
+					log( -2, "'%s' already exists as a compressed disk image", argv[t] );
+				img = new CompressedImage( argv[t], readOnly, drives.drives( portcount-1 ), cyl, head, sect, useCHS );
+			}
+			else if( mapped )
+				img = new MappedImage( argv[t], readOnly, drives.drives( portcount-1 ), createFile, cyl, head, sect, useCHS, syncEvery );
+			else
+				img = new FlatImage( argv[t], readOnly, drives.drives( portcount-1 ), createFile, cyl, head, sect, useCHS );
+
+			if( writeBehind >= 0 && !readOnly )
+				img = new WriteBehindImage( img, writeBehind );
+
+			drives.add( portcount-1, img );
+
+			if( !path )
+				path = realpath( argv[t], NULL );
+			if( path )
+			{
+				if( !(opened = (struct openedImage *) realloc( opened, (openedcount + 1) * sizeof(struct openedImage) )) )
+					log( -1, "Out of memory for the images" );
+				given.path = path;
+				given.image = img;
+				opened[ openedcount++ ] = given;
+			}
+
+			createFile = readOnly = cyl = sect = head = useCHS = mapped = 0;
+			syncEvery = 0;
+			writeBehind = -1;
+			overlay = NULL;
 		}
-		else
+	}
+
+	if( imported )
+		exit( 0 );
+
+	for( int t = 0; t < portcount; t++ )
+	{
+		if( drives.drives( t ) == 0 )
 			usage();
+
+		if( !ports[t]->name )
+			log( -2, "No serial port given" );
+
+		//
+		// Sockets without a baud rate take Inquire at any rate, see SerialAccess::acceptSocket
+		//
+		if( !ports[t]->baudRate && !SerialAccess::isSocket( ports[t]->name ) )
+			ports[t]->baudRate = baudRateMatchString( "9600" );
+
+		if( ports[t]->emulateLink )
+			ports[t]->serial.linkEmulation = &ports[t]->link;
+
+		ports[t]->serial.Listen( ports[t]->name );
+	}
+
+	if( traceFile )
+	{
+		trace = new ProtocolTrace( traceFile );
+		atexit( stopTrace );
+
+		for( int t = 0; t < portcount; t++ )
+			ports[t]->serial.trace = trace;
 	}
 
-	if( imagecount == 0 )
-		usage();
+	//
+	// Put the sector cache in front of every image, except those that are memory mapped
+	// and can hand out their sectors directly anyway
+	//
+	if( cacheSize )
+	{
+		cache = new SectorCache( cacheSize, cacheWriteBack );
+		cacheDrives = &drives;
+		atexit( flushCache );
+
+		for( int t = 0; t < portcount * 2; t++ )
+		{
+			Image *raw = drives.image( t / 2, t % 2 );
+			int seen = 0;
+
+			//
+			// An image shared between ports gets a single CachedImage, which is already in
+			// the earlier slots
+			//
+			for( int e = 0; e < t; e++ )
+				seen |= drives.image( e / 2, e % 2 ) == raw;
+
+			if( !raw || seen || raw->mapSector( 0 ) || raw->attachCache( cache ) )
+				continue;
 
-	if( !baudRate )
-		baudRate = baudRateMatchString( "9600" );
+			drives.replace( raw, new CachedImage( raw, cache ) );
+
+			for( int o = 0; o < openedcount; o++ )
+				if( opened[o].image == raw )
+					opened[o].image = drives.image( t / 2, t % 2 );
+		}
+	}
+
+	//
+	// Images from the command line are found by name if they are inserted again
+	//
+	if( controlPath )
+	{
+		control = new DriveControl( controlPath, &drives, cache );
+
+		for( int t = 0; t < openedcount; t++ )
+			control->opened( opened[t].path, opened[t].image );
+	}
+
+	if( pthread_create( &statsThreadId, NULL, statsThread, &jsonInterval ) )
+		log( -1, "Could not start statistics thread" );
+
+	//
+	// Registered after stopTrace, so that it is run first at exit, and anything logged while the
+	// trace is written out is printed directly
+	//
+	messageLog = new MessageLog( stdout );
+	atexit( stopLog );
+
+	if( portcount > 1 || control )
+	{
+		ProcessState **states = (ProcessState **) malloc( portcount * sizeof(ProcessState *) );
+
+		for( int t = 0; t < portcount; t++ )
+		{
+			ports[t]->serial.Connect( ports[t]->name, ports[t]->baudRate );
+			states[t] = new ProcessState( &ports[t]->serial, &drives, t, &ports[t]->timeouts, verbose,
+										  statsForPort( ports[t]->serial.deviceName ) );
+		}
+
+		serveRequests( states, portcount, &drives, control );
+		return( 0 );
+	}
 
 	do
 	{
-		serial.Connect( ComPort, baudRate );
+		ports[0]->serial.Connect( ports[0]->name, ports[0]->baudRate );
+
+		processRequests( &ports[0]->serial, &drives, 0, &ports[0]->timeouts, verbose,
+						 statsForPort( ports[0]->serial.deviceName ) );
 
-		processRequests( &serial, images[0], images[1], timeoutEnabled, verbose );
+		ports[0]->serial.Disconnect();
 
-		serial.Disconnect();
+		if( cache )
+			cache->report();
 
-		if( serial.resetConnection )
+		if( ports[0]->serial.resetConnection )
 			log( 0, "Serial Connection closed, reset..." );
 	}
-	while( serial.resetConnection );
+	while( ports[0]->serial.resetConnection );
 }
 
 void log( int level, const char *message, ... )
 {
 	va_list args;
 
+	if( level > verbose )
+		return;
+
 	va_start( args, message );
 
 	if( level < 0 )
 	{
+		//
+		// What was logged before the error is printed ahead of it
+		//
+		if( messageLog )
+			messageLog->stop();
+
 		fprintf( stderr, "ERROR: " );
 		vfprintf( stderr, message, args );
 		fprintf( stderr, "\n" );
@@ -297,7 +791,7 @@ void log( int level, const char *message, ... )
 		}
 		exit( 1 );
 	}
-	else if( verbose >= level )
+	else if( !messageLog || !messageLog->record( message, args ) )
 	{
 		vprintf( message, args );
 		printf( "\n" );
@@ -316,7 +810,11 @@ unsigned long GetTime(void)
   return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
 }
 
-unsigned long GetTime_Timeout(void)
+unsigned long long GetTime_Microseconds(void)
 {
-	return( 1000 );
+	struct timespec now;
+
+	if( clock_gettime( CLOCK_MONOTONIC, &now ) )
+		return( 0 );
+	return( now.tv_sec * 1000000ULL + now.tv_nsec / 1000 );
 }
@@ -0,0 +1,819 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        LinuxClient.cpp - Simulated serial drive client, for testing and benchmarking SerDrive
+//
+// serclient takes the place of the XTIDE Universal BIOS on an XT: it sends Inquire, Read and Write
+// commands to a server, checks every frame just as the BIOS does, and reports sectors per second,
+// latency percentiles and protocol errors.  Commands come from a synthetic access pattern, or from
+// a trace file that is replayed as fast as the server allows.  Several ports can be given, each is
+// driven by its own thread, to put a multi-port server under load.
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../library/Library.h"
+#include "LinuxConnect.h"
+
+//
+// Protocol, as in library/Process.cpp
+//
+#define SERIAL_COMMAND_HEADER 0xa0
+#define SERIAL_COMMAND_INQUIRE 0
+#define SERIAL_COMMAND_READ 2
+#define SERIAL_COMMAND_WRITE 3
+
+#define ATA_COMMAND_LBA 0x40
+#define ATA_DriveAndHead_Drive 0x10
+
+//
+// Inquire response words, as in library/Image.cpp
+//
+#define ATA_wCylCnt 1
+#define ATA_wHeadCnt 3
+#define ATA_wSPT 6
+#define ATA_dwLBACnt 60
+#define ATA_wSerialDriveFlags 158
+#define ATA_wSerialDriveFlags_Present 0x02
+
+#define CLIENT_MAXSECTORS 127               // largest transfer the BIOS makes
+#define CLIENT_RETRIES 3
+#define CLIENT_MAXPORTS 32
+
+//
+// Sectors we write start with this, followed by their LBA, so that a read can tell if it got
+// back one of our sectors from the wrong place
+//
+#define CLIENT_MAGIC 0x4c435358             // "XSCL"
+
+const char *bannerStrings[] = {
+	"serclient - XTIDE Universal BIOS Serial Drive Client Simulator",
+	"Copyright (C) 2012-2013 by XTIDE Universal BIOS Team",
+	"Released under GNU GPL v2, with ABSOLUTELY NO WARRANTY",
+	"",
+	NULL };
+
+const char *usageStrings[] = {
+	"Usage: serclient [options] port [port ...]",
+	"",
+	"  port                a serial device or pseudo-terminal, \"tcp:port\" on localhost,",
+	"                      or \"unix:path\", as served by SerDrive.  Each port is driven",
+	"                      by its own thread.",
+	"",
+	"  -p pattern          Access pattern, one of:",
+	"                          boot    reads moving forward through the disk, with",
+	"                                  the odd jump back as a new file is opened",
+	"                          fat     small reads and single sector writes, mostly",
+	"                                  near the start of the disk",
+	"                          burst   long sequential writes, then reading them back",
+	"                          random  reads and writes anywhere (default)",
+	"",
+	"  -t tracefile        Replay a trace instead, one command per line: \"r lba count\"",
+	"                      or \"w lba count\", optionally preceded by a drive number",
+	"",
+	"  -n commands         Number of commands to send on each port (default 1000),",
+	"                      a trace is replayed once",
+	"  -s sectors          Largest transfer, 1-127 sectors (default 127)",
+	"  -d drive            Drive 0 (default) or 1",
+	"  -r                  Read only, writes in the pattern become reads",
+	"  -b BaudRate         Baud rate given in the Inquire, and set on serial ports",
+	"                      (default 115.2K)",
+	"  -T milliseconds     Time to wait on the server before giving up on a command",
+	"                      (default 2000)",
+	"  -S seed             Random seed for the access pattern (default 1)",
+	"  -j                  Report as a line of JSON",
+	"  -v                  Report every protocol error",
+	NULL };
+
+void usagePrint( const char *strings[] )
+{
+	for( int t = 0; strings[t]; t++ )
+		fprintf( stderr, "%s\n", strings[t] );
+}
+
+#define usage() { usagePrint( usageStrings ); exit(1); }
+
+int verbose = 0;
+
+struct command {
+	int write;
+	int drive;
+	unsigned long lba;
+	unsigned long count;
+};
+
+struct clientStats {
+	struct histogram latency[ STATS_COMMANDS ];
+	unsigned long sectors[ STATS_COMMANDS ];
+
+	unsigned long checksumFailures;         // bad read frames
+	unsigned long echoFailures;             // write checksum not echoed correctly
+	unsigned long timeouts;
+	unsigned long dataFailures;             // one of our sectors read back from the wrong LBA
+	unsigned long retries;
+	unsigned long failed;                   // commands that failed every retry
+};
+
+struct client {
+	const char *name;
+	int fd;
+
+	struct clientStats stats;
+	unsigned long long elapsed;
+
+	struct command *trace;
+	unsigned long traceCount;
+
+	unsigned long totallba;
+	unsigned long long random;
+	unsigned long position;                 // for the sequential patterns
+	int burst;
+
+	union processBuffer buff;
+	unsigned short sector[ 256 ];
+
+	pthread_t thread;
+};
+
+//
+// Settings shared by all ports
+//
+struct baudRate *baudRate;
+const char *patternName = "random";
+unsigned long commandCount = 1000;
+unsigned long maxSectors = CLIENT_MAXSECTORS;
+int drive = 0;
+int readOnly = 0;
+unsigned long timeout = 2000;
+unsigned long long seed = 1;
+
+//====================================================================================================
+//
+// Connection
+//
+
+int sendBytes( struct client *c, void *buff, unsigned long len )
+{
+	ssize_t n;
+
+	while( len )
+	{
+		if( (n = write( c->fd, buff, len )) < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			log( -1, "'%s', write failed (error %i)", c->name, errno );
+		}
+
+		buff = (char *) buff + n;
+		len -= n;
+	}
+
+	return( 1 );
+}
+
+//
+// Returns 0 if the server doesn't send it all in time
+//
+int receiveBytes( struct client *c, void *buff, unsigned long len )
+{
+	unsigned long long deadline = GetTime_Microseconds() + timeout * 1000ULL, now;
+	struct pollfd p;
+	ssize_t n;
+
+	p.fd = c->fd;
+	p.events = POLLIN;
+
+	while( len )
+	{
+		if( (now = GetTime_Microseconds()) >= deadline || !poll( &p, 1, (int) ((deadline - now + 999) / 1000) ) )
+			return( 0 );
+
+		if( (n = read( c->fd, buff, len )) <= 0 )
+		{
+			if( n < 0 && (errno == EINTR || errno == EAGAIN) )
+				continue;
+			log( -1, "'%s', connection closed by the server", c->name );
+		}
+
+		buff = (char *) buff + n;
+		len -= n;
+	}
+
+	return( 1 );
+}
+
+//
+// After an error, wait until the server has given up on the command too (it times out after a
+// second of silence), throwing away anything it still sends
+//
+void resync( struct client *c )
+{
+	unsigned char discard[ 1024 ];
+	struct pollfd p;
+
+	p.fd = c->fd;
+	p.events = POLLIN;
+
+	while( poll( &p, 1, 1200 ) > 0 )
+		if( read( c->fd, discard, sizeof(discard) ) <= 0 )
+			break;
+}
+
+//====================================================================================================
+//
+// Commands
+//
+
+void sendHeader( struct client *c, int command, int drive, unsigned long lba, unsigned long count )
+{
+	unsigned char *h = &c->buff.b[0];
+
+	h[0] = SERIAL_COMMAND_HEADER | command;
+	h[1] = ATA_COMMAND_LBA | (drive ? ATA_DriveAndHead_Drive : 0) | ((lba >> 24) & 0xf);
+	h[2] = (unsigned char) count;
+	h[3] = (unsigned char) lba;
+	h[4] = (unsigned char) (lba >> 8);
+	h[5] = (unsigned char) (lba >> 16);
+	c->buff.w[3] = checksum( &c->buff.w[0], 3 );
+
+	sendBytes( c, h, 8 );
+}
+
+//
+// Returns 0 if there was no good answer
+//
+int inquire( struct client *c, int drive )
+{
+	c->buff.inquire.command = SERIAL_COMMAND_HEADER | SERIAL_COMMAND_INQUIRE;
+	c->buff.inquire.driveAndHead = drive ? ATA_DriveAndHead_Drive : 0;
+	c->buff.inquire.count = 1;
+	c->buff.inquire.scan = 0;
+	c->buff.inquire.port = 0x3f8 >> 2;
+	c->buff.inquire.baud = baudRate->divisor == 0xff ? 1 : baudRate->divisor;
+	c->buff.w[3] = checksum( &c->buff.w[0], 3 );
+
+	sendBytes( c, &c->buff.b[0], 8 );
+
+	if( !receiveBytes( c, &c->buff.b[0], 514 ) )
+	{
+		c->stats.timeouts++;
+		if( verbose )
+			log( 0, "%s: Timeout waiting for Inquire response", c->name );
+		return( 0 );
+	}
+	if( checksum( &c->buff.w[0], 256 ) != c->buff.w[256] )
+	{
+		c->stats.checksumFailures++;
+		if( verbose )
+			log( 0, "%s: Bad Inquire checksum", c->name );
+		return( 0 );
+	}
+
+	if( !(c->buff.w[ ATA_wSerialDriveFlags ] & ATA_wSerialDriveFlags_Present) )
+		log( -1, "'%s', drive %d not present", c->name, drive );
+
+	c->totallba = c->buff.w[ ATA_dwLBACnt ] | ((unsigned long) c->buff.w[ ATA_dwLBACnt+1 ] << 16);
+	if( !c->totallba )
+		c->totallba = (unsigned long) c->buff.w[ ATA_wCylCnt ] * c->buff.w[ ATA_wHeadCnt ] * c->buff.w[ ATA_wSPT ];
+
+	return( 1 );
+}
+
+void fillSector( struct client *c, unsigned long lba )
+{
+	c->sector[0] = CLIENT_MAGIC & 0xffff;
+	c->sector[1] = CLIENT_MAGIC >> 16;
+	c->sector[2] = (unsigned short) lba;
+	c->sector[3] = (unsigned short) (lba >> 16);
+	for( int t = 4; t < 256; t++ )
+		c->sector[t] = (unsigned short) (lba * 2654435761UL + t);
+}
+
+//
+// One attempt at a read or write, returns 0 on any error
+//
+int transfer( struct client *c, struct command *cmd )
+{
+	unsigned char ack;
+	unsigned short echo;
+
+	sendHeader( c, cmd->write ? SERIAL_COMMAND_WRITE : SERIAL_COMMAND_READ, cmd->drive, cmd->lba, cmd->count );
+
+	for( unsigned long t = 0; t < cmd->count; t++ )
+	{
+		if( cmd->write )
+		{
+			fillSector( c, cmd->lba + t );
+			memcpy( &c->buff.w[0], c->sector, 512 );
+			c->buff.w[256] = checksum( &c->buff.w[0], 256 );
+			sendBytes( c, &c->buff.b[0], 514 );
+
+			if( !receiveBytes( c, &echo, 2 ) )
+			{
+				c->stats.timeouts++;
+				if( verbose )
+					log( 0, "%s: Timeout waiting for write echo, LBA=%lu", c->name, cmd->lba + t );
+				return( 0 );
+			}
+			if( echo != c->buff.w[256] )
+			{
+				c->stats.echoFailures++;
+				if( verbose )
+					log( 0, "%s: Bad write echo %04x, expected %04x, LBA=%lu", c->name, echo, c->buff.w[256], cmd->lba + t );
+				return( 0 );
+			}
+		}
+		else
+		{
+			if( !receiveBytes( c, &c->buff.b[0], 514 ) )
+			{
+				c->stats.timeouts++;
+				if( verbose )
+					log( 0, "%s: Timeout waiting for sector, LBA=%lu", c->name, cmd->lba + t );
+				return( 0 );
+			}
+			if( checksum( &c->buff.w[0], 256 ) != c->buff.w[256] )
+			{
+				c->stats.checksumFailures++;
+				if( verbose )
+					log( 0, "%s: Bad read checksum, LBA=%lu", c->name, cmd->lba + t );
+				return( 0 );
+			}
+			if( c->buff.w[0] == (CLIENT_MAGIC & 0xffff) && c->buff.w[1] == (CLIENT_MAGIC >> 16) )
+			{
+				fillSector( c, cmd->lba + t );
+				if( memcmp( c->sector, &c->buff.w[0], 512 ) )
+				{
+					c->stats.dataFailures++;
+					if( verbose )
+						log( 0, "%s: Sector read from LBA=%lu was written elsewhere", c->name, cmd->lba + t );
+				}
+			}
+		}
+
+		if( t + 1 < cmd->count )
+		{
+			ack = (unsigned char) (cmd->count - t - 1);
+			sendBytes( c, &ack, 1 );
+		}
+	}
+
+	return( 1 );
+}
+
+//====================================================================================================
+//
+// Access patterns
+//
+
+unsigned long nextRandom( struct client *c, unsigned long range )
+{
+	c->random ^= c->random >> 12;
+	c->random ^= c->random << 25;
+	c->random ^= c->random >> 27;
+
+	return( range ? (unsigned long) ((c->random * 0x2545f4914f6cdd1dULL) >> 33) % range : 0 );
+}
+
+//
+// Sets the LBA, keeping the whole transfer on the disk
+//
+void placeCommand( struct client *c, struct command *cmd, unsigned long lba )
+{
+	if( cmd->count > c->totallba )
+		cmd->count = c->totallba;
+	if( lba > c->totallba - cmd->count )
+		lba = c->totallba - cmd->count;
+	cmd->lba = lba;
+}
+
+void patternBoot( struct client *c, struct command *cmd )
+{
+	cmd->write = 0;
+	cmd->count = 1 + nextRandom( c, maxSectors );
+
+	if( !nextRandom( c, 16 ) || c->position >= c->totallba )
+		c->position = nextRandom( c, 4 ) ? nextRandom( c, c->totallba ) : 0;
+
+	placeCommand( c, cmd, c->position );
+	c->position = cmd->lba + cmd->count;
+}
+
+void patternFat( struct client *c, struct command *cmd )
+{
+	unsigned long fatArea = c->totallba / 64 > 64 ? c->totallba / 64 : 64;
+
+	cmd->write = nextRandom( c, 4 ) == 0;
+	cmd->count = cmd->write ? 1 : 1 + nextRandom( c, maxSectors < 4 ? maxSectors : 4 );
+
+	placeCommand( c, cmd, nextRandom( c, 10 ) < 7 ? nextRandom( c, fatArea ) : nextRandom( c, c->totallba ) );
+}
+
+//
+// Eight writes one after the other, then the same eight reads
+//
+void patternBurst( struct client *c, struct command *cmd )
+{
+	if( !(c->burst % 16) )
+		c->position = nextRandom( c, c->totallba );
+
+	cmd->write = (c->burst % 16) < 8;
+	cmd->count = maxSectors;
+	placeCommand( c, cmd, c->position + (c->burst % 8) * maxSectors );
+
+	c->burst++;
+}
+
+void patternRandom( struct client *c, struct command *cmd )
+{
+	cmd->write = nextRandom( c, 10 ) < 3;
+	cmd->count = 1 + nextRandom( c, maxSectors );
+	placeCommand( c, cmd, nextRandom( c, c->totallba ) );
+}
+
+struct pattern {
+	const char *name;
+	void (*next)( struct client *c, struct command *cmd );
+} patterns[] = {
+	{ "boot", patternBoot },
+	{ "fat", patternFat },
+	{ "burst", patternBurst },
+	{ "random", patternRandom },
+	{ NULL, NULL }
+};
+
+struct pattern *pattern;
+
+//
+// Lines of "r lba count" or "w lba count", with an optional drive number first
+//
+struct command *loadTrace( const char *name, unsigned long *count )
+{
+	struct command *trace = NULL;
+	unsigned long size = 0;
+	char line[ 256 ], op;
+	FILE *f;
+
+	if( !(f = fopen( name, "r" )) )
+		log( -1, "Could not open trace '%s'", name );
+
+	*count = 0;
+
+	while( fgets( line, sizeof(line), f ) )
+	{
+		struct command cmd;
+		char *p = line;
+
+		while( isspace( *p ) )
+			p++;
+		if( !*p || *p == '#' )
+			continue;
+
+		cmd.drive = drive;
+		if( isdigit( *p ) )
+			cmd.drive = strtol( p, &p, 10 );
+
+		if( sscanf( p, " %c %lu %lu", &op, &cmd.lba, &cmd.count ) != 3 || (op != 'r' && op != 'w') ||
+			!cmd.count || cmd.count > CLIENT_MAXSECTORS )
+			log( -1, "'%s', bad trace line: %s", name, line );
+		cmd.write = (op == 'w');
+
+		if( *count == size )
+		{
+			size = size ? size * 2 : 1024;
+			if( !(trace = (struct command *) realloc( trace, size * sizeof(struct command) )) )
+				log( -1, "Out of memory for trace '%s'", name );
+		}
+		trace[ (*count)++ ] = cmd;
+	}
+
+	fclose( f );
+
+	if( !*count )
+		log( -1, "'%s', trace is empty", name );
+
+	return( trace );
+}
+
+//====================================================================================================
+//
+// Running and reporting
+//
+
+void *clientThread( void *arg )
+{
+	struct client *c = (struct client *) arg;
+	struct command cmd;
+	unsigned long long start, t0;
+	unsigned long n;
+	int which, attempt;
+
+	c->fd = connectPort( c->name, baudRate );
+
+	t0 = GetTime_Microseconds();
+	for( attempt = 0; attempt < CLIENT_RETRIES && !inquire( c, drive ); attempt++ )
+	{
+		c->stats.retries++;
+		resync( c );
+	}
+	if( attempt == CLIENT_RETRIES )
+		log( -1, "'%s', no answer to Inquire", c->name );
+	histogramAdd( &c->stats.latency[ STATS_INQUIRE ], GetTime_Microseconds() - t0 );
+	c->stats.sectors[ STATS_INQUIRE ]++;
+
+	n = c->trace ? c->traceCount : commandCount;
+
+	start = GetTime_Microseconds();
+
+	for( unsigned long t = 0; t < n; t++ )
+	{
+		if( c->trace )
+			cmd = c->trace[t];
+		else
+		{
+			cmd.drive = drive;
+			pattern->next( c, &cmd );
+		}
+		if( readOnly )
+			cmd.write = 0;
+
+		which = cmd.write ? STATS_WRITE : STATS_READ;
+
+		t0 = GetTime_Microseconds();
+
+		for( attempt = 0; attempt < CLIENT_RETRIES && !transfer( c, &cmd ); attempt++ )
+		{
+			c->stats.retries++;
+			resync( c );
+		}
+
+		if( attempt == CLIENT_RETRIES )
+			c->stats.failed++;
+		else
+		{
+			histogramAdd( &c->stats.latency[ which ], GetTime_Microseconds() - t0 );
+			c->stats.sectors[ which ] += cmd.count;
+		}
+	}
+
+	c->elapsed = GetTime_Microseconds() - start;
+
+	close( c->fd );
+
+	return( NULL );
+}
+
+void histogramMerge( struct histogram *to, struct histogram *from )
+{
+	to->count += from->count;
+	to->sum += from->sum;
+	if( from->max > to->max )
+		to->max = from->max;
+	for( int b = 0; b < STATS_BUCKETS; b++ )
+		to->buckets[b] += from->buckets[b];
+}
+
+const char *commandNames[ STATS_COMMANDS ] = { "inquire", "read", "write" };
+
+void report( const char *name, struct clientStats *s, unsigned long long elapsed, int json )
+{
+	unsigned long sectors = s->sectors[ STATS_READ ] + s->sectors[ STATS_WRITE ];
+	double seconds = elapsed / 1e6;
+	struct histogram *h;
+
+	if( json )
+	{
+		printf( "{\"port\":\"%s\",\"seconds\":%.3f,\"sectorsPerSecond\":%.1f", name, seconds, seconds ? sectors / seconds : 0.0 );
+		for( int c = STATS_READ; c < STATS_COMMANDS; c++ )
+		{
+			h = &s->latency[c];
+			printf( ",\"%s\":{\"commands\":%lu,\"sectors\":%lu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+					commandNames[c], h->count, s->sectors[c], histogramPercentile( h, 50 ), histogramPercentile( h, 90 ),
+					histogramPercentile( h, 99 ), histogramPercentile( h, 99.9 ), h->max );
+		}
+		printf( ",\"checksumFailures\":%lu,\"echoFailures\":%lu,\"timeouts\":%lu,\"dataFailures\":%lu,\"retries\":%lu,\"failed\":%lu}",
+				s->checksumFailures, s->echoFailures, s->timeouts, s->dataFailures, s->retries, s->failed );
+		return;
+	}
+
+	printf( "%s: %lu sectors in %.3f s, %.0f sectors/s, %.1f KB/s\n", name, sectors, seconds,
+			seconds ? sectors / seconds : 0.0, seconds ? sectors / seconds / 2 : 0.0 );
+	printf( "    %-8s %8s %8s %10s %10s %10s %10s %10s\n", "", "commands", "sectors", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us" );
+	for( int c = STATS_READ; c < STATS_COMMANDS; c++ )
+	{
+		h = &s->latency[c];
+		printf( "    %-8s %8lu %8lu %10llu %10llu %10llu %10llu %10llu\n", commandNames[c], h->count, s->sectors[c],
+				histogramPercentile( h, 50 ), histogramPercentile( h, 90 ), histogramPercentile( h, 99 ),
+				histogramPercentile( h, 99.9 ), h->max );
+	}
+	printf( "    errors: checksum %lu, echo %lu, timeouts %lu, data %lu, retries %lu, failed %lu\n",
+			s->checksumFailures, s->echoFailures, s->timeouts, s->dataFailures, s->retries, s->failed );
+}
+
+int main( int argc, char *argv[] )
+{
+	static struct client clients[ CLIENT_MAXPORTS ];
+	struct clientStats total;
+	unsigned long long elapsed = 0;
+	const char *traceName = NULL;
+	int count = 0, json = 0;
+
+	baudRate = baudRateMatchString( "115200" );
+
+	for( int t = 1; t < argc; t++ )
+	{
+		char *next = (t+1 < argc ? argv[t+1] : NULL );
+
+		if( argv[t][0] == '-' )
+		{
+			char option = argv[t][1];
+
+			//
+			// All but the flags take a value
+			//
+			if( !option || !strchr( "rjv", option ) )
+			{
+				if( !next )
+					usage();
+				t++;
+			}
+
+			switch( option )
+			{
+			case 'p':
+				patternName = next;
+				break;
+			case 't':
+				traceName = next;
+				break;
+			case 'n':
+				if( !(commandCount = atol( next )) )
+					usage();
+				break;
+			case 's':
+				if( !(maxSectors = atol( next )) || maxSectors > CLIENT_MAXSECTORS )
+					usage();
+				break;
+			case 'd':
+				drive = atoi( next );
+				if( drive != 0 && drive != 1 )
+					usage();
+				break;
+			case 'b':
+				if( !(baudRate = baudRateMatchString( next )) || !baudRate->rate )
+					log( -2, "Unknown Baud Rate \"%s\"", next );
+				break;
+			case 'T':
+				if( !(timeout = atol( next )) )
+					usage();
+				break;
+			case 'S':
+				seed = strtoull( next, NULL, 0 );
+				break;
+			case 'r':
+				readOnly = 1;
+				break;
+			case 'j':
+				json = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				log( -2, "Unknown Option: \"-%c\"", option );
+			}
+		}
+		else
+		{
+			if( count == CLIENT_MAXPORTS )
+				log( -2, "No more than %d ports can be driven", CLIENT_MAXPORTS );
+			clients[ count++ ].name = argv[t];
+		}
+	}
+
+	if( !count )
+		usage();
+
+	if( !json )
+		usagePrint( bannerStrings );
+
+	for( pattern = patterns; pattern->name && strcmp( pattern->name, patternName ); pattern++ ) ;
+	if( !pattern->name )
+		log( -2, "Unknown pattern \"%s\"", patternName );
+
+	for( int t = 0; t < count; t++ )
+	{
+		if( traceName )
+			clients[t].trace = loadTrace( traceName, &clients[t].traceCount );
+		clients[t].random = seed * 0x9e3779b97f4a7c15ULL + t + 1;
+
+		if( pthread_create( &clients[t].thread, NULL, clientThread, &clients[t] ) )
+			log( -1, "Could not start a thread for '%s'", clients[t].name );
+	}
+
+	memset( &total, 0, sizeof(total) );
+
+	if( json )
+		printf( "{\"pattern\":\"%s\",\"ports\":[", traceName ? traceName : patternName );
+
+	for( int t = 0; t < count; t++ )
+	{
+		struct clientStats *s = &clients[t].stats;
+
+		pthread_join( clients[t].thread, NULL );
+
+		if( json && t )
+			printf( "," );
+		report( clients[t].name, s, clients[t].elapsed, json );
+
+		for( int c = 0; c < STATS_COMMANDS; c++ )
+		{
+			histogramMerge( &total.latency[c], &s->latency[c] );
+			total.sectors[c] += s->sectors[c];
+		}
+		total.checksumFailures += s->checksumFailures;
+		total.echoFailures += s->echoFailures;
+		total.timeouts += s->timeouts;
+		total.dataFailures += s->dataFailures;
+		total.retries += s->retries;
+		total.failed += s->failed;
+
+		if( clients[t].elapsed > elapsed )
+			elapsed = clients[t].elapsed;
+	}
+
+	if( json )
+	{
+		printf( "],\"total\":" );
+		report( "total", &total, elapsed, 1 );
+		printf( "}\n" );
+	}
+	else if( count > 1 )
+		report( "total", &total, elapsed, 0 );
+
+	return( total.failed || total.dataFailures ? 2 : 0 );
+}
+
+void log( int level, const char *message, ... )
+{
+	va_list args;
+
+	va_start( args, message );
+
+	if( level < 0 )
+	{
+		fprintf( stderr, "ERROR: " );
+		vfprintf( stderr, message, args );
+		fprintf( stderr, "\n" );
+		if( level < -1 )
+		{
+			fprintf( stderr, "\n" );
+			usage();
+		}
+		exit( 1 );
+	}
+	else if( verbose >= level )
+	{
+		vfprintf( stderr, message, args );
+		fprintf( stderr, "\n" );
+	}
+
+	va_end( args );
+}
+
+unsigned long long GetTime_Microseconds(void)
+{
+	struct timespec now;
+
+	if( clock_gettime( CLOCK_MONOTONIC, &now ) )
+		return( 0 );
+	return( now.tv_sec * 1000000ULL + now.tv_nsec / 1000 );
+}
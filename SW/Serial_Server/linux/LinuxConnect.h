@@ -0,0 +1,89 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        LinuxConnect.h - Client end of a connection to SerDrive, for the test tools
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+#ifndef LINUXCONNECT_H_INCLUDED
+#define LINUXCONNECT_H_INCLUDED
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../library/Library.h"
+
+//
+// 'name' is a serial device or pseudo-terminal, set to 'baudRate', or a socket as served by SerDrive:
+// "tcp:port" on localhost, or "unix:path"
+//
+static int connectPort( const char *name, struct baudRate *baudRate )
+{
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+	struct termios state;
+	int fd, on = 1;
+
+	if( !strncmp( name, "tcp:", 4 ) )
+	{
+		memset( &in, 0, sizeof(in) );
+		in.sin_family = AF_INET;
+		in.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+		in.sin_port = htons( atoi( &name[4] ) );
+
+		if( (fd = socket( AF_INET, SOCK_STREAM, 0 )) < 0 || connect( fd, (struct sockaddr *) &in, sizeof(in) ) )
+			log( -1, "'%s', could not connect (error %i)", name, errno );
+
+		setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+	}
+	else if( !strncmp( name, "unix:", 5 ) )
+	{
+		memset( &un, 0, sizeof(un) );
+		un.sun_family = AF_UNIX;
+		strncpy( un.sun_path, &name[5], sizeof(un.sun_path) - 1 );
+
+		if( (fd = socket( AF_UNIX, SOCK_STREAM, 0 )) < 0 || connect( fd, (struct sockaddr *) &un, sizeof(un) ) )
+			log( -1, "'%s', could not connect (error %i)", name, errno );
+	}
+	else
+	{
+		if( (fd = open( name, O_RDWR | O_NOCTTY )) < 0 )
+			log( -1, "Could not Open \"%s\"", name );
+
+		tcgetattr( fd, &state );
+		cfmakeraw( &state );
+		state.c_cflag |= CLOCAL;
+		cfsetispeed( &state, baudRate->speed );
+		cfsetospeed( &state, baudRate->speed );
+		tcsetattr( fd, TCSAFLUSH, &state );          // also drops anything left over from an earlier client
+	}
+
+	return( fd );
+}
+
+#endif
@@ -0,0 +1,663 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        LinuxControl.h - Changing the images behind the drives while serving
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// DriveControl listens on a Unix domain socket (-u) for commands to change the image behind a
+// drive, without the serial connection being dropped.  Commands are lines of text, and each is
+// answered with any number of lines, and then "ok" or "error <reason>":
+//
+//     stats                           one line for each drive of each port, with the image and
+//                                     the commands completed on it
+//     eject <port> <drive>            leaves the drive empty
+//     insert <port> <drive> [-r] <image>
+//     swap <port> <drive> [-r] <image>
+//
+// Ports are numbered from 0 in the order they were given with -c, and drives are 0 or 1.  -r
+// serves the image read only.  For example:
+//
+//     echo "swap 0 1 /images/dos622-disk2.img" | socat - UNIX-CONNECT:/tmp/serdrive.ctl
+//
+// A change waits for any command in progress on the drive to finish, and for the image's worker
+// to finish its jobs, before it is made and answered; the connection carries on with the new
+// image from its next command.  A command that hasn't finished after CONTROL_DRAIN_TIMEOUT (the
+// client may have gone away in the middle of it) is abandoned.  All of this runs on the thread
+// serving the ports (see LinuxServer.cpp), between their commands, so nothing here is locked.
+//
+// The BIOS learns what is behind each drive when it boots, so a drive keeps to the kind of disk it
+// started with: a floppy drive takes floppy images (those of one of the sizes in floppyInfos, see
+// FindFloppyInfoBySize), and a hard disk takes images of the same size and geometry.  A drive that
+// started out empty takes either.  Images are opened as flat files, with the sector cache in front
+// if there is one, and closed again once no drive is using them.  Images given on the command line
+// are kept open, and are used again if they are inserted by name.
+//
+
+#ifndef LINUXCONTROL_H_INCLUDED
+#define LINUXCONTROL_H_INCLUDED
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "../library/Library.h"
+#include "../library/FlatImage.h"
+#include "../library/CachedImage.h"
+#include "../library/ImageWorker.h"
+
+#define CONTROL_EVENT 0x20000000          // epoll event is for the control socket, or one of its clients
+#define CONTROL_CLIENTS 8
+#define CONTROL_LINE 1024
+#define CONTROL_DRAIN_TIMEOUT 5000        // milliseconds
+
+struct controlImage {
+	char *path;                           // real path, shortFileName points into it
+	Image *image;                         // as served, a CachedImage in front of 'raw' if there is a cache
+	Image *raw;
+	int owned;                            // opened here, and closed once no drive uses it
+	struct controlImage *next;
+};
+
+//
+// What the BIOS was told about each drive
+//
+struct controlDrive {
+	int known;
+	unsigned char floppy;
+	unsigned long cyl, head, sect, totallba;
+	int useCHS;
+};
+
+struct controlClient {
+	int fd;                               // -1 if not connected
+	char line[ CONTROL_LINE ];
+	int length;
+	int closing;                          // nothing more will be read, close once answered
+
+	//
+	// A change waiting on the commands in progress
+	//
+	int changing;
+	int port, drive;
+	struct controlImage *to;              // NULL to eject
+	unsigned long deadline;
+};
+
+class DriveControl
+{
+public:
+	DriveControl( const char *path, DriveTable *p_drives, SectorCache *p_cache )
+	{
+		struct sockaddr_un un;
+		struct stat st;
+		Image *img;
+
+		drives = p_drives;
+		cache = p_cache;
+		images = NULL;
+		epfd = -1;
+		notify = NULL;
+
+		for( int c = 0; c < CONTROL_CLIENTS; c++ )
+			clients[c].fd = -1;
+
+		if( !(known = (struct controlDrive *) calloc( drives->ports * 2, sizeof(struct controlDrive) )) )
+			log( -1, "Out of memory for the control socket" );
+
+		for( int t = 0; t < drives->ports * 2; t++ )
+			if( (img = drives->image( t / 2, t % 2 )) )
+				remember( &known[t], img );
+
+		memset( &un, 0, sizeof(un) );
+		un.sun_family = AF_UNIX;
+		if( strlen( path ) >= sizeof(un.sun_path) || !path[0] )
+			log( -2, "'%s', bad Unix socket path", path );
+		strcpy( un.sun_path, path );
+
+		//
+		// A socket left behind by an earlier server is replaced, but nothing else is
+		//
+		if( !stat( un.sun_path, &st ) && S_ISSOCK( st.st_mode ) )
+			unlink( un.sun_path );
+
+		if( (listener = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 )) < 0 )
+			log( -1, "'%s', could not create control socket (error %i)", path, errno );
+
+		if( bind( listener, (struct sockaddr *) &un, sizeof(un) ) )
+			log( -1, "'%s', could not bind control socket (error %i)", path, errno );
+
+		if( listen( listener, CONTROL_CLIENTS ) )
+			log( -1, "'%s', could not listen on control socket (error %i)", path, errno );
+
+		log( 1, "Control socket: %s", path );
+	}
+
+	//
+	// An image given on the command line, which can be inserted again by name
+	//
+	void opened( const char *path, Image *image )
+	{
+		struct controlImage *ci;
+
+		if( !(ci = (struct controlImage *) malloc( sizeof(struct controlImage) )) || !(ci->path = strdup( path )) )
+			log( -1, "Out of memory for the control socket" );
+
+		ci->image = ci->raw = image;
+		ci->owned = 0;
+		ci->next = images;
+		images = ci;
+	}
+
+	//
+	// Called by serveRequests, which gives the epoll instance and what workers call once a job
+	// is done
+	//
+	void serve( int p_epfd, void (*p_notify)( void *arg ) )
+	{
+		struct epoll_event ev;
+
+		epfd = p_epfd;
+		notify = p_notify;
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = CONTROL_EVENT;
+		if( epoll_ctl( epfd, EPOLL_CTL_ADD, listener, &ev ) )
+			log( -1, "Could not add control socket to epoll (error %i)", errno );
+	}
+
+	//
+	// For an epoll event with CONTROL_EVENT set
+	//
+	void event( unsigned int data, unsigned int events, ProcessState *states[], int count )
+	{
+		struct controlClient *cl;
+		int n;
+
+		if( !(data & ~CONTROL_EVENT) )
+		{
+			acceptClient();
+			return;
+		}
+
+		cl = &clients[ (data & ~CONTROL_EVENT) - 1 ];
+		if( cl->fd < 0 )
+			return;
+
+		if( cl->length == CONTROL_LINE )
+		{
+			reply( cl, "error line too long" );
+			cl->length = 0;
+		}
+
+		n = read( cl->fd, &cl->line[ cl->length ], CONTROL_LINE - cl->length );
+		if( n > 0 )
+			cl->length += n;
+		else if( n == 0 || (errno != EAGAIN && errno != EINTR) || (events & (EPOLLHUP | EPOLLERR)) )
+			cl->closing = 1;
+
+		input( cl, states, count );
+	}
+
+	//
+	// Makes the changes whose drives are now free, and returns how long epoll may wait before
+	// this is to be called again, or -1 if no change is waiting
+	//
+	int carryOn( ProcessState *states[], int count )
+	{
+		int waiting = 0;
+
+		for( int c = 0; c < CONTROL_CLIENTS; c++ )
+		{
+			if( clients[c].fd < 0 || !clients[c].changing )
+				continue;
+
+			if( change( &clients[c], states, count ) )
+				input( &clients[c], states, count );
+			else
+				waiting = 1;
+		}
+
+		return( waiting ? 50 : -1 );
+	}
+
+private:
+	DriveTable *drives;
+	SectorCache *cache;
+	struct controlImage *images;
+	struct controlDrive *known;
+
+	int listener, epfd;
+	void (*notify)( void *arg );
+
+	struct controlClient clients[ CONTROL_CLIENTS ];
+
+	void remember( struct controlDrive *k, Image *img )
+	{
+		k->known = 1;
+		k->floppy = img->floppy;
+		k->cyl = img->cyl;
+		k->head = img->head;
+		k->sect = img->sect;
+		k->totallba = img->totallba;
+		k->useCHS = img->useCHS;
+	}
+
+	void acceptClient( void )
+	{
+		struct epoll_event ev;
+		int fd, c;
+
+		if( (fd = accept4( listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC )) < 0 )
+			return;
+
+		for( c = 0; c < CONTROL_CLIENTS && clients[c].fd >= 0; c++ ) ;
+		if( c == CONTROL_CLIENTS )
+		{
+			if( write( fd, "error too many control connections\n", 35 ) < 0 )
+				;
+			close( fd );
+			return;
+		}
+
+		clients[c].fd = fd;
+		clients[c].length = 0;
+		clients[c].closing = 0;
+		clients[c].changing = 0;
+
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.u32 = CONTROL_EVENT | (c + 1);
+		if( epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev ) )
+			log( -1, "Could not add control connection to epoll (error %i)", errno );
+	}
+
+	void reply( struct controlClient *cl, const char *message, ... )
+	{
+		char buff[ CONTROL_LINE + 32 ];
+		va_list args;
+		int n;
+
+		va_start( args, message );
+		n = vsnprintf( buff, sizeof(buff) - 1, message, args );
+		va_end( args );
+
+		if( n > (int) sizeof(buff) - 2 )
+			n = sizeof(buff) - 2;
+		buff[n++] = '\n';
+
+		//
+		// Answers are short, and a client that doesn't read them only loses them
+		//
+		if( write( cl->fd, buff, n ) < 0 )
+			;
+	}
+
+	//
+	// Carries out the complete lines that have been read, stopping at a change that has to wait
+	//
+	void input( struct controlClient *cl, ProcessState *states[], int count )
+	{
+		char *end;
+		int n;
+
+		while( !cl->changing && (end = (char *) memchr( cl->line, '\n', cl->length )) )
+		{
+			*end = 0;
+			n = end + 1 - cl->line;
+
+			command( cl, cl->line, states, count );
+
+			memmove( cl->line, end + 1, cl->length - n );
+			cl->length -= n;
+		}
+
+		if( cl->closing && !cl->changing )
+		{
+			epoll_ctl( epfd, EPOLL_CTL_DEL, cl->fd, NULL );
+			close( cl->fd );
+			cl->fd = -1;
+		}
+	}
+
+	void command( struct controlClient *cl, char *line, ProcessState *states[], int count )
+	{
+		char *cmd, *arg, *path;
+		int port, drive, readOnly = 0;
+		struct driveSlot *slot;
+		char error[ CONTROL_LINE ];
+
+		for( char *c = line; *c; c++ )
+			if( *c == '\r' )
+				*c = 0;
+
+		if( !(cmd = strtok( line, " \t" )) )
+			return;
+
+		if( !strcmp( cmd, "stats" ) )
+		{
+			stats( cl, states, count );
+			reply( cl, "ok" );
+			return;
+		}
+
+		if( strcmp( cmd, "eject" ) && strcmp( cmd, "insert" ) && strcmp( cmd, "swap" ) )
+		{
+			reply( cl, "error unknown command '%s', use stats, eject, insert or swap", cmd );
+			return;
+		}
+
+		arg = strtok( NULL, " \t" );
+		port = arg ? atoi( arg ) : -1;
+		arg = strtok( NULL, " \t" );
+		drive = arg ? atoi( arg ) : -1;
+
+		if( port < 0 || port >= drives->ports || (drive != 0 && drive != 1) )
+		{
+			reply( cl, "error give a port from 0 to %d, and drive 0 or 1", drives->ports - 1 );
+			return;
+		}
+
+		slot = drives->slot( port, drive );
+
+		for( int c = 0; c < CONTROL_CLIENTS; c++ )
+			if( clients[c].fd >= 0 && clients[c].changing && clients[c].port == port && clients[c].drive == drive )
+			{
+				reply( cl, "error port %d drive %d is already being changed", port, drive );
+				return;
+			}
+
+		if( !strcmp( cmd, "eject" ) )
+		{
+			if( !slot->image )
+			{
+				reply( cl, "error port %d drive %d is empty", port, drive );
+				return;
+			}
+			cl->to = NULL;
+		}
+		else
+		{
+			if( !strcmp( cmd, "insert" ) && slot->image )
+			{
+				reply( cl, "error port %d drive %d already has '%s', eject it or swap", port, drive, slot->image->shortFileName );
+				return;
+			}
+			if( !strcmp( cmd, "swap" ) && !slot->image )
+			{
+				reply( cl, "error port %d drive %d is empty, insert an image", port, drive );
+				return;
+			}
+
+			for( path = strtok( NULL, "" ); path && (*path == ' ' || *path == '\t'); path++ ) ;
+			if( path && !strncmp( path, "-r", 2 ) && (path[2] == ' ' || path[2] == '\t') )
+			{
+				readOnly = 1;
+				for( path += 2; *path == ' ' || *path == '\t'; path++ ) ;
+			}
+			if( !path || !*path )
+			{
+				reply( cl, "error no image given" );
+				return;
+			}
+
+			if( !(cl->to = openImage( path, readOnly, port, drive, error )) )
+			{
+				reply( cl, "error %s", error );
+				return;
+			}
+		}
+
+		cl->changing = 1;
+		cl->port = port;
+		cl->drive = drive;
+		cl->deadline = GetTime() + CONTROL_DRAIN_TIMEOUT;
+
+		//
+		// No more is read from the client until the change has been made
+		//
+		epoll_ctl( epfd, EPOLL_CTL_DEL, cl->fd, NULL );
+
+		if( change( cl, states, count ) )
+			return;
+
+		log( 1, "Port %d drive %d: waiting for the command in progress to finish", port, drive );
+	}
+
+	//
+	// Makes the change once no connection has a command in progress on the image, and returns 1,
+	// or returns 0 to be called again
+	//
+	int change( struct controlClient *cl, ProcessState *states[], int count )
+	{
+		struct driveSlot *slot = drives->slot( cl->port, cl->drive );
+		Image *from = slot->image;
+		DriveWorker *fromWorker = slot->worker;
+		struct epoll_event ev;
+		int busy = 0, parked = 0;
+
+		for( int t = 0; t < count; t++ )
+			if( states[t]->port == cl->port && from && states[t]->release( from ) )
+			{
+				busy = 1;
+				parked |= states[t]->waiting();
+			}
+
+		if( busy )
+		{
+			//
+			// A command waiting on the worker is always let finish, the worker will get to it
+			//
+			if( GetTime() < cl->deadline || parked )
+				return( 0 );
+
+			for( int t = 0; t < count; t++ )
+				if( states[t]->port == cl->port && from && states[t]->release( from ) )
+					states[t]->abandon();
+		}
+
+		if( fromWorker )
+			fromWorker->drain();
+
+		slot->image = cl->to ? cl->to->image : NULL;
+		slot->worker = NULL;
+		if( cl->to && !(slot->worker = cl->to->image == from ? fromWorker : drives->findWorker( cl->to->image )) )
+			slot->worker = new ImageWorker( cl->to->image, notify, NULL );
+		slot->changes++;
+
+		if( cl->to )
+		{
+			if( !known[ cl->port * 2 + cl->drive ].known )
+				remember( &known[ cl->port * 2 + cl->drive ], cl->to->image );
+			log( 0, "Port %d drive %d: '%s'%s", cl->port, cl->drive, cl->to->path, cl->to->image->readOnly ? ", read only" : "" );
+		}
+		else
+			log( 0, "Port %d drive %d: ejected", cl->port, cl->drive );
+
+		if( from && !drives->uses( from ) )
+		{
+			delete fromWorker;
+			from->flush();
+			forget( from );
+		}
+
+		cl->changing = 0;
+		reply( cl, "ok" );
+
+		if( !cl->closing )
+		{
+			ev.events = EPOLLIN | EPOLLRDHUP;
+			ev.data.u32 = CONTROL_EVENT | (cl - clients + 1);
+			if( epoll_ctl( epfd, EPOLL_CTL_ADD, cl->fd, &ev ) )
+				log( -1, "Could not add control connection to epoll (error %i)", errno );
+		}
+
+		return( 1 );
+	}
+
+	//
+	// An image no drive is using any more is closed, if it was opened here
+	//
+	void forget( Image *image )
+	{
+		struct controlImage **p, *ci;
+
+		for( p = &images; *p && (*p)->image != image; p = &(*p)->next ) ;
+		if( !(ci = *p) || !ci->owned )
+			return;
+
+		*p = ci->next;
+		if( ci->raw != ci->image )
+			delete ci->image;
+		delete ci->raw;
+		free( ci->path );
+		free( ci );
+	}
+
+	//
+	// Opens an image for the drive, or finds it already open the same way, read only or not.
+	// Everything that Image::init and FileAccess would stop the server for is checked first.
+	//
+	struct controlImage *openImage( const char *name, int readOnly, int port, int drive, char *error )
+	{
+		struct controlDrive *k = &known[ port * 2 + drive ];
+		struct controlImage *ci;
+		struct floppyInfo *fi;
+		unsigned long sectors, cyl = 0, head = 0, sect = 0;
+		int useCHS = 0, floppy;
+		struct stat st;
+		char *path;
+		Image *img;
+
+		if( !(path = realpath( name, NULL )) )
+		{
+			snprintf( error, CONTROL_LINE, "'%s', %s", name, strerror( errno ) );
+			return( NULL );
+		}
+
+		for( ci = images; ci && strcmp( ci->path, path ); ci = ci->next ) ;
+		if( ci )
+		{
+			free( path );
+			img = ci->image;
+			if( k->known && (img->floppy != k->floppy || (!k->floppy && img->totallba != k->totallba)) )
+			{
+				snprintf( error, CONTROL_LINE, "'%s' doesn't fit port %d drive %d", ci->path, port, drive );
+				return( NULL );
+			}
+			if( img->readOnly != readOnly )
+			{
+				snprintf( error, CONTROL_LINE, "'%s' is already open %s", ci->path, img->readOnly ? "read only" : "read-write" );
+				return( NULL );
+			}
+			return( ci );
+		}
+
+		if( stat( path, &st ) || !S_ISREG( st.st_mode ) || (st.st_size % 512) || !st.st_size ||
+			(unsigned long long) st.st_size / 512 > 0xfffffff )
+		{
+			snprintf( error, CONTROL_LINE, "'%s', not a disk image", path );
+			free( path );
+			return( NULL );
+		}
+
+		if( access( path, readOnly ? R_OK : R_OK | W_OK ) )
+		{
+			snprintf( error, CONTROL_LINE, "'%s', %s", path, strerror( errno ) );
+			free( path );
+			return( NULL );
+		}
+
+		sectors = st.st_size / 512;
+		floppy = (fi = FindFloppyInfoBySize( sectors )) && fi->real && fi->size == sectors;
+
+		if( k->known && floppy != k->floppy )
+		{
+			snprintf( error, CONTROL_LINE, "port %d drive %d is a %s, '%s' is not", port, drive, k->floppy ? "floppy drive" : "hard disk", path );
+			free( path );
+			return( NULL );
+		}
+
+		if( !floppy )
+		{
+			if( k->known )
+			{
+				if( sectors != k->totallba )
+				{
+					snprintf( error, CONTROL_LINE, "'%s' has %lu sectors, port %d drive %d has %lu", path, sectors, port, drive, k->totallba );
+					free( path );
+					return( NULL );
+				}
+				cyl = k->cyl;
+				head = k->head;
+				sect = k->sect;
+				useCHS = k->useCHS;
+			}
+			else if( (sectors % (16*63)) && sectors <= 65536*16*63 )
+			{
+				snprintf( error, CONTROL_LINE, "'%s', size does not match standard CHS geometry (x:16:63)", path );
+				free( path );
+				return( NULL );
+			}
+		}
+
+		if( !(ci = (struct controlImage *) malloc( sizeof(struct controlImage) )) )
+			log( -1, "Out of memory for the control socket" );
+
+		ci->path = path;
+		ci->raw = ci->image = new FlatImage( path, readOnly, drive, 0, cyl, head, sect, useCHS );
+		if( cache )
+			ci->image = new CachedImage( ci->raw, cache );
+		ci->owned = 1;
+		ci->next = images;
+		images = ci;
+
+		return( ci );
+	}
+
+	void stats( struct controlClient *cl, ProcessState *states[], int count )
+	{
+		struct driveSlot *slot;
+		struct controlImage *ci;
+		const char *name;
+
+		for( int p = 0; p < drives->ports; p++ )
+			for( int d = 0; d < 2; d++ )
+			{
+				slot = drives->slot( p, d );
+
+				for( ci = images; ci && ci->image != slot->image; ci = ci->next ) ;
+				name = !slot->image ? "-" : ci ? ci->path : slot->image->shortFileName;
+
+				reply( cl, "%d %d %s %s %s %s inquires=%lu reads=%lu read_sectors=%lu writes=%lu written_sectors=%lu changes=%lu",
+					   p, d, p < count ? states[p]->serial->deviceName : "-",
+					   !slot->image ? "empty" : slot->image->floppy ? "floppy" : "hard", name,
+					   !slot->image ? "-" : slot->image->readOnly ? "ro" : "rw",
+					   slot->commands[ STATS_INQUIRE ], slot->commands[ STATS_READ ], slot->sectors[ STATS_READ ],
+					   slot->commands[ STATS_WRITE ], slot->sectors[ STATS_WRITE ], slot->changes );
+			}
+	}
+};
+
+#endif
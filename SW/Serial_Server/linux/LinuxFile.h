@@ -29,8 +29,11 @@
 #include <stdio.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include "../library/Library.h"
+#include "LinuxUring.h"
 
 class FileAccess
 {
@@ -51,22 +54,32 @@ public:
 		}
 
 		name = p_name;
+		addToUring();
 
 		return( 1 );
 	}
 
-	void Open( char *p_name )
+	void Open( char *p_name, int readOnly = 0 )
 	{
-		fp = open(p_name, O_RDWR);
+		fp = open(p_name, readOnly ? O_RDONLY : O_RDWR);
 
 		if( fp < 0 )
 			log( -1, "'%s', could not open file", p_name );
 
 		name = p_name;
+		addToUring();
 	}
 
 	void Close()
 	{
+		Unmap();
+
+		if( uring )
+		{
+			uring->removeFile( fp );
+			uring = NULL;
+		}
+
 		if( fp )
 		{
 			if( close( fp ) )
@@ -93,6 +106,21 @@ public:
 		return( (unsigned long) i );
 	}
 
+	//
+	// Sets the file length without writing any data, the file system leaves the new space as a sparse hole
+	// which reads back as zeros
+	//
+	void SetSizeSectors( unsigned long sectors )
+	{
+		off64_t size;
+
+		size = sectors;
+		size <<= 9;
+
+		if( ftruncate64( fp, size ) )
+			log( -1, "'%s', could not set file size to %lu sectors (error %i)", name, sectors, errno );
+	}
+
 	void SeekSectors( unsigned long lba )
 	{
 		off64_t offset, result;
@@ -123,10 +151,152 @@ public:
 			log( -1, "'%s', WriteFile failed", name );
 	}
 
+	//
+	// Positional access, which leaves the seek position alone.  These go through io_uring when the
+	// kernel has it, and otherwise pread/pwrite.
+	//
+	void ReadAt( void *buff, unsigned long lba, unsigned long sectors )
+	{
+		off64_t offset = ((off64_t) lba) << 9;
+		size_t len = ((size_t) sectors) << 9;
+
+		if( uring )
+			uring->transfer( 0, fp, buff, len, offset );
+		else if( pread64( fp, buff, len, offset ) != (ssize_t) len )
+			log( -1, "'%s', Failed to read lba=%lu", name, lba );
+	}
+
+	void WriteAt( void *buff, unsigned long lba, unsigned long sectors )
+	{
+		off64_t offset = ((off64_t) lba) << 9;
+		size_t len = ((size_t) sectors) << 9;
+
+		if( uring )
+			uring->transfer( 1, fp, buff, len, offset );
+		else if( pwrite64( fp, buff, len, offset ) != (ssize_t) len )
+			log( -1, "'%s', Failed to write lba=%lu", name, lba );
+	}
+
+	//
+	// Reads 'count' consecutive sectors starting at 'lba', each into its own buffer, with a single
+	// submission (or a single preadv)
+	//
+	void ReadVectorAt( void *buffs[], unsigned long lba, int count )
+	{
+		struct iovec iov[ URING_ENTRIES ];
+		off64_t offset = ((off64_t) lba) << 9;
+
+		if( uring )
+		{
+			uring->readVector( fp, buffs, count, 512, offset );
+			return;
+		}
+
+		for( int t = 0; t < count; t += URING_ENTRIES )
+		{
+			int n = count - t < URING_ENTRIES ? count - t : URING_ENTRIES;
+
+			for( int i = 0; i < n; i++ )
+			{
+				iov[i].iov_base = buffs[t+i];
+				iov[i].iov_len = 512;
+			}
+
+			if( preadv64( fp, iov, n, offset + (((off64_t) t) << 9) ) != ((ssize_t) n) << 9 )
+				log( -1, "'%s', Failed to read lba=%lu", name, lba + t );
+		}
+	}
+
+	//
+	// Memory that will be read into often, such as the read-ahead ring of a serial port, can be
+	// registered with io_uring to save the kernel mapping it on every read
+	//
+	static void RegisterBuffer( void *buff, unsigned long len )
+	{
+		UringQueue *q;
+
+		if( (q = UringQueue::get()) )
+			q->addBuffer( buff, len );
+	}
+
+	//
+	// Waits until everything written so far has reached the disk
+	//
+	void Flush()
+	{
+		if( fsync( fp ) )
+			log( 0, "'%s', fsync failed (error %i)", name, errno );
+	}
+
+	//
+	// Memory maps the first 'sectors' sectors of the file.  Returns NULL if the mapping is not possible
+	// (for example, a large image on a 32-bit host), in which case the caller should fall back to Read/Write.
+	//
+	void *Map( unsigned long sectors, int readOnly )
+	{
+		void *p;
+
+		if( sectors > ((size_t) -1) >> 9 )
+		{
+			log( 0, "'%s', too large to memory map on this host, using read/write instead", name );
+			return( NULL );
+		}
+
+		p = mmap( NULL, ((size_t) sectors) << 9, PROT_READ | (readOnly ? 0 : PROT_WRITE), MAP_SHARED, fp, 0 );
+		if( p == MAP_FAILED )
+		{
+			log( 0, "'%s', could not memory map file (error %i), using read/write instead", name, errno );
+			return( NULL );
+		}
+
+		mapped = p;
+		mappedLength = ((size_t) sectors) << 9;
+
+		return( mapped );
+	}
+
+	//
+	// Flushes dirty pages of the mapping back to the file, either the whole mapping (len == 0) or the pages
+	// covering [offset, offset+len).  With 'wait' set, returns only once the data has reached the file.
+	//
+	void Sync( unsigned long offset, unsigned long len, int wait )
+	{
+		unsigned long page, start;
+
+		if( !mapped )
+			return;
+
+		if( !len )
+		{
+			offset = 0;
+			len = mappedLength;
+		}
+
+		page = sysconf( _SC_PAGESIZE );
+		start = offset & ~(page - 1);
+
+		if( msync( (char *) mapped + start, len + (offset - start), wait ? MS_SYNC : MS_ASYNC ) )
+			log( 0, "'%s', msync failed (error %i)", name, errno );
+	}
+
+	void Unmap()
+	{
+		if( mapped )
+		{
+			Sync( 0, 0, 1 );
+			munmap( mapped, mappedLength );
+			mapped = NULL;
+			mappedLength = 0;
+		}
+	}
+
 	FileAccess()
 	{
 		fp = 0;
 		name = NULL;
+		mapped = NULL;
+		mappedLength = 0;
+		uring = NULL;
 	}
 
     // LBA 28 limit - 28-bits (could be 1 more, but not worth pushing it)
@@ -136,5 +306,14 @@ public:
 private:
 	int fp;
 	char *name;
+	void *mapped;
+	size_t mappedLength;
+	UringQueue *uring;
+
+	void addToUring( void )
+	{
+		if( (uring = UringQueue::get()) )
+			uring->addFile( fp );
+	}
 };
 
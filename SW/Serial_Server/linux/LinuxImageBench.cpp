@@ -0,0 +1,515 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        LinuxImageBench.cpp - Benchmark of the disk image backends, without a serial port
+//
+// serbench opens a disk image the way SerDrive would, with the same options choosing the backend,
+// and reads and writes it directly through the Image interface: sequentially, at random, and a
+// random mix of reads and writes, for each of the transfer sizes the BIOS makes (1, 8 and 127
+// sectors by default).  Each run reports sectors per second and latency percentiles, so that
+// backends can be compared, and changes to them measured, without serial hardware or a client.
+//
+// Latencies are kept in the power of two histograms of Stats.h, so percentiles are the upper
+// bound of their bucket.  The image is flushed at the end of each run, within its time, so that
+// sectors queued by write-behind or a write-back cache are counted once they reach the image.
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../library/Library.h"
+#include "../library/FlatImage.h"
+#include "../library/MappedImage.h"
+#include "../library/OverlayImage.h"
+#include "../library/CompressedImage.h"
+#include "../library/DedupImage.h"
+#include "../library/CachedImage.h"
+#include "../library/WriteBehindImage.h"
+
+#define BENCH_MAXSECTORS 127                // largest transfer the BIOS makes
+#define BENCH_MAXTHREADS 64
+#define BENCH_MAXCOUNTS 16
+
+const char *bannerStrings[] = {
+	"serbench - XTIDE Universal BIOS Serial Drive Image Benchmark",
+	"Copyright (C) 2012-2013 by XTIDE Universal BIOS Team",
+	"Released under GNU GPL v2, with ABSOLUTELY NO WARRANTY",
+	"",
+	NULL };
+
+const char *usageStrings[] = {
+	"Usage: serbench [options] imagefile",
+	"",
+	"  The image is opened as SerDrive would open it, compressed and deduplicated",
+	"  images are recognized by their contents, and these options choose the rest",
+	"  of the backend, as they do for SerDrive:",
+	"",
+	"  -m [syncEvery]      Memory mapped",
+	"  -q [durable]        Write-behind",
+	"  -o deltafile        Copy-on-write overlay",
+	"  -s megabytes        Sector cache in front of the image",
+	"  -w                  Write-back sector cache",
+	"  -n [megabytes]      Create a new flat image of this size first (default 32)",
+	"",
+	"  -p pattern          Run only one access pattern, one of:",
+	"                          seqread    reads, moving forward through the disk",
+	"                          seqwrite   writes, moving forward through the disk",
+	"                          randread   reads anywhere on the disk",
+	"                          randwrite  writes anywhere on the disk",
+	"                          mixed      reads and writes anywhere, -M percent writes",
+	"                      (default is all of them, in that order)",
+	"  -c counts           Sectors in each transfer, a comma separated list of 1-127",
+	"                      (default \"1,8,127\")",
+	"  -d seconds          Length of each run (default 1)",
+	"  -t threads          Threads sharing the image, each reading and writing its",
+	"                      own part of it (default 1)",
+	"  -M percent          Writes in the mixed pattern (default 30)",
+	"  -S seed             Random seed (default 1)",
+	"  -r                  Read only, the patterns that write are left out",
+	"  -j                  Report each run as a line of JSON",
+	"  -v [level]          Report what the image backends say as they are opened",
+	"",
+	"The write patterns overwrite the image, use a scratch image or an overlay.",
+	"Reads come from the page cache of the host once the image has been read.",
+	NULL };
+
+void usagePrint( const char *strings[] )
+{
+	for( int t = 0; strings[t]; t++ )
+		fprintf( stderr, "%s\n", strings[t] );
+}
+
+#define usage() { usagePrint( usageStrings ); exit(1); }
+
+int verbose = 0;
+
+struct pattern {
+	const char *name;
+	int sequential;
+	int writePercent;                   // -1 for the mixed percentage
+};
+
+struct pattern patterns[] = {
+	{ "seqread", 1, 0 },
+	{ "seqwrite", 1, 100 },
+	{ "randread", 0, 0 },
+	{ "randwrite", 0, 100 },
+	{ "mixed", 0, -1 },
+	{ NULL, 0, 0 }
+};
+
+struct benchThread {
+	pthread_t thread;
+
+	unsigned long long random;
+	unsigned long start, length;        // part of the disk for sequential runs
+	unsigned char *buff;
+
+	struct histogram latency[ STATS_COMMANDS ];
+	unsigned long sectors[ STATS_COMMANDS ];
+};
+
+Image *image;
+struct pattern *pattern;
+unsigned long count;
+int writePercent = 30;
+volatile int running;
+
+int patternWrites( struct pattern *p )
+{
+	return( p->writePercent > 0 || (p->writePercent < 0 && writePercent > 0) );
+}
+
+unsigned long nextRandom( struct benchThread *b, unsigned long range )
+{
+	b->random ^= b->random >> 12;
+	b->random ^= b->random << 25;
+	b->random ^= b->random >> 27;
+
+	return( range ? (unsigned long) ((b->random * 0x2545f4914f6cdd1dULL) >> 33) % range : 0 );
+}
+
+void *benchThread( void *arg )
+{
+	struct benchThread *b = (struct benchThread *) arg;
+	unsigned long lba = b->start, n;
+	unsigned long long t0;
+	int write, which;
+
+	while( running )
+	{
+		n = count;
+
+		if( pattern->sequential )
+		{
+			if( n > b->length )
+				n = b->length;
+			if( lba + n > b->start + b->length )
+				lba = b->start;
+		}
+		else
+			lba = nextRandom( b, image->totallba - n + 1 );
+
+		write = pattern->writePercent < 0 ? nextRandom( b, 100 ) < (unsigned long) writePercent :
+				pattern->writePercent > 0;
+		which = write ? STATS_WRITE : STATS_READ;
+
+		t0 = GetTime_Microseconds();
+
+		if( write )
+			image->writeSectors( lba, n, b->buff );
+		else
+			image->readSectors( lba, n, b->buff );
+
+		histogramAdd( &b->latency[ which ], GetTime_Microseconds() - t0 );
+		b->sectors[ which ] += n;
+
+		if( pattern->sequential )
+			lba += n;
+	}
+
+	return( NULL );
+}
+
+void histogramMerge( struct histogram *to, struct histogram *from )
+{
+	to->count += from->count;
+	to->sum += from->sum;
+	if( from->max > to->max )
+		to->max = from->max;
+	for( int b = 0; b < STATS_BUCKETS; b++ )
+		to->buckets[b] += from->buckets[b];
+}
+
+const char *commandNames[ STATS_COMMANDS ] = { "inquire", "read", "write" };
+
+void report( struct histogram *latency, unsigned long *sectors, int threads, unsigned long long elapsed, int json )
+{
+	unsigned long total = sectors[ STATS_READ ] + sectors[ STATS_WRITE ];
+	double seconds = elapsed / 1e6;
+	struct histogram *h;
+
+	if( json )
+	{
+		printf( "{\"image\":\"%s\",\"pattern\":\"%s\",\"count\":%lu,\"threads\":%d,\"seconds\":%.3f,\"sectorsPerSecond\":%.1f",
+				image->shortFileName, pattern->name, count, threads, seconds, seconds ? total / seconds : 0.0 );
+		for( int c = STATS_READ; c < STATS_COMMANDS; c++ )
+		{
+			h = &latency[c];
+			printf( ",\"%s\":{\"commands\":%lu,\"sectors\":%lu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+					commandNames[c], h->count, sectors[c], histogramPercentile( h, 50 ), histogramPercentile( h, 90 ),
+					histogramPercentile( h, 99 ), histogramPercentile( h, 99.9 ), h->max );
+		}
+		printf( "}\n" );
+		fflush( stdout );
+		return;
+	}
+
+	for( int c = STATS_READ; c < STATS_COMMANDS; c++ )
+	{
+		h = &latency[c];
+		if( !h->count )
+			continue;
+
+		printf( "%-10s %5lu %5s %12.0f %9.1f %10llu %10llu %10llu %10llu\n",
+				c == STATS_READ || !latency[ STATS_READ ].count ? pattern->name : "", count, commandNames[c],
+				sectors[c] / seconds, sectors[c] / seconds / 2048, histogramPercentile( h, 50 ),
+				histogramPercentile( h, 99 ), histogramPercentile( h, 99.9 ), h->max );
+	}
+	fflush( stdout );
+}
+
+int main( int argc, char *argv[] )
+{
+	static struct benchThread threads[ BENCH_MAXTHREADS ];
+	unsigned long counts[ BENCH_MAXCOUNTS ] = { 1, 8, 127 };
+	int countCount = 3, threadCount = 1, json = 0;
+	unsigned long seconds = 1, cacheSize = 0;
+	unsigned long long seed = 1, start, elapsed;
+	const char *patternName = NULL;
+	char *name = NULL, *overlay = NULL;
+	int mapped = 0, writeBehind = -1, cacheWriteBack = 0, readOnly = 0;
+	unsigned long syncEvery = 0, createSize = 0;
+
+	struct histogram latency[ STATS_COMMANDS ];
+	unsigned long sectors[ STATS_COMMANDS ];
+
+	for( int t = 1; t < argc; t++ )
+	{
+		char *next = (t+1 < argc ? argv[t+1] : NULL );
+
+		if( argv[t][0] == '-' )
+		{
+			char option = argv[t][1];
+
+			//
+			// All but these take a value, and these may be given one
+			//
+			if( !option || !strchr( "mqnwrjv", option ) )
+			{
+				if( !next )
+					usage();
+				t++;
+			}
+			else if( strchr( "mqnv", option ) && next && isdigit( next[0] ) )
+				t++;
+			else
+				next = NULL;
+
+			switch( option )
+			{
+			case 'm':
+				mapped = 1;
+				syncEvery = next ? atol( next ) : 0;
+				break;
+			case 'q':
+				writeBehind = next ? atoi( next ) : 0;
+				break;
+			case 'o':
+				overlay = next;
+				break;
+			case 's':
+				if( !isdigit( next[0] ) || !(cacheSize = atol( next )) )
+					usage();
+				break;
+			case 'w':
+				cacheWriteBack = 1;
+				break;
+			case 'n':
+				if( !(createSize = next ? atol( next ) : 32) )
+					usage();
+				break;
+			case 'p':
+				patternName = next;
+				break;
+			case 'c':
+				countCount = 0;
+				for( char *c = next; *c; c++ )
+				{
+					if( countCount == BENCH_MAXCOUNTS )
+						log( -2, "No more than %d transfer sizes", BENCH_MAXCOUNTS );
+					if( !(counts[ countCount ] = strtoul( c, &c, 10 )) || counts[ countCount ] > BENCH_MAXSECTORS ||
+						(*c && *c != ',') )
+						log( -2, "Transfer sizes are 1-%d sectors, given as \"1,8,127\"", BENCH_MAXSECTORS );
+					countCount++;
+					if( !*c )
+						break;
+				}
+				break;
+			case 'd':
+				if( !(seconds = atol( next )) )
+					usage();
+				break;
+			case 't':
+				if( (threadCount = atoi( next )) < 1 || threadCount > BENCH_MAXTHREADS )
+					log( -2, "From 1 to %d threads", BENCH_MAXTHREADS );
+				break;
+			case 'M':
+				if( !isdigit( next[0] ) || (writePercent = atoi( next )) > 100 )
+					usage();
+				break;
+			case 'S':
+				seed = strtoull( next, NULL, 0 );
+				break;
+			case 'r':
+				readOnly = 1;
+				break;
+			case 'j':
+				json = 1;
+				break;
+			case 'v':
+				verbose = next ? atoi( next ) : 1;
+				break;
+			default:
+				log( -2, "Unknown Option: \"-%c\"", option );
+			}
+		}
+		else
+		{
+			if( name )
+				usage();
+			name = argv[t];
+		}
+	}
+
+	if( !name )
+		usage();
+
+	if( !json )
+		usagePrint( bannerStrings );
+
+	if( patternName )
+	{
+		for( pattern = patterns; pattern->name && strcmp( pattern->name, patternName ); pattern++ ) ;
+		if( !pattern->name )
+			log( -2, "Unknown pattern \"%s\"", patternName );
+	}
+
+	//
+	// As in Linux.cpp
+	//
+	if( overlay )
+		image = new OverlayImage( name, overlay, readOnly, 0, 0, 0, 0, 0 );
+	else if( DedupImage::isDedupMap( name ) )
+		image = new DedupImage( name, readOnly, 0, 0, 0, 0, 0 );
+	else if( CompressedImage::isCompressed( name ) )
+		image = new CompressedImage( name, readOnly, 0, 0, 0, 0, 0 );
+	else if( mapped )
+		image = new MappedImage( name, readOnly, 0, createSize != 0, createSize * 2048 / (16*63), 16, 63, 0, syncEvery );
+	else
+		image = new FlatImage( name, readOnly, 0, createSize != 0, createSize * 2048 / (16*63), 16, 63, 0 );
+
+	if( writeBehind >= 0 && !readOnly )
+		image = new WriteBehindImage( image, writeBehind );
+
+	if( cacheSize && !image->mapSector( 0 ) )
+	{
+		SectorCache *cache = new SectorCache( cacheSize, cacheWriteBack );
+
+		if( !image->attachCache( cache ) )
+			image = new CachedImage( image, cache );
+	}
+
+	if( patternName && patternWrites( pattern ) && image->readOnly )
+		log( -1, "'%s', the %s pattern writes, and the image is read only", name, pattern->name );
+
+	for( int t = 0; t < threadCount; t++ )
+	{
+		threads[t].length = image->totallba / threadCount;
+		threads[t].start = threads[t].length * t;
+		if( !threads[t].length )
+			log( -1, "'%s', too small for %d threads", name, threadCount );
+
+		if( posix_memalign( (void **) &threads[t].buff, 4096, BENCH_MAXSECTORS * 512 ) )
+			log( -1, "Out of memory for the transfers" );
+		memset( threads[t].buff, 0xe5, BENCH_MAXSECTORS * 512 );
+	}
+
+	if( !json )
+	{
+		printf( "%s: %lu sectors, %d thread%s, %lu second%s a run\n", image->shortFileName, image->totallba,
+				threadCount, threadCount == 1 ? "" : "s", seconds, seconds == 1 ? "" : "s" );
+		printf( "%-10s %5s %5s %12s %9s %10s %10s %10s %10s\n", "pattern", "count", "", "sectors/s", "MB/s",
+				"p50 us", "p99 us", "p99.9 us", "max us" );
+	}
+
+	for( struct pattern *p = patternName ? pattern : patterns; p->name; p++ )
+	{
+		pattern = p;
+
+		if( patternWrites( pattern ) && image->readOnly )
+			continue;
+
+		for( int c = 0; c < countCount; c++ )
+		{
+			count = counts[c];
+
+			for( int t = 0; t < threadCount; t++ )
+			{
+				threads[t].random = seed * 0x9e3779b97f4a7c15ULL + t + 1;
+				memset( threads[t].latency, 0, sizeof(threads[t].latency) );
+				memset( threads[t].sectors, 0, sizeof(threads[t].sectors) );
+			}
+
+			running = 1;
+			start = GetTime_Microseconds();
+
+			for( int t = 0; t < threadCount; t++ )
+				if( pthread_create( &threads[t].thread, NULL, benchThread, &threads[t] ) )
+					log( -1, "Could not start a benchmark thread" );
+
+			sleep( seconds );
+			running = 0;
+
+			for( int t = 0; t < threadCount; t++ )
+				pthread_join( threads[t].thread, NULL );
+
+			image->flush();
+
+			elapsed = GetTime_Microseconds() - start;
+
+			memset( latency, 0, sizeof(latency) );
+			memset( sectors, 0, sizeof(sectors) );
+			for( int t = 0; t < threadCount; t++ )
+				for( int s = 0; s < STATS_COMMANDS; s++ )
+				{
+					histogramMerge( &latency[s], &threads[t].latency[s] );
+					sectors[s] += threads[t].sectors[s];
+				}
+
+			report( latency, sectors, threadCount, elapsed, json );
+		}
+
+		if( patternName )
+			break;
+	}
+
+	delete image;
+
+	return( 0 );
+}
+
+void log( int level, const char *message, ... )
+{
+	va_list args;
+
+	va_start( args, message );
+
+	if( level < 0 )
+	{
+		fprintf( stderr, "ERROR: " );
+		vfprintf( stderr, message, args );
+		fprintf( stderr, "\n" );
+		if( level < -1 )
+		{
+			fprintf( stderr, "\n" );
+			usage();
+		}
+		exit( 1 );
+	}
+	else if( verbose >= level )
+	{
+		vfprintf( stderr, message, args );
+		fprintf( stderr, "\n" );
+	}
+
+	va_end( args );
+}
+
+unsigned long GetTime(void)
+{
+	return( GetTime_Microseconds() / 1000 );
+}
+
+unsigned long long GetTime_Microseconds(void)
+{
+	struct timespec now;
+
+	if( clock_gettime( CLOCK_MONOTONIC, &now ) )
+		return( 0 );
+	return( now.tv_sec * 1000000ULL + now.tv_nsec / 1000 );
+}
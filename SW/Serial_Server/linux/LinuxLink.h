@@ -0,0 +1,394 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        LinuxLink.h - Emulation of the timing and errors of a real serial line
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// LinkEmulator sits between a connection (usually a pseudo-terminal or a socket, which have no
+// speed of their own) and the server, and makes it behave like an 8N1 serial line at a given rate:
+// one start bit, eight data bits and one stop bit, so every byte takes 10 bit times on the wire.
+//
+// In both directions each byte is held until it has been clocked out, plus a fixed latency for the
+// cable, level shifters or USB adapter.  Sending blocks while the transmit FIFO is full, as a UART
+// would, so the server sees the real cost of writing to the line.  Bit errors can be injected at a
+// given rate; they land on the wire like noise would, and a hit start or stop bit corrupts the byte
+// too.
+//
+// The server reads from one end of a socket pair, the other end is fed by the link thread as bytes
+// "arrive", so the serial code can keep using poll, epoll and non-blocking reads on it unchanged.
+// The same thread delivers what the server sends to the connection.  Both are written to without
+// blocking, so a client that has stopped reading can't hold up what it sends being passed on.
+//
+
+#ifndef LINUXLINK_H_INCLUDED
+#define LINUXLINK_H_INCLUDED
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "../library/Library.h"
+
+#define LINK_RING 65536                     // bytes held in each direction, a power of 2
+#define LINK_BITS 10                        // 8N1
+
+struct linkEmulation {
+	unsigned long latency;                  // microseconds, added to every byte
+	unsigned long fifo;                     // transmit FIFO depth in bytes
+	unsigned long errorBits;                // one bit error per this many bits on average, 0 for none
+};
+
+//
+// Bytes in flight in one direction, each with the time it is due at the other end
+//
+struct linkRing {
+	unsigned char data[ LINK_RING ];
+	unsigned long long due[ LINK_RING ];
+	unsigned long head, count;
+	double wireFree;                        // when the last byte queued has been clocked out
+	int blocked;                            // the receiving end is full
+};
+
+class LinkEmulator
+{
+public:
+	LinkEmulator( int p_line, const char *p_name, struct linkEmulation *p_params, unsigned long rate )
+	{
+		int fds[2];
+
+		line = p_line;
+		name = p_name;
+		params = *p_params;
+		if( !params.fifo )
+			params.fifo = 1;
+
+		byteTime = LINK_BITS * 1000000.0 / rate;
+
+		if( !(tx = (struct linkRing *) calloc( 1, sizeof(struct linkRing) )) ||
+			!(rx = (struct linkRing *) calloc( 1, sizeof(struct linkRing) )) )
+			log( -1, "'%s', out of memory for link emulation", name );
+
+		if( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) )
+			log( -1, "'%s', could not create socket pair (error %i)", name, errno );
+		server = fds[0];
+		inside = fds[1];
+
+		fcntl( line, F_SETFL, fcntl( line, F_GETFL ) | O_NONBLOCK );
+		fcntl( inside, F_SETFL, fcntl( inside, F_GETFL ) | O_NONBLOCK );
+
+		if( (wake = eventfd( 0, EFD_NONBLOCK )) < 0 )
+			log( -1, "'%s', could not create eventfd (error %i)", name, errno );
+
+		random = 0x2545f4914f6cdd1dULL;     // fixed, so that runs can be repeated
+		bitsToError = nextError();
+		errors = 0;
+		lineClosed = 0;
+		stopping = 0;
+
+		pthread_mutex_init( &lock, NULL );
+		pthread_cond_init( &room, NULL );
+
+		if( pthread_create( &thread, NULL, linkThread, this ) )
+			log( -1, "'%s', could not start link emulation thread", name );
+
+		log( 1, "%s: Emulating an 8N1 line at %lu baud, latency %lu us, FIFO %lu bytes, %s", name, rate,
+			 params.latency, params.fifo, params.errorBits ? "with bit errors" : "without errors" );
+	}
+
+	~LinkEmulator()
+	{
+		stopping = 1;
+		signalThread();
+		pthread_join( thread, NULL );
+
+		if( errors )
+			log( 1, "%s: %lu bit errors injected", name, errors );
+
+		close( wake );
+		close( inside );
+		close( server );
+		free( tx );
+		free( rx );
+	}
+
+	//
+	// The server reads from, and polls, this handle
+	//
+	int handle()
+	{
+		return( server );
+	}
+
+	//
+	// Queues the segments for the line, and waits until no more than a FIFO full are still to
+	// be clocked out.  Returns 0 once the connection has been closed.
+	//
+	int send( struct sendSegment *segments, int count )
+	{
+		unsigned long long now;
+		double waitFor;
+		unsigned char *data;
+		unsigned long len, t;
+
+		pthread_mutex_lock( &lock );
+
+		now = GetTime_Microseconds();
+
+		for( int s = 0; s < count; s++ )
+		{
+			data = (unsigned char *) segments[s].data;
+
+			for( len = segments[s].len; len; len--, data++ )
+			{
+				while( tx->count == LINK_RING && !lineClosed )
+				{
+					pthread_cond_wait( &room, &lock );
+					now = GetTime_Microseconds();
+				}
+
+				if( lineClosed )
+				{
+					pthread_mutex_unlock( &lock );
+					return( 0 );
+				}
+
+				t = (tx->head + tx->count++) & (LINK_RING-1);
+				tx->data[t] = *data;
+				queueByte( tx, t, now );
+			}
+		}
+
+		waitFor = tx->wireFree;
+
+		pthread_mutex_unlock( &lock );
+
+		signalThread();
+
+		//
+		// The UART takes new bytes only as the FIFO empties
+		//
+		now = GetTime_Microseconds();
+		if( waitFor > now + params.fifo * byteTime )
+			usleep( (useconds_t) (waitFor - now - params.fifo * byteTime) );
+
+		return( !lineClosed );
+	}
+
+private:
+	int line, server, inside, wake;
+	const char *name;
+	struct linkEmulation params;
+	double byteTime;
+
+	struct linkRing *tx, *rx;               // to the client, and from it
+	pthread_mutex_t lock;                   // tx, and lineClosed
+	pthread_cond_t room;
+	pthread_t thread;
+
+	unsigned long long random;
+	double bitsToError;
+	unsigned long errors;
+	volatile int lineClosed, stopping;
+
+	//
+	// Number of bits until the next error, exponentially distributed around errorBits
+	//
+	double nextError( void )
+	{
+		if( !params.errorBits )
+			return( HUGE_VAL );
+
+		random ^= random >> 12;
+		random ^= random << 25;
+		random ^= random >> 27;
+
+		return( -log( ((random * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0) + 1e-300 ) * params.errorBits );
+	}
+
+	//
+	// Sets when the byte at 't' reaches the other end, and puts any bit errors on it.  Called with
+	// the lock held, as both directions share the error generator.
+	//
+	void queueByte( struct linkRing *r, unsigned long t, unsigned long long now )
+	{
+		if( r->wireFree < now )
+			r->wireFree = now;
+		r->wireFree += byteTime;
+		r->due[t] = (unsigned long long) r->wireFree + params.latency;
+
+		for( bitsToError -= LINK_BITS; bitsToError <= 0; bitsToError += nextError() )
+		{
+			//
+			// Bit 0 is the start bit, 9 the stop bit: either way the receiver gets a garbled byte
+			//
+			int bit = (int) (bitsToError + LINK_BITS);
+
+			r->data[t] ^= (bit >= 1 && bit <= 8) ? 1 << (bit-1) : 1 << (random & 7);
+			errors++;
+		}
+	}
+
+	void signalThread( void )
+	{
+		unsigned long long one = 1;
+
+		if( write( wake, &one, sizeof(one) ) < 0 )
+			;
+	}
+
+	//
+	// Writes out the bytes from the head of the ring that are due, returns the time the next
+	// byte is due, or 0 if there are none or the other end is full
+	//
+	unsigned long long deliver( struct linkRing *r, int fd, unsigned long long now )
+	{
+		unsigned long n, count;
+		ssize_t len = 0;
+
+		pthread_mutex_lock( &lock );
+		count = r->count;
+		pthread_mutex_unlock( &lock );
+
+		for( n = 0; n < count && (r->head + n) < LINK_RING && r->due[ r->head + n ] <= now; n++ ) ;
+
+		if( n )
+		{
+			r->blocked = 0;
+
+			if( (len = write( fd, &r->data[ r->head ], n )) <= 0 )
+			{
+				if( len < 0 && errno == EINTR )
+					return( now );
+				if( len < 0 && errno == EAGAIN )
+					r->blocked = 1;
+				else
+					lineClosed = 1;
+				return( 0 );
+			}
+
+			pthread_mutex_lock( &lock );
+			r->head = (r->head + len) & (LINK_RING-1);
+			r->count -= len;
+			pthread_cond_broadcast( &room );
+			pthread_mutex_unlock( &lock );
+		}
+
+		return( count > (unsigned long) len ? r->due[ r->head ] : 0 );
+	}
+
+	//
+	// Takes whatever the client has sent, as it would be clocked in
+	//
+	void receive( unsigned long long now )
+	{
+		unsigned long t = (rx->head + rx->count) & (LINK_RING-1);
+		unsigned long room = LINK_RING - rx->count;
+		ssize_t len;
+
+		if( room > LINK_RING - t )
+			room = LINK_RING - t;
+
+		if( (len = read( line, &rx->data[t], room )) <= 0 )
+		{
+			if( len < 0 && (errno == EINTR || errno == EAGAIN) )
+				return;
+			lineClosed = 1;
+			return;
+		}
+
+		pthread_mutex_lock( &lock );
+		for( ssize_t i = 0; i < len; i++ )
+			queueByte( rx, t + i, now );
+		rx->count += len;
+		pthread_mutex_unlock( &lock );
+	}
+
+	static void *linkThread( void *arg )
+	{
+		LinkEmulator *link = (LinkEmulator *) arg;
+		struct pollfd p[3];
+		struct timespec timeout, *wait;
+		unsigned long long now, next, nextTx, nextRx, discard;
+
+		while( !link->stopping )
+		{
+			now = GetTime_Microseconds();
+
+			nextTx = link->deliver( link->tx, link->line, now );
+			nextRx = link->deliver( link->rx, link->inside, now );
+
+			//
+			// Once the client has gone and everything it sent has been passed on, the server
+			// sees the end of the connection
+			//
+			if( link->lineClosed )
+			{
+				pthread_mutex_lock( &link->lock );
+				pthread_cond_broadcast( &link->room );
+				pthread_mutex_unlock( &link->lock );
+
+				if( !link->rx->count )
+				{
+					shutdown( link->inside, SHUT_WR );
+					break;
+				}
+			}
+
+			next = nextTx && (!nextRx || nextTx < nextRx) ? nextTx : nextRx;
+
+			p[0].fd = link->wake;
+			p[0].events = POLLIN;
+			p[1].fd = link->line;
+			p[1].events = (link->lineClosed || link->rx->count == LINK_RING ? 0 : POLLIN) | (link->tx->blocked ? POLLOUT : 0);
+			p[2].fd = link->inside;
+			p[2].events = link->rx->blocked ? POLLOUT : 0;
+
+			wait = NULL;
+			if( next )
+			{
+				now = GetTime_Microseconds();
+				next = next > now ? next - now : 0;
+				timeout.tv_sec = next / 1000000;
+				timeout.tv_nsec = (next % 1000000) * 1000;
+				wait = &timeout;
+			}
+
+			if( ppoll( p, 3, wait, NULL ) > 0 )
+			{
+				if( p[0].revents & POLLIN )
+					if( read( link->wake, &discard, sizeof(discard) ) < 0 )
+						;
+				if( p[1].revents & (POLLIN | POLLHUP | POLLERR) )
+					link->receive( GetTime_Microseconds() );
+			}
+		}
+
+		return( NULL );
+	}
+};
+
+#endif
@@ -0,0 +1,425 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        LinuxLog.h - Messages written out by a background thread
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// At the higher reporting levels, the ports log every command and frame.  Formatting each message
+// and writing it to stdout from the thread serving the ports would hold up the next frame, so once
+// serving starts, log() only records the message: the format string, which is a literal and so
+// stays put, and the arguments it takes, copied as they are.  A background thread formats the
+// records and writes them out, in the order they were made, a few milliseconds later.
+//
+// Each thread that logs gets a ring of its own, which only it adds to and only the background
+// thread takes from, so recording takes no lock and makes no system call.  If a ring fills up,
+// messages are dropped, rather than holding up the thread, and the number lost is reported once
+// there is room again.  Rings stay allocated once a thread has logged.
+//
+// The arguments are found from the format string, as printf would find them: integers of each
+// size, doubles, characters, pointers and strings, which are copied (up to LOG_MAXSTRING
+// characters in all).  '*' widths are not supported.
+//
+
+#ifndef LINUXLOG_H_INCLUDED
+#define LINUXLOG_H_INCLUDED
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOG_RING (256*1024)                 // for each thread, a power of 2
+#define LOG_MAXSTRING 8192
+#define LOG_FLUSH_MS 10                     // records are written out at least this often
+
+//
+// Each record starts on an 8 byte boundary.  The arguments follow in 8 byte slots, a string as
+// its length and then its characters and a 0, padded out to the next slot.  A record with no
+// format fills out the end of the ring, where the next record didn't fit.
+//
+struct logRecord {
+	unsigned long long time;
+	const char *format;
+	unsigned int length;                    // of the whole record, a multiple of 8
+	unsigned int reserved;
+};
+
+struct logRing {
+	unsigned char *data;
+	unsigned long long head, tail;          // bytes ever added and taken, head - tail are in the ring
+	unsigned long lost, reported;           // messages dropped because the ring was full
+	struct logRing *next;
+};
+
+class MessageLog
+{
+public:
+	MessageLog( FILE *p_out )
+	{
+		out = p_out;
+		rings = NULL;
+		stopping = 0;
+
+		pthread_mutex_init( &lock, NULL );
+		pthread_cond_init( &work, NULL );
+
+		if( pthread_create( &writer, NULL, writerThread, this ) )
+			log( -1, "Could not start the logging thread" );
+	}
+
+	//
+	// Writes out everything recorded so far, nothing more is recorded after this
+	//
+	void stop( void )
+	{
+		pthread_mutex_lock( &lock );
+		if( stopping )
+		{
+			pthread_mutex_unlock( &lock );
+			return;
+		}
+		stopping = 1;
+		pthread_cond_signal( &work );
+		pthread_mutex_unlock( &lock );
+
+		pthread_join( writer, NULL );
+	}
+
+	//
+	// Returns 0 if nothing can be recorded, once stopped, and the message is to be written out
+	// straight away instead
+	//
+	int record( const char *format, va_list args )
+	{
+		struct logRing *r = ring();
+		unsigned char buff[ sizeof(struct logRecord) + LOG_MAXSTRING + 256 ];
+		struct logRecord *rec = (struct logRecord *) buff;
+		unsigned long long tail;
+		unsigned long at, len;
+
+		if( stopping || !r )
+			return( 0 );
+
+		len = pack( buff, format, args );
+
+		rec->time = GetTime_Microseconds();
+		rec->format = format;
+		rec->length = len;
+
+		tail = __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE );
+		at = r->head & (LOG_RING-1);
+
+		//
+		// A record doesn't wrap, the end of the ring is skipped instead.  There is room past the
+		// end for the header saying so.
+		//
+		if( LOG_RING - at < len )
+		{
+			if( LOG_RING - (r->head - tail) < (LOG_RING - at) + len )
+			{
+				r->lost++;
+				return( 1 );
+			}
+
+			((struct logRecord *) &r->data[at])->format = NULL;
+			((struct logRecord *) &r->data[at])->length = LOG_RING - at;
+			__atomic_store_n( &r->head, r->head + (LOG_RING - at), __ATOMIC_RELEASE );
+			at = 0;
+		}
+		else if( LOG_RING - (r->head - tail) < len )
+		{
+			r->lost++;
+			return( 1 );
+		}
+
+		memcpy( &r->data[at], buff, len );
+		__atomic_store_n( &r->head, r->head + len, __ATOMIC_RELEASE );
+
+		return( 1 );
+	}
+
+private:
+	FILE *out;
+	struct logRing *rings;
+
+	pthread_mutex_t lock;                   // stopping, and the waits of the writer
+	pthread_cond_t work;
+	pthread_t writer;
+	volatile int stopping;
+
+	//
+	// The calling thread's ring, added to the list the first time
+	//
+	struct logRing *ring( void )
+	{
+		static __thread struct logRing *mine = NULL;
+		struct logRing *r;
+
+		if( mine )
+			return( mine );
+
+		if( !(r = (struct logRing *) calloc( 1, sizeof(struct logRing) )) || !(r->data = (unsigned char *) malloc( LOG_RING + sizeof(struct logRecord) )) )
+			return( NULL );
+
+		r->next = __atomic_load_n( &rings, __ATOMIC_ACQUIRE );
+		while( !__atomic_compare_exchange_n( &rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE ) ) ;
+
+		return( mine = r );
+	}
+
+	//
+	// Steps through a format string to the next conversion, returning the literal text before it
+	// in 'len', and the conversion in 'spec' and 'specLen'.  Returns the conversion character, and
+	// 'size' is 2 for ll, 1 for l or z, otherwise 0.  Returns 0 at the end of the string.
+	//
+	static char nextConversion( const char **f, unsigned long *len, const char **spec, unsigned long *specLen, int *size )
+	{
+		const char *c = *f, *s;
+
+		for( ;; )
+		{
+			for( s = c; *s && *s != '%'; s++ ) ;
+			*len = s - *f;
+
+			if( !*s )
+			{
+				*f = s;
+				return( 0 );
+			}
+
+			if( s[1] == '%' )             // taken as literal text, with the first % dropped below
+			{
+				c = s + 2;
+				continue;
+			}
+
+			*spec = s;
+			for( s++; *s && strchr( "-+ #0123456789.", *s ); s++ ) ;
+			for( *size = 0; *s == 'l' || *s == 'h' || *s == 'z' || *s == 'j' || *s == 'q' || *s == 'L'; s++ )
+				*size += *s == 'l' || *s == 'z' || *s == 'j' || *s == 'q' ? 1 : 0;
+			*specLen = s + 1 - *spec;
+			*f = *s ? s + 1 : s;
+
+			return( *s ? *s : 0 );
+		}
+	}
+
+	//
+	// Copies the arguments into the record after the header, returns the length of the record
+	//
+	static unsigned long pack( unsigned char *buff, const char *format, va_list args )
+	{
+		unsigned long at = sizeof(struct logRecord), len, specLen, n;
+		const char *f = format, *spec, *str;
+		unsigned long long v;
+		double d;
+		int size;
+		char c;
+
+		while( (c = nextConversion( &f, &len, &spec, &specLen, &size )) )
+		{
+			if( at > sizeof(struct logRecord) + LOG_MAXSTRING )
+				break;
+
+			switch( c )
+			{
+			case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+				v = size > 1 ? va_arg( args, unsigned long long ) : size ? va_arg( args, unsigned long ) : va_arg( args, unsigned int );
+				memcpy( &buff[at], &v, 8 );
+				at += 8;
+				break;
+			case 'f': case 'e': case 'E': case 'g': case 'G':
+				d = va_arg( args, double );
+				memcpy( &buff[at], &d, 8 );
+				at += 8;
+				break;
+			case 'p':
+				v = (unsigned long) va_arg( args, void * );
+				memcpy( &buff[at], &v, 8 );
+				at += 8;
+				break;
+			case 's':
+				if( !(str = va_arg( args, const char * )) )
+					str = "(null)";
+				for( n = 0; str[n] && n < LOG_MAXSTRING + sizeof(struct logRecord) - at; n++ ) ;
+				v = n;
+				memcpy( &buff[at], &v, 8 );
+				memcpy( &buff[at+8], str, n );
+				buff[at+8+n] = 0;
+				at += 8 + ((n + 8) & ~7UL);
+				break;
+			}
+		}
+
+		return( at );
+	}
+
+	//
+	// Formats a record as printf would have, one conversion at a time
+	//
+	static void format( FILE *out, struct logRecord *rec )
+	{
+		unsigned char *arg = (unsigned char *) (rec + 1), *end = (unsigned char *) rec + rec->length;
+		const char *f = rec->format, *literal, *spec;
+		unsigned long len, specLen;
+		char conv[ 32 ];
+		unsigned long long v;
+		double d;
+		int size;
+		char c;
+
+		for( ;; )
+		{
+			literal = f;
+			c = nextConversion( &f, &len, &spec, &specLen, &size );
+
+			//
+			// The literal text, with any %% as %
+			//
+			for( const char *l = literal; l < literal + len; l++ )
+			{
+				if( l[0] == '%' && l[1] == '%' )
+					l++;
+				putc_unlocked( *l, out );
+			}
+
+			if( !c || arg >= end || specLen >= sizeof(conv) )
+				break;
+
+			memcpy( conv, spec, specLen );
+			conv[ specLen ] = 0;
+			memcpy( &v, arg, 8 );
+
+			switch( c )
+			{
+			case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+				if( size > 1 )
+					fprintf( out, conv, v );
+				else if( size )
+					fprintf( out, conv, (unsigned long) v );
+				else
+					fprintf( out, conv, (unsigned int) v );
+				arg += 8;
+				break;
+			case 'f': case 'e': case 'E': case 'g': case 'G':
+				memcpy( &d, arg, 8 );
+				fprintf( out, conv, d );
+				arg += 8;
+				break;
+			case 'p':
+				fprintf( out, conv, (void *) (unsigned long) v );
+				arg += 8;
+				break;
+			case 's':
+				fprintf( out, conv, (const char *) arg + 8 );
+				arg += 8 + ((v + 8) & ~7ULL);
+				break;
+			}
+		}
+
+		putc_unlocked( '\n', out );
+	}
+
+	static void *writerThread( void *arg )
+	{
+		MessageLog *m = (MessageLog *) arg;
+		struct logRing *r, *oldest;
+		struct logRecord *rec, *first;
+		unsigned long long head;
+		struct timespec until;
+		int stopping;
+
+		for( ;; )
+		{
+			stopping = m->stopping;
+
+			flockfile( m->out );
+
+			//
+			// The oldest record of all the rings goes next
+			//
+			for( ;; )
+			{
+				oldest = NULL;
+				first = NULL;
+
+				for( r = __atomic_load_n( &m->rings, __ATOMIC_ACQUIRE ); r; r = r->next )
+				{
+					head = __atomic_load_n( &r->head, __ATOMIC_ACQUIRE );
+
+					while( r->tail != head )
+					{
+						rec = (struct logRecord *) &r->data[ r->tail & (LOG_RING-1) ];
+						if( rec->format )
+							break;
+						__atomic_store_n( &r->tail, r->tail + rec->length, __ATOMIC_RELEASE );
+					}
+
+					if( r->tail == head )
+					{
+						if( r->lost != r->reported )
+						{
+							fprintf( m->out, "%lu messages lost, logging could not keep up\n", r->lost - r->reported );
+							r->reported = r->lost;
+						}
+					}
+					else if( !first || rec->time < first->time )
+					{
+						oldest = r;
+						first = rec;
+					}
+				}
+
+				if( !oldest )
+					break;
+
+				format( m->out, first );
+				__atomic_store_n( &oldest->tail, oldest->tail + first->length, __ATOMIC_RELEASE );
+			}
+
+			fflush( m->out );
+			funlockfile( m->out );
+
+			if( stopping )
+				break;
+
+			pthread_mutex_lock( &m->lock );
+			if( !m->stopping )
+			{
+				clock_gettime( CLOCK_REALTIME, &until );
+				until.tv_nsec += LOG_FLUSH_MS * 1000000L;
+				if( until.tv_nsec >= 1000000000L )
+				{
+					until.tv_sec++;
+					until.tv_nsec -= 1000000000L;
+				}
+				pthread_cond_timedwait( &m->work, &m->lock, &until );
+			}
+			pthread_mutex_unlock( &m->lock );
+		}
+
+		return( NULL );
+	}
+};
+
+#endif
@@ -26,81 +26,374 @@
 #include <termios.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <stdlib.h>
 #include "../library/Library.h"
+#include "LinuxLink.h"
+#include "LinuxTrace.h"
 
-#define PIPENAME "\\\\.\\pipe\\xtide"
+#define PIPENAME "unix:/tmp/xtide"
+
+#define SOCKET_BUFFER (1024*1024)
 
 class SerialAccess
 {
 public:
+	//
+	// 'name' is a serial device, "pty" to create a new pseudo-terminal for a local client, or a
+	// socket for an emulator (see isSocket)
+	//
 	void Connect( const char *name, struct baudRate *p_baudRate )
 	{
-		char buff1[20], buff2[1024];
+		struct termios state;
 
-		baudRate = p_baudRate;
+		baudRate = requestedBaudRate = p_baudRate;
 
 		pipe = -1;
 
-		if( !access(name, R_OK | W_OK) )
+		if( isSocket( name ) )
+		{
+			acceptSocket( name );
+			connected();
+			return;
+		}
+
+		if( !strcmp( name, "pty" ) )
+		{
+			if( (pipe = posix_openpt( O_RDWR | O_NOCTTY )) < 0 || grantpt( pipe ) || unlockpt( pipe ) )
+				log( -1, "Could not create a pseudo-terminal (error %i)", errno );
+
+			strncpy( deviceName, ptsname( pipe ), sizeof(deviceName) - 1 );
+
+			//
+			// Hold the slave side open ourselves, so that the master doesn't report a hang up
+			// while no client has the pseudo-terminal open
+			//
+			if( (ptySlave = open( deviceName, O_RDWR | O_NOCTTY )) < 0 )
+				log( -1, "Could not open \"%s\"", deviceName );
+
+			tcgetattr(ptySlave, &state);
+			cfmakeraw(&state);
+			tcsetattr(ptySlave, TCSANOW, &state);
+
+			log( 0, "Opening pseudo-terminal %s (%s baud)", deviceName, baudRate->display );
+		}
+		else if( !access(name, R_OK | W_OK) )
 		{
-			struct termios state;
-			  
 			log( 0, "Opening %s (%s baud)", name, baudRate->display );
 
+			strncpy( deviceName, name, sizeof(deviceName) - 1 );
+
 			pipe = open(name, O_RDWR);
 			if( pipe < 0 )
 				log( -1, "Could not Open \"%s\"", name );
-
-			tcgetattr(pipe, &state);
-			cfmakeraw(&state);
-			state.c_cflag |= CRTSCTS | CLOCAL;
-			state.c_lflag &= ~ECHO;
-			cfsetispeed(&state, baudRate->speed);
-			cfsetospeed(&state, baudRate->speed);
-			tcsetattr(pipe, TCSAFLUSH, &state);
 		}
 		else
 			log( -1, "Serial port '%s' not found", name );
+
+		tcgetattr(pipe, &state);
+		cfmakeraw(&state);
+		state.c_cflag |= CRTSCTS | CLOCAL;
+		state.c_lflag &= ~ECHO;
+		cfsetispeed(&state, baudRate->speed);
+		cfsetospeed(&state, baudRate->speed);
+		tcsetattr(pipe, TCSAFLUSH, &state);
+
+		connected();
+	}
+
+	//
+	// Emulators connect to "tcp:port", on localhost, or to "unix:path", a Unix domain socket
+	//
+	static int isSocket( const char *name )
+	{
+		return( !strncmp( name, "tcp:", 4 ) || !strncmp( name, "unix:", 5 ) );
+	}
+
+	//
+	// Sockets are only bound once, so that an emulator can connect (and reconnect) to any of the
+	// ports while the server is waiting on another.  Does nothing for serial devices.
+	//
+	void Listen( const char *name )
+	{
+		struct sockaddr_in in;
+		struct sockaddr_un un;
+		struct stat st;
+		int on = 1;
+
+		if( !isSocket( name ) || listener >= 0 )
+			return;
+
+		strncpy( deviceName, name, sizeof(deviceName) - 1 );
+
+		if( name[0] == 't' )
+		{
+			memset( &in, 0, sizeof(in) );
+			in.sin_family = AF_INET;
+			in.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+			if( !(in.sin_port = htons( atoi( &name[4] ) )) )
+				log( -2, "'%s', missing TCP port number", name );
+
+			if( (listener = socket( AF_INET, SOCK_STREAM, 0 )) < 0 )
+				log( -1, "'%s', could not create socket (error %i)", name, errno );
+
+			setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+			setSocketBuffers( listener );
+
+			if( bind( listener, (struct sockaddr *) &in, sizeof(in) ) )
+				log( -1, "'%s', could not bind (error %i)", name, errno );
+		}
+		else
+		{
+			memset( &un, 0, sizeof(un) );
+			un.sun_family = AF_UNIX;
+			if( strlen( &name[5] ) >= sizeof(un.sun_path) || !name[5] )
+				log( -2, "'%s', bad Unix socket path", name );
+			strcpy( un.sun_path, &name[5] );
+
+			//
+			// A socket left behind by an earlier server is replaced, but nothing else is
+			//
+			if( !stat( un.sun_path, &st ) && S_ISSOCK( st.st_mode ) )
+				unlink( un.sun_path );
+
+			if( (listener = socket( AF_UNIX, SOCK_STREAM, 0 )) < 0 )
+				log( -1, "'%s', could not create socket (error %i)", name, errno );
+
+			setSocketBuffers( listener );
+
+			if( bind( listener, (struct sockaddr *) &un, sizeof(un) ) )
+				log( -1, "'%s', could not bind (error %i)", name, errno );
+
+			socketPath = strdup( un.sun_path );
+		}
+
+		if( listen( listener, 1 ) )
+			log( -1, "'%s', could not listen (error %i)", name, errno );
+	}
+
+	//
+	// For a socket, returns the listening socket, which polls as readable when an emulator is
+	// waiting to be accepted, or -1 for serial devices
+	//
+	int listenHandle()
+	{
+		return( listener );
+	}
+
+	//
+	// Accepts the next connection on a socket, with the same settings as the last
+	//
+	void Reconnect()
+	{
+		Connect( deviceName, requestedBaudRate );
 	}
 
 	void Disconnect()
 	{
-		if( pipe )
+		if( link )
+		{
+			delete link;
+			link = NULL;
+			pipe = line;
+		}
+
+		if( pipe >= 0 )
 		{
 			close( pipe );
 			pipe = -1;
 		}
+
+		if( ptySlave >= 0 )
+		{
+			close( ptySlave );
+			ptySlave = -1;
+		}
+	}
+
+	//
+	// In non-blocking mode, readCharacters returns 0 when no characters are waiting, and
+	// writeCharacters waits for room in the output queue for no longer than the characters take
+	// on the wire plus p_writeAllowance microseconds.  One thread serves every port in this mode,
+	// so a client that stops reading is given up on rather than left to hold up the others.
+	//
+	void setNonBlocking( unsigned long long p_writeAllowance )
+	{
+		fcntl( pipe, F_SETFL, fcntl( pipe, F_GETFL ) | O_NONBLOCK );
+		writeAllowance = p_writeAllowance;
+	}
+
+	int handle()
+	{
+		return( pipe );
+	}
+
+	//
+	// Waits until there are characters to read, or until the time 'until' (see
+	// GetTime_Microseconds), returning 0 if it has passed first
+	//
+	int waitCharacters( unsigned long long until )
+	{
+		unsigned long long now;
+		struct timespec timeout;
+		struct pollfd p;
+		int n;
+
+		p.fd = pipe;
+		p.events = POLLIN;
+
+		do
+		{
+			if( (now = GetTime_Microseconds()) >= until )
+				now = until;
+
+			timeout.tv_sec = (until - now) / 1000000;
+			timeout.tv_nsec = ((until - now) % 1000000) * 1000;
+
+			if( (n = ppoll( &p, 1, &timeout, NULL )) < 0 && errno != EINTR )
+				log( -1, "'%s', poll serial failed (error code %i)", deviceName, errno );
+		}
+		while( n < 0 );
+
+		return( n > 0 );
 	}
 
 	unsigned long readCharacters( void *buff, unsigned long len )
 	{
-		unsigned long readLen;
-		int ret;
+		ssize_t readLen;
 
-		readLen = read(pipe, buff, len);
+		while( (readLen = read(pipe, buff, len)) < 0 )
+		{
+			if( errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNRESET )
+				return( 0 );
+			if( errno != EINTR )
+				log( -1, "'%s', read serial failed (error code %i)", deviceName, errno );
+		}
 
-		if( readLen < 0 )
-			log( -1, "read serial failed (error code %i)", errno );
+		if( trace && readLen > 0 )
+		{
+			struct sendSegment segment = { buff, (unsigned long) readLen };
+
+			trace->record( traceId, TRACE_RECEIVED, &segment, 1 );
+		}
 
 		return( readLen );
 	}
 
 	int writeCharacters( void *buff, unsigned long len )
 	{
-		unsigned long writeLen;
-		int ret;
+		struct sendSegment segment = { buff, len };
+		unsigned long long until = writeDeadline( len );
+		ssize_t writeLen;
 
-		writeLen = write(pipe, buff, len);
+		if( link )
+			return( link->send( &segment, 1 ) && traceSent( &segment, 1 ) );
 
-		if( writeLen < 0 )
-			log( -1, "write serial failed (error code %i)", errno );
+		while( len )
+		{
+			if( (writeLen = write(pipe, buff, len)) < 0 )
+			{
+				if( errno == EAGAIN || errno == EWOULDBLOCK )
+				{
+					if( !waitWritable( until ) )
+						return( 0 );
+				}
+				else if( errno == EPIPE || errno == ECONNRESET )
+					return( 0 );                       // the emulator has gone away
+				else if( errno != EINTR )
+					log( -1, "'%s', write serial failed (error code %i)", deviceName, errno );
+				continue;
+			}
 
-		return( 1 );
+			buff = (char *) buff + writeLen;
+			len -= writeLen;
+		}
+
+		return( traceSent( &segment, 1 ) );
+	}
+
+	//
+	// Sends several pieces of data with as few system calls as possible, for example a sector
+	// straight out of a memory mapped image followed by its checksum
+	//
+	int writeSegments( struct sendSegment *segments, int count )
+	{
+		struct iovec iov[ SEND_SEGMENTS ];
+		struct iovec *next = &iov[0];
+		unsigned long long until;
+		unsigned long len = 0;
+		ssize_t writeLen;
+		int segmentCount = count;
+
+		if( count > SEND_SEGMENTS )
+			log( -1, "'%s', too many segments to send (%d)", deviceName, count );
+
+		if( link )
+			return( link->send( segments, count ) && traceSent( segments, count ) );
+
+		for( int t = 0; t < count; t++ )
+		{
+			iov[t].iov_base = segments[t].data;
+			iov[t].iov_len = segments[t].len;
+			len += segments[t].len;
+		}
+		until = writeDeadline( len );
+
+		while( count )
+		{
+			if( (writeLen = writev(pipe, next, count)) < 0 )
+			{
+				if( errno == EAGAIN || errno == EWOULDBLOCK )
+				{
+					if( !waitWritable( until ) )
+						return( 0 );
+				}
+				else if( errno == EPIPE || errno == ECONNRESET )
+					return( 0 );                       // the emulator has gone away
+				else if( errno != EINTR )
+					log( -1, "'%s', write serial failed (error code %i)", deviceName, errno );
+				continue;
+			}
+
+			//
+			// Skip past what was written, which may end part way through a segment
+			//
+			while( count && (size_t) writeLen >= next->iov_len )
+			{
+				writeLen -= next->iov_len;
+				next++;
+				count--;
+			}
+			if( count )
+			{
+				next->iov_base = (char *) next->iov_base + writeLen;
+				next->iov_len -= writeLen;
+			}
+		}
+
+		return( traceSent( segments, segmentCount ) );
 	}
 
 	SerialAccess()
 	{
-		pipe = 0;
+		pipe = -1;
+		ptySlave = -1;
+		listener = -1;
+		socketPath = NULL;
+		link = NULL;
+		linkEmulation = NULL;
+		trace = NULL;
+		traceId = 0;
+		requestedBaudRate = NULL;
+		writeAllowance = 0;
+		memset( deviceName, 0, sizeof(deviceName) );
 		speedEmulation = 0;
 		resetConnection = 0;
 		baudRate = NULL;
@@ -109,6 +402,15 @@ public:
 	~SerialAccess()
 	{
 		Disconnect();
+
+		if( listener >= 0 )
+			close( listener );
+
+		if( socketPath )
+		{
+			unlink( socketPath );
+			free( socketPath );
+		}
 	}
 
 	int speedEmulation;
@@ -116,7 +418,140 @@ public:
 
 	struct baudRate *baudRate;
 
+	//
+	// When set, the connection is paced as a real serial line at baudRate, see LinuxLink.h
+	//
+	struct linkEmulation *linkEmulation;
+
+	//
+	// When set, everything sent and received is recorded, see LinuxTrace.h
+	//
+	ProtocolTrace *trace;
+
+	char deviceName[ 128 ];
+
 private:
 	int pipe;
+	int ptySlave;
+	int listener;
+	char *socketPath;
+	int line;
+	LinkEmulator *link;
+	struct baudRate *requestedBaudRate;
+	int traceId;
+	unsigned long long writeAllowance;  // see setNonBlocking, 0 to wait for room as long as it takes
+
+	//
+	// When a write of 'len' characters has to be given up on, or 0 for never
+	//
+	unsigned long long writeDeadline( unsigned long len )
+	{
+		if( !writeAllowance )
+			return( 0 );
+
+		return( GetTime_Microseconds() + writeAllowance +
+				(baudRate && baudRate->rate ? len * 10000000ULL / baudRate->rate : 0) );
+	}
+
+	//
+	// Waits for room in the output queue, returns 0 once 'until' has passed
+	//
+	int waitWritable( unsigned long long until )
+	{
+		unsigned long long now = 0;
+		struct timespec timeout;
+		struct pollfd p;
+
+		if( until && (now = GetTime_Microseconds()) >= until )
+		{
+			log( 1, "'%s', the client has stopped reading, closing the connection", deviceName );
+			return( 0 );
+		}
+
+		timeout.tv_sec = (until - now) / 1000000;
+		timeout.tv_nsec = ((until - now) % 1000000) * 1000;
+
+		p.fd = pipe;
+		p.events = POLLOUT;
+		if( ppoll( &p, 1, until ? &timeout : NULL, NULL ) < 0 && errno != EINTR )
+			log( -1, "'%s', poll serial failed (error code %i)", deviceName, errno );
+
+		return( 1 );
+	}
+
+	//
+	// Called once a connection is open
+	//
+	void connected( void )
+	{
+		startLink();
+
+		if( trace )
+			traceId = trace->connect( deviceName );
+	}
+
+	int traceSent( struct sendSegment *segments, int count )
+	{
+		if( trace )
+			trace->record( traceId, TRACE_SENT, segments, count );
+
+		return( 1 );
+	}
+
+	//
+	// The client can only be heard at the emulated rate, so Inquire at any other is ignored
+	//
+	void startLink( void )
+	{
+		if( !linkEmulation )
+			return;
+
+		line = pipe;
+		link = new LinkEmulator( line, deviceName, linkEmulation, baudRate->rate );
+		pipe = link->handle();
+		speedEmulation = 1;
+	}
+
+	//
+	// Large buffers let a whole multi-sector transfer sit in the socket, so the server rarely waits
+	// on the emulator draining it.  The listening socket passes these on to accepted connections.
+	//
+	void setSocketBuffers( int fd )
+	{
+		int size = SOCKET_BUFFER;
+
+		setsockopt( fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+		setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) );
+	}
+
+	//
+	// Waits for the emulator to connect.  There is no line speed on a socket, sectors go as fast as
+	// the emulator takes them.  If a baud rate was given it is simulated as far as the client can see:
+	// Inquire is only answered at that rate, as it would be on a real port.
+	//
+	void acceptSocket( const char *name )
+	{
+		int on = 1;
+
+		Listen( name );
+
+		speedEmulation = (baudRate != NULL);
+		if( !baudRate )
+			baudRate = baudRateMatchString( "115200" );
+		resetConnection = 1;
+
+		log( 0, "Waiting on %s for an emulator to connect (%s)", name,
+			 speedEmulation ? baudRate->display : "any baud rate" );
+
+		while( (pipe = accept( listener, NULL, NULL )) < 0 )
+			if( errno != EINTR )
+				log( -1, "'%s', accept failed (error %i)", name, errno );
+
+		if( name[0] == 't' )
+			setsockopt( pipe, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+		setSocketBuffers( pipe );
+
+		log( 1, "%s: Emulator connected", name );
+	}
 };
 
@@ -0,0 +1,248 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        LinuxServer.cpp - Serving several serial ports from one process
+//
+// Each serial port has its own ProcessState, and characters are handed to it as they arrive,
+// with epoll telling us which ports have data waiting.  Images that are given for more than
+// one port are shared.  A socket whose emulator disconnects goes back to waiting for
+// another connection.
+//
+// The reads and writes are done by a worker thread for each image (see ImageWorker.h), so
+// that a slow image only holds up the ports using it.  While a port waits on its worker, it
+// is taken out of epoll, and put back once the worker has signalled the completions eventfd
+// and the port has carried on.
+//
+// The control socket (see LinuxControl.h) is served here too, so that the images behind the
+// drives are only changed between the commands of the ports.
+//
+// A port part way through a command has a deadline for the client to carry on (see
+// ProcessState::deadline), and epoll_wait is given a timeout to the nearest one, so that a
+// client that has stalled is given up on when the time comes, not when it next sends something.
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "LinuxServer.h"
+#include "LinuxControl.h"
+#include "../library/ImageWorker.h"
+
+#define MAXEVENTS 32
+#define LISTENING 0x80000000              // event is for the listening socket of the port
+#define COMPLETIONS 0x40000000            // event is for the completions eventfd
+
+static int completions;
+
+static void jobCompleted( void *arg )
+{
+	unsigned long long one = 1;
+
+	if( write( completions, &one, sizeof(one) ) < 0 )
+		;
+}
+
+//
+// Reading from the port stops while it waits on a worker (PROCESS_WAITING), and starts again
+// after it has carried on.  Returns 0 if the connection is to be closed.
+//
+static int portResult( int epfd, ProcessState *state, int t, int result, int wasWaiting )
+{
+	struct epoll_event ev;
+
+	if( !result )
+		return( 0 );
+
+	if( (result == PROCESS_WAITING) == wasWaiting )
+		return( 1 );
+
+	ev.events = result == PROCESS_WAITING ? 0 : EPOLLIN | EPOLLRDHUP;
+	ev.data.u32 = t;
+	if( epoll_ctl( epfd, EPOLL_CTL_MOD, state->serial->handle(), &ev ) )
+		log( -1, "'%s', could not change epoll (error %i)", state->serial->deviceName, errno );
+
+	return( 1 );
+}
+
+static void closePort( int epfd, ProcessState *state, int t, int *active )
+{
+	struct epoll_event ev;
+
+	log( 0, "'%s', connection closed", state->serial->deviceName );
+	epoll_ctl( epfd, EPOLL_CTL_DEL, state->serial->handle(), NULL );
+	state->serial->Disconnect();
+	state->reset();
+
+	if( state->serial->listenHandle() >= 0 )
+	{
+		ev.events = EPOLLIN;
+		ev.data.u32 = t | LISTENING;
+		if( epoll_ctl( epfd, EPOLL_CTL_ADD, state->serial->listenHandle(), &ev ) )
+			log( -1, "'%s', could not add to epoll (error %i)", state->serial->deviceName, errno );
+	}
+	else
+		(*active)--;
+}
+
+void serveRequests( ProcessState *states[], int count, DriveTable *drives, DriveControl *control )
+{
+	struct epoll_event ev, events[ MAXEVENTS ];
+	struct driveSlot *slot;
+	unsigned long long discard, now, until, nearest;
+	int epfd, n, active, result, wasWaiting, timeout = -1, controlTimeout = -1;
+	unsigned long len;
+
+	if( (epfd = epoll_create1( 0 )) < 0 )
+		log( -1, "Could not create epoll instance (error %i)", errno );
+
+	if( (completions = eventfd( 0, EFD_NONBLOCK )) < 0 )
+		log( -1, "Could not create eventfd (error %i)", errno );
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = COMPLETIONS;
+	if( epoll_ctl( epfd, EPOLL_CTL_ADD, completions, &ev ) )
+		log( -1, "Could not add to epoll (error %i)", errno );
+
+	//
+	// One worker for each image, however many drives it is behind
+	//
+	for( int p = 0; p < drives->ports; p++ )
+		for( int d = 0; d < 2; d++ )
+			if( (slot = drives->slot( p, d ))->image && !slot->worker &&
+				!(slot->worker = drives->findWorker( slot->image )) )
+				slot->worker = new ImageWorker( slot->image, jobCompleted, NULL );
+
+	for( int t = 0; t < count; t++ )
+	{
+		states[t]->serial->setNonBlocking( states[t]->writeAllowance() );
+
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.u32 = t;
+		if( epoll_ctl( epfd, EPOLL_CTL_ADD, states[t]->serial->handle(), &ev ) )
+			log( -1, "'%s', could not add to epoll (error %i)", states[t]->serial->deviceName, errno );
+	}
+
+	if( control )
+		control->serve( epfd, jobCompleted );
+
+	active = count;
+
+	while( active )
+	{
+		if( (n = epoll_wait( epfd, events, MAXEVENTS, timeout )) < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			log( -1, "epoll_wait failed (error %i)", errno );
+		}
+
+		for( int e = 0; e < n; e++ )
+		{
+			int t = events[e].data.u32 & ~LISTENING;
+			ProcessState *state;
+
+			//
+			// Workers have finished jobs, the ports waiting on them carry on
+			//
+			if( events[e].data.u32 == COMPLETIONS )
+			{
+				if( read( completions, &discard, sizeof(discard) ) < 0 )
+					;
+
+				for( t = 0; t < count; t++ )
+					if( states[t]->waiting() && !portResult( epfd, states[t], t, states[t]->resume(), 1 ) )
+						closePort( epfd, states[t], t, &active );
+				continue;
+			}
+
+			if( events[e].data.u32 & CONTROL_EVENT )
+			{
+				control->event( events[e].data.u32, events[e].events, states, count );
+				continue;
+			}
+
+			state = states[t];
+
+			//
+			// An emulator is waiting on a socket whose last connection closed, so accept won't block
+			//
+			if( events[e].data.u32 & LISTENING )
+			{
+				epoll_ctl( epfd, EPOLL_CTL_DEL, state->serial->listenHandle(), NULL );
+
+				state->serial->Reconnect();
+				state->serial->setNonBlocking( state->writeAllowance() );
+				state->reset();
+
+				ev.events = EPOLLIN | EPOLLRDHUP;
+				ev.data.u32 = t;
+				if( epoll_ctl( epfd, EPOLL_CTL_ADD, state->serial->handle(), &ev ) )
+					log( -1, "'%s', could not add to epoll (error %i)", state->serial->deviceName, errno );
+				continue;
+			}
+
+			//
+			// Hand over everything that is waiting on this port, unless it is waiting on a worker.
+			//
+			// A socket that the emulator has closed reads as empty once drained, like a port with
+			// nothing waiting, so the hang up is checked for as well.
+			//
+			if( state->serial->handle() < 0 )
+				continue;             // closed earlier in this batch of events
+
+			wasWaiting = state->waiting();
+			result = wasWaiting ? PROCESS_WAITING : 1;
+			while( result == 1 && (len = state->serial->readCharacters( state->receiveBuffer(), state->receiveLength() )) )
+				result = state->received( len );
+
+			if( !portResult( epfd, state, t, result, wasWaiting ) || (events[e].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) )
+				closePort( epfd, state, t, &active );
+		}
+
+		//
+		// Changes to the drives wait for the commands in progress
+		//
+		if( control )
+			controlTimeout = control->carryOn( states, count );
+
+		//
+		// Ports past their deadline go back to looking for a command header, after the
+		// characters that have arrived in time have been handed over above
+		//
+		now = GetTime_Microseconds();
+		nearest = 0;
+		for( int t = 0; t < count; t++ )
+		{
+			if( states[t]->serial->handle() < 0 || !(until = states[t]->deadline()) )
+				continue;
+
+			if( until <= now )
+				states[t]->timedOut();
+			else if( !nearest || until < nearest )
+				nearest = until;
+		}
+
+		timeout = controlTimeout;
+		if( nearest && (timeout < 0 || (nearest - now + 999) / 1000 < (unsigned long long) timeout) )
+			timeout = (nearest - now + 999) / 1000;
+	}
+}
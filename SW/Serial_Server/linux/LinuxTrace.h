@@ -0,0 +1,328 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        LinuxTrace.h - Binary trace of everything sent and received on the serial ports
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// ProtocolTrace records the bytes exactly as they cross each port, with the time and direction,
+// so that a session can be looked at, measured and replayed afterwards with sertrace (see
+// LinuxTraceTool.cpp).  It is meant to be left on while timing matters: recording a read or write
+// is a copy into a preallocated ring under a short lock, and a background thread writes the ring
+// to the file.  If the ring fills up, records are dropped rather than holding up the port, and a
+// TRACE_DROPPED record says how many were lost.
+//
+// The file is a traceFileHeader, followed by records: a traceRecord and then 'length' bytes of
+// data.  All fields are little-endian, and laid out the same on 32 and 64 bit machines.
+//
+//     TRACE_CONNECT     a new connection on the port, the data is the port name
+//     TRACE_RECEIVED    bytes read from the client, as one read returned them
+//     TRACE_SENT        bytes written to the client, timed once they have been handed to the port
+//     TRACE_DROPPED     an unsigned int count of records lost before this one
+//
+// Times are in microseconds since the trace was started.
+//
+
+#ifndef LINUXTRACE_H_INCLUDED
+#define LINUXTRACE_H_INCLUDED
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "../library/Library.h"
+
+#define TRACE_MAGIC "SDTRACE1"
+
+#define TRACE_CONNECT 1
+#define TRACE_RECEIVED 2
+#define TRACE_SENT 3
+#define TRACE_DROPPED 4
+
+#define TRACE_RING (8*1024*1024)            // a power of 2
+#define TRACE_FLUSH_MS 100                  // the ring is written out at least this often
+#define TRACE_MAXPORTS 64
+
+struct traceFileHeader {
+	char magic[8];
+	unsigned long long started;             // seconds since 1970
+};
+
+struct traceRecord {
+	unsigned long long time;
+	unsigned short port;
+	unsigned char type;
+	unsigned char reserved;
+	unsigned int length;
+};
+
+class ProtocolTrace
+{
+public:
+	ProtocolTrace( const char *p_path )
+	{
+		struct traceFileHeader header;
+
+		path = p_path;
+
+		if( (fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 )) < 0 )
+			log( -1, "'%s', could not create trace file (error %i)", path, errno );
+
+		memset( &header, 0, sizeof(header) );
+		memcpy( header.magic, TRACE_MAGIC, sizeof(header.magic) );
+		header.started = time( NULL );
+		writeOut( &header, sizeof(header) );
+
+		if( !(ring = (unsigned char *) malloc( TRACE_RING )) )
+			log( -1, "'%s', out of memory for the trace ring", path );
+
+		head = tail = 0;
+		dropped = lost = 0;
+		portCount = 0;
+		stopping = 0;
+		start = GetTime_Microseconds();
+
+		pthread_mutex_init( &lock, NULL );
+		pthread_cond_init( &work, NULL );
+
+		if( pthread_create( &writer, NULL, writerThread, this ) )
+			log( -1, "'%s', could not start the trace thread", path );
+
+		log( 1, "%s: Recording a protocol trace", path );
+	}
+
+	~ProtocolTrace()
+	{
+		stop();
+
+		close( fd );
+		free( ring );
+		for( int t = 0; t < portCount; t++ )
+			free( ports[t] );
+	}
+
+	//
+	// Waits until everything recorded has reached the file.  Nothing more is recorded after this,
+	// so it can be called on the way out while the ports are still being served.
+	//
+	void stop( void )
+	{
+		pthread_mutex_lock( &lock );
+		if( stopping )
+		{
+			pthread_mutex_unlock( &lock );
+			return;
+		}
+		stopping = 1;
+		pthread_cond_signal( &work );
+		pthread_mutex_unlock( &lock );
+
+		pthread_join( writer, NULL );
+
+		if( lost )
+			log( 0, "%s: %lu trace records lost, the ring was full", path, lost );
+	}
+
+	//
+	// Starts a new session on the named port, returns the number its records are made under.
+	// A port keeps its number across connections.
+	//
+	int connect( const char *name )
+	{
+		struct sendSegment segment;
+		int t;
+
+		pthread_mutex_lock( &lock );
+		for( t = 0; t < portCount && strcmp( ports[t], name ); t++ ) ;
+		if( t == portCount && portCount < TRACE_MAXPORTS )
+			ports[ portCount++ ] = strdup( name );
+		pthread_mutex_unlock( &lock );
+
+		segment.data = (void *) name;
+		segment.len = strlen( name );
+		record( t, TRACE_CONNECT, &segment, 1 );
+
+		return( t );
+	}
+
+	void record( int port, int type, struct sendSegment *segments, int count )
+	{
+		struct traceRecord r;
+		unsigned long length = 0, needed;
+
+		for( int s = 0; s < count; s++ )
+			length += segments[s].len;
+
+		r.time = GetTime_Microseconds() - start;
+		r.port = port;
+		r.type = type;
+		r.reserved = 0;
+		r.length = length;
+
+		pthread_mutex_lock( &lock );
+
+		if( stopping )
+		{
+			pthread_mutex_unlock( &lock );
+			return;
+		}
+
+		//
+		// After a loss, the next record to go in is preceded by the count of those lost
+		//
+		needed = sizeof(r) + length + (dropped ? sizeof(r) + sizeof(unsigned int) : 0);
+		if( room() < needed )
+		{
+			dropped++;
+			lost++;
+			pthread_mutex_unlock( &lock );
+			return;
+		}
+
+		if( dropped )
+		{
+			struct traceRecord d = r;
+			unsigned int n = dropped;
+
+			d.type = TRACE_DROPPED;
+			d.length = sizeof(n);
+			put( &d, sizeof(d) );
+			put( &n, sizeof(n) );
+			dropped = 0;
+		}
+
+		put( &r, sizeof(r) );
+		for( int s = 0; s < count; s++ )
+			put( segments[s].data, segments[s].len );
+
+		if( head - tail > TRACE_RING/2 )
+			pthread_cond_signal( &work );
+
+		pthread_mutex_unlock( &lock );
+	}
+
+private:
+	const char *path;
+	int fd;
+
+	unsigned char *ring;
+	unsigned long long head, tail;          // bytes ever recorded and written out, head - tail are in the ring
+	unsigned long dropped;                  // records lost since the last TRACE_DROPPED
+	unsigned long lost;                     // in all
+	unsigned long long start;
+
+	char *ports[ TRACE_MAXPORTS ];
+	int portCount;
+
+	pthread_mutex_t lock;                   // all of the above
+	pthread_cond_t work;
+	pthread_t writer;
+	int stopping;
+
+	unsigned long room( void )
+	{
+		return( TRACE_RING - (unsigned long) (head - tail) );
+	}
+
+	void put( const void *data, unsigned long len )
+	{
+		unsigned long at = head & (TRACE_RING-1);
+		unsigned long first = len < TRACE_RING - at ? len : TRACE_RING - at;
+
+		memcpy( &ring[at], data, first );
+		memcpy( &ring[0], (const unsigned char *) data + first, len - first );
+		head += len;
+	}
+
+	void writeOut( const void *data, unsigned long len )
+	{
+		ssize_t n;
+
+		while( len )
+		{
+			if( (n = write( fd, data, len )) < 0 )
+			{
+				if( errno == EINTR )
+					continue;
+				log( -1, "'%s', could not write trace file (error %i)", path, errno );
+			}
+			data = (const char *) data + n;
+			len -= n;
+		}
+	}
+
+	static void *writerThread( void *arg )
+	{
+		ProtocolTrace *trace = (ProtocolTrace *) arg;
+		unsigned long long from, to;
+		unsigned long at, len;
+		struct timespec until;
+
+		pthread_mutex_lock( &trace->lock );
+
+		for( ;; )
+		{
+			if( trace->head == trace->tail )
+			{
+				if( trace->stopping )
+					break;
+
+				clock_gettime( CLOCK_REALTIME, &until );
+				until.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+				if( until.tv_nsec >= 1000000000L )
+				{
+					until.tv_sec++;
+					until.tv_nsec -= 1000000000L;
+				}
+				pthread_cond_timedwait( &trace->work, &trace->lock, &until );
+				continue;
+			}
+
+			from = trace->tail;
+			to = trace->head;
+
+			//
+			// The records between tail and head stay put until tail is moved on, so they are written
+			// without the lock
+			//
+			pthread_mutex_unlock( &trace->lock );
+
+			while( from < to )
+			{
+				at = from & (TRACE_RING-1);
+				len = to - from < TRACE_RING - at ? to - from : TRACE_RING - at;
+				trace->writeOut( &trace->ring[at], len );
+				from += len;
+			}
+
+			pthread_mutex_lock( &trace->lock );
+			trace->tail = to;
+		}
+
+		pthread_mutex_unlock( &trace->lock );
+
+		return( NULL );
+	}
+};
+
+#endif
@@ -0,0 +1,924 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        LinuxTraceTool.cpp - Prints, measures and replays protocol traces recorded by SerDrive
+//
+// sertrace reads a trace recorded with SerDrive -x (see LinuxTrace.h) and splits the bytes on each
+// port back into frames, as the server and the BIOS see them: command headers, sectors with their
+// checksums, continuation ACKs and write echoes.  It can print every frame, or just the statistics:
+// command latencies from the first byte of the header to the last byte of the answer, and protocol
+// errors.
+//
+// A trace can also be replayed against a server, for regression testing and for comparing builds:
+// what the client sent is sent again, and what comes back is checked against what was recorded.
+// The statistics of the recording and the replay are then printed side by side.
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../library/Library.h"
+#include "LinuxConnect.h"
+
+//
+// Protocol, as in library/Process.cpp
+//
+#define SERIAL_COMMAND_HEADER 0xa0
+#define SERIAL_COMMAND_HEADERMASK 0xe0
+#define SERIAL_COMMAND_RWMASK 3
+#define SERIAL_COMMAND_INQUIRE 0
+#define SERIAL_COMMAND_READ 2
+#define SERIAL_COMMAND_WRITE 3
+
+#define ATA_COMMAND_LBA 0x40
+#define ATA_COMMAND_HEADMASK 0xf
+#define ATA_DriveAndHead_Drive 0x10
+
+#define SERVER_TIMEOUT 1000000              // us of silence before the server abandons a command
+
+#define DECODE_EXPECT 64                    // answers the client is owed, a power of 2
+
+const char *bannerStrings[] = {
+	"sertrace - XTIDE Universal BIOS Serial Drive Protocol Trace Tool",
+	"Copyright (C) 2012-2013 by XTIDE Universal BIOS Team",
+	"Released under GNU GPL v2, with ABSOLUTELY NO WARRANTY",
+	"",
+	NULL };
+
+const char *usageStrings[] = {
+	"Usage: sertrace [options] tracefile",
+	"",
+	"  tracefile           As recorded with SerDrive -x.  Every frame is printed,",
+	"                      followed by the statistics for each port",
+	"",
+	"  -s                  Only print the statistics",
+	"",
+	"  -r port             Replay the trace against a server on port: a serial device",
+	"                      or pseudo-terminal, \"tcp:port\" or \"unix:path\".  Repeat",
+	"                      for each port in the trace, in the order they first appear.",
+	"                      The server's answers are checked against the recording,",
+	"                      and the statistics of both are printed",
+	"  -t                  Keep the recorded timing when replaying, instead of going",
+	"                      as fast as the server answers",
+	"  -b BaudRate         Baud rate set on serial ports when replaying (default 115.2K)",
+	"  -T milliseconds     Time to wait on each answer when replaying (default 2000)",
+	"  -v                  Report every difference found when replaying",
+	NULL };
+
+void usagePrint( const char *strings[] )
+{
+	for( int t = 0; strings[t]; t++ )
+		fprintf( stderr, "%s\n", strings[t] );
+}
+
+#define usage() { usagePrint( usageStrings ); exit(1); }
+
+int verbose = 0;
+
+//
+// A record of the trace, as read or replayed
+//
+struct event {
+	unsigned long long time;
+	int port;
+	int type;
+	unsigned long length;
+	unsigned char *data;
+};
+
+struct trace {
+	struct event *events;
+	unsigned long count;
+	unsigned long long started;
+	const char *names[ TRACE_MAXPORTS ];
+	int ports;
+};
+
+struct traceStats {
+	struct histogram latency[ STATS_COMMANDS ];
+	unsigned long sectors[ STATS_COMMANDS ];
+	unsigned long long first, last;
+	unsigned long long received, sent;      // bytes
+
+	unsigned long connects;
+	unsigned long badHeaders;               // command checksum
+	unsigned long badSectors;               // write sector checksum
+	unsigned long continueFaults;
+	unsigned long timeouts;
+	unsigned long spurious;                 // bytes from the client outside of a command
+	unsigned long unexpected;               // bytes from the server that weren't asked for
+	unsigned long unanswered;               // frames the client was owed, and never got
+	unsigned long dropped;                  // records lost from the trace
+};
+
+#define EXPECT_INQUIRE 0
+#define EXPECT_SECTOR 1
+#define EXPECT_ECHO 2
+
+struct expected {
+	int kind;
+	unsigned long sector;                   // LBA, or the sector's place in a CHS command
+	unsigned short crc;                     // for echoes
+	int last;                               // of the command
+};
+
+#define DECODE_IDLE 0
+#define DECODE_HEADER 1
+#define DECODE_SECTOR 2
+#define DECODE_ACK 3
+
+//
+// Splits the bytes of one port into frames
+//
+struct decoder {
+	const char *name;
+	int print;
+
+	int state;
+	union processBuffer frame;              // from the client
+	unsigned long have, want;
+	unsigned long long lastReceived;
+
+	int command, drive, chs;
+	unsigned long lba, count, done;
+	unsigned long long commandStart;
+
+	struct expected expect[ DECODE_EXPECT ];
+	int expectHead, expectCount;
+	union processBuffer response;           // from the server
+	unsigned long responseHave;
+
+	struct traceStats stats;
+};
+
+//====================================================================================================
+//
+// Reading the trace
+//
+
+void loadTrace( const char *name, struct trace *tr )
+{
+	struct traceFileHeader *header;
+	struct traceRecord r;
+	unsigned char *data, *p, *end;
+	struct stat st;
+	int fd;
+
+	if( (fd = open( name, O_RDONLY )) < 0 || fstat( fd, &st ) )
+		log( -1, "Could not Open \"%s\"", name );
+
+	if( !(data = (unsigned char *) malloc( st.st_size + 1 )) ||
+		!(tr->events = (struct event *) malloc( (st.st_size / sizeof(r) + 1) * sizeof(struct event) )) )
+		log( -1, "'%s', out of memory", name );
+
+	if( read( fd, data, st.st_size ) != st.st_size )
+		log( -1, "'%s', could not read the trace (error %i)", name, errno );
+	close( fd );
+
+	header = (struct traceFileHeader *) data;
+	if( (unsigned long) st.st_size < sizeof(*header) || memcmp( header->magic, TRACE_MAGIC, sizeof(header->magic) ) )
+		log( -1, "'%s' is not a SerDrive trace", name );
+
+	tr->started = header->started;
+	tr->count = 0;
+	tr->ports = 0;
+
+	p = data + sizeof(*header);
+	end = data + st.st_size;
+
+	while( p < end )
+	{
+		//
+		// A server that was killed can leave the last record short
+		//
+		if( (unsigned long) (end - p) >= sizeof(r) )
+			memcpy( &r, p, sizeof(r) );
+		if( (unsigned long) (end - p) < sizeof(r) || (unsigned long) (end - p) - sizeof(r) < r.length )
+		{
+			fprintf( stderr, "'%s', the last record is incomplete\n", name );
+			break;
+		}
+
+		if( r.port >= TRACE_MAXPORTS )
+			log( -1, "'%s', bad port number %u, is the trace damaged?", name, r.port );
+
+		tr->events[ tr->count ].time = r.time;
+		tr->events[ tr->count ].port = r.port;
+		tr->events[ tr->count ].type = r.type;
+		tr->events[ tr->count ].length = r.length;
+		tr->events[ tr->count ].data = p + sizeof(r);
+		tr->count++;
+
+		//
+		// Ports are numbered in the order they first connect
+		//
+		if( r.type == TRACE_CONNECT && r.port >= tr->ports )
+		{
+			char *portName = (char *) malloc( r.length + 1 );
+
+			memcpy( portName, p + sizeof(r), r.length );
+			portName[ r.length ] = 0;
+
+			while( tr->ports <= r.port )
+				tr->names[ tr->ports++ ] = portName;
+		}
+
+		p += sizeof(r) + r.length;
+	}
+}
+
+//====================================================================================================
+//
+// Decoding
+//
+
+void decoderInit( struct decoder *d, const char *name, int print )
+{
+	memset( d, 0, sizeof(*d) );
+	d->name = name;
+	d->print = print;
+	d->stats.first = ~0ULL;
+}
+
+void say( struct decoder *d, unsigned long long time, const char *direction, const char *message, ... )
+{
+	va_list args;
+
+	if( !d->print )
+		return;
+
+	va_start( args, message );
+	printf( "%12.6f %-16s %s ", time / 1e6, d->name, direction );
+	vprintf( message, args );
+	printf( "\n" );
+	va_end( args );
+}
+
+//
+// Forgets the command in progress, and anything the server still owed for it
+//
+void abandon( struct decoder *d, unsigned long long time )
+{
+	if( d->expectCount )
+	{
+		say( d, time, "!!", "%d frames never answered", d->expectCount );
+		d->stats.unanswered += d->expectCount;
+	}
+
+	d->expectCount = 0;
+	d->responseHave = 0;
+	d->state = DECODE_IDLE;
+}
+
+void expect( struct decoder *d, int kind, unsigned long sector, unsigned short crc, int last )
+{
+	struct expected *e;
+
+	if( d->expectCount == DECODE_EXPECT )
+	{
+		d->expectHead = (d->expectHead + 1) & (DECODE_EXPECT-1);
+		d->expectCount--;
+		d->stats.unanswered++;
+	}
+
+	e = &d->expect[ (d->expectHead + d->expectCount++) & (DECODE_EXPECT-1) ];
+	e->kind = kind;
+	e->sector = sector;
+	e->crc = crc;
+	e->last = last;
+}
+
+const char *sectorName( struct decoder *d, unsigned long sector )
+{
+	static char buff[40];
+
+	sprintf( buff, d->chs ? "Sector %lu of %lu" : "Sector LBA=%lu", sector, d->count );
+
+	return( buff );
+}
+
+//
+// A whole frame from the client is in d->frame
+//
+void clientFrame( struct decoder *d, unsigned long long time )
+{
+	unsigned short crc;
+	unsigned char *b = &d->frame.b[0];
+
+	switch( d->state )
+	{
+	case DECODE_HEADER:
+		abandon( d, time );
+
+		if( (crc = checksum( &d->frame.w[0], 3 )) != d->frame.w[3] )
+		{
+			say( d, time, "->", "Bad Command Checksum: %02x %02x %02x %02x %02x %02x %02x %02x, Checksum=%04x",
+				 b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7], crc );
+			d->stats.badHeaders++;
+			return;
+		}
+
+		d->command = b[0] & SERIAL_COMMAND_RWMASK;
+		d->drive = (b[1] & ATA_DriveAndHead_Drive) ? 1 : 0;
+		d->count = b[2];
+		d->done = 0;
+		d->chs = d->command != SERIAL_COMMAND_INQUIRE && !(b[1] & ATA_COMMAND_LBA);
+
+		if( d->command == SERIAL_COMMAND_INQUIRE )
+		{
+			say( d, time, "->", "Inquire %d: Client Port=0x%x, Client Baud=%s", d->drive,
+				 ((unsigned short) d->frame.inquire.port) << 2, baudRateMatchDivisor( d->frame.inquire.baud )->display );
+			expect( d, EXPECT_INQUIRE, 0, 0, 1 );
+			return;
+		}
+
+		if( d->command != SERIAL_COMMAND_READ && d->command != SERIAL_COMMAND_WRITE )
+		{
+			say( d, time, "->", "Unknown command %02x", b[0] );
+			return;
+		}
+
+		if( d->chs )
+		{
+			say( d, time, "->", "%s %d: Cylinder=%u, Sector=%u, Head=%u, Count=%lu", d->command == SERIAL_COMMAND_WRITE ? "Write" : "Read",
+				 d->drive, d->frame.chs.cylinder, d->frame.chs.sector, d->frame.chs.driveAndHead & ATA_COMMAND_HEADMASK, d->count );
+			d->lba = 1;
+		}
+		else
+		{
+			d->lba = (((unsigned long) b[1] & ATA_COMMAND_HEADMASK) << 24) | ((unsigned long) b[5] << 16) |
+				((unsigned long) b[4] << 8) | b[3];
+			say( d, time, "->", "%s %d: LBA=%lu, Count=%lu", d->command == SERIAL_COMMAND_WRITE ? "Write" : "Read",
+				 d->drive, d->lba, d->count );
+		}
+
+		if( !d->count )
+			return;
+
+		if( d->command == SERIAL_COMMAND_WRITE )
+		{
+			d->state = DECODE_SECTOR;
+			d->want = 514;
+		}
+		else
+		{
+			expect( d, EXPECT_SECTOR, d->lba, 0, d->count == 1 );
+			d->done = 1;
+			d->state = d->count > 1 ? DECODE_ACK : DECODE_IDLE;
+			d->want = 1;
+		}
+		return;
+
+	case DECODE_SECTOR:
+		crc = checksum( &d->frame.w[0], 256 );
+		if( crc != d->frame.w[256] )
+		{
+			say( d, time, "->", "%s, Checksum=%04x, bad (should be %04x)", sectorName( d, d->lba + d->done ), d->frame.w[256], crc );
+			d->stats.badSectors++;
+			d->state = DECODE_IDLE;
+			return;
+		}
+
+		say( d, time, "->", "%s, Checksum=%04x", sectorName( d, d->lba + d->done ), crc );
+		d->done++;
+		expect( d, EXPECT_ECHO, d->lba + d->done - 1, crc, d->done == d->count );
+		d->state = d->done < d->count ? DECODE_ACK : DECODE_IDLE;
+		d->want = 1;
+		return;
+
+	case DECODE_ACK:
+		if( b[0] != d->count - d->done )
+		{
+			say( d, time, "->", "Continue Fault: Received=%d, Expected=%lu", b[0], d->count - d->done );
+			d->stats.continueFaults++;
+			d->state = DECODE_IDLE;
+			return;
+		}
+
+		say( d, time, "->", "Continuation %d", b[0] );
+
+		if( d->command == SERIAL_COMMAND_WRITE )
+		{
+			d->state = DECODE_SECTOR;
+			d->want = 514;
+		}
+		else
+		{
+			expect( d, EXPECT_SECTOR, d->lba + d->done, 0, d->done + 1 == d->count );
+			d->done++;
+			d->state = d->done < d->count ? DECODE_ACK : DECODE_IDLE;
+			d->want = 1;
+		}
+		return;
+	}
+}
+
+//
+// Bytes from the client, split into frames the way library/Process.cpp does
+//
+void clientBytes( struct decoder *d, unsigned long long time, unsigned char *data, unsigned long len )
+{
+	unsigned long n;
+
+	if( d->state != DECODE_IDLE && time - d->lastReceived > SERVER_TIMEOUT )
+	{
+		say( d, time, "!!", "Timeout, the server abandons the command" );
+		d->stats.timeouts++;
+		d->state = DECODE_IDLE;
+	}
+	d->lastReceived = time;
+
+	while( len )
+	{
+		if( d->state == DECODE_IDLE )
+		{
+			for( n = 0; n < len && (data[n] & SERIAL_COMMAND_HEADERMASK) != SERIAL_COMMAND_HEADER; n++ ) ;
+
+			if( n )
+			{
+				say( d, time, "->", "%lu spurious bytes", n );
+				d->stats.spurious += n;
+			}
+
+			data += n;
+			len -= n;
+			if( !len )
+				break;
+
+			d->state = DECODE_HEADER;
+			d->want = 8;
+			d->have = 0;
+			d->commandStart = time;
+		}
+
+		n = d->want - d->have;
+		if( n > len )
+			n = len;
+
+		memcpy( &d->frame.b[ d->have ], data, n );
+		d->have += n;
+		data += n;
+		len -= n;
+
+		if( d->have == d->want )
+		{
+			d->have = 0;
+			clientFrame( d, time );
+		}
+	}
+}
+
+//
+// Bytes from the server, matched up with the frames the client is owed
+//
+void serverBytes( struct decoder *d, unsigned long long time, unsigned char *data, unsigned long len )
+{
+	struct expected *e;
+	unsigned long n, size;
+	unsigned short crc;
+	int c;
+
+	while( len )
+	{
+		if( !d->expectCount )
+		{
+			say( d, time, "<-", "%lu unexpected bytes", len );
+			d->stats.unexpected += len;
+			return;
+		}
+
+		e = &d->expect[ d->expectHead ];
+		size = e->kind == EXPECT_ECHO ? 2 : 514;
+
+		n = size - d->responseHave;
+		if( n > len )
+			n = len;
+
+		memcpy( &d->response.b[ d->responseHave ], data, n );
+		d->responseHave += n;
+		data += n;
+		len -= n;
+
+		if( d->responseHave < size )
+			break;
+
+		d->responseHave = 0;
+		d->expectHead = (d->expectHead + 1) & (DECODE_EXPECT-1);
+		d->expectCount--;
+
+		crc = checksum( &d->response.w[0], 256 );
+
+		switch( e->kind )
+		{
+		case EXPECT_INQUIRE:
+			say( d, time, "<-", "Inquire response, Checksum=%04x%s", d->response.w[256], crc == d->response.w[256] ? "" : ", bad" );
+			break;
+		case EXPECT_SECTOR:
+			say( d, time, "<-", "%s, Checksum=%04x%s", sectorName( d, e->sector ), d->response.w[256], crc == d->response.w[256] ? "" : ", bad" );
+			break;
+		case EXPECT_ECHO:
+			say( d, time, "<-", "Echo %04x%s", d->response.w[0], d->response.w[0] == e->crc ? "" : ", wrong" );
+			break;
+		}
+
+		if( e->last )
+		{
+			c = e->kind == EXPECT_INQUIRE ? STATS_INQUIRE : e->kind == EXPECT_ECHO ? STATS_WRITE : STATS_READ;
+			histogramAdd( &d->stats.latency[c], time - d->commandStart );
+			d->stats.sectors[c] += c == STATS_INQUIRE ? 0 : d->count;
+		}
+	}
+}
+
+void decode( struct decoder *d, struct event *ev )
+{
+	if( ev->time < d->stats.first )
+		d->stats.first = ev->time;
+	d->stats.last = ev->time;
+
+	switch( ev->type )
+	{
+	case TRACE_CONNECT:
+		abandon( d, ev->time );
+		say( d, ev->time, "==", "Connected" );
+		d->stats.connects++;
+		break;
+	case TRACE_DROPPED:
+		abandon( d, ev->time );
+		say( d, ev->time, "!!", "%u records lost from the trace", *(unsigned int *) ev->data );
+		d->stats.dropped += *(unsigned int *) ev->data;
+		break;
+	case TRACE_RECEIVED:
+		d->stats.received += ev->length;
+		clientBytes( d, ev->time, ev->data, ev->length );
+		break;
+	case TRACE_SENT:
+		d->stats.sent += ev->length;
+		serverBytes( d, ev->time, ev->data, ev->length );
+		break;
+	}
+}
+
+//====================================================================================================
+//
+// Statistics
+//
+
+const char *commandNames[ STATS_COMMANDS ] = { "inquire", "read", "write" };
+
+void report( const char *name, struct traceStats *s )
+{
+	unsigned long sectors = s->sectors[ STATS_READ ] + s->sectors[ STATS_WRITE ];
+	double seconds = s->last > s->first ? (s->last - s->first) / 1e6 : 0.0;
+	struct histogram *h;
+
+	printf( "%s: %lu sectors in %.3f s, %.0f sectors/s, %llu bytes received, %llu sent, %lu connections\n", name, sectors, seconds,
+			seconds ? sectors / seconds : 0.0, s->received, s->sent, s->connects );
+	printf( "    %-8s %8s %8s %10s %10s %10s %10s %10s\n", "", "commands", "sectors", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us" );
+	for( int c = 0; c < STATS_COMMANDS; c++ )
+	{
+		h = &s->latency[c];
+		printf( "    %-8s %8lu %8lu %10llu %10llu %10llu %10llu %10llu\n", commandNames[c], h->count, s->sectors[c],
+				histogramPercentile( h, 50 ), histogramPercentile( h, 90 ), histogramPercentile( h, 99 ),
+				histogramPercentile( h, 99.9 ), h->max );
+	}
+	printf( "    errors: command checksum %lu, sector checksum %lu, continue %lu, timeouts %lu, spurious %lu, unexpected %lu, unanswered %lu",
+			s->badHeaders, s->badSectors, s->continueFaults, s->timeouts, s->spurious, s->unexpected, s->unanswered );
+	if( s->dropped )
+		printf( ", %lu records lost", s->dropped );
+	printf( "\n" );
+}
+
+//====================================================================================================
+//
+// Replay
+//
+
+struct replay {
+	struct trace *tr;
+	int port;
+	const char *target;
+	int fd;
+
+	struct event *events;                   // as they happened this time
+	unsigned long count;
+
+	unsigned long differences;              // answers that weren't the same as recorded
+	unsigned long missing;                  // bytes of them that never came
+
+	pthread_t thread;
+};
+
+int keepTiming = 0;
+struct baudRate *baudRate;
+unsigned long timeout = 2000;
+
+int sendAll( struct replay *r, unsigned char *data, unsigned long len )
+{
+	ssize_t n;
+
+	while( len )
+	{
+		if( (n = write( r->fd, data, len )) < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			return( 0 );
+		}
+		data += n;
+		len -= n;
+	}
+
+	return( 1 );
+}
+
+//
+// Returns how much of 'len' came in time
+//
+unsigned long receiveAll( struct replay *r, unsigned char *data, unsigned long len )
+{
+	unsigned long long deadline = GetTime_Microseconds() + timeout * 1000ULL, now;
+	unsigned long have = 0;
+	struct pollfd p;
+	ssize_t n;
+
+	p.fd = r->fd;
+	p.events = POLLIN;
+
+	while( have < len )
+	{
+		if( (now = GetTime_Microseconds()) >= deadline || !poll( &p, 1, (int) ((deadline - now + 999) / 1000) ) )
+			break;
+
+		if( (n = read( r->fd, data + have, len - have )) <= 0 )
+		{
+			if( n < 0 && (errno == EINTR || errno == EAGAIN) )
+				continue;
+			break;
+		}
+		have += n;
+	}
+
+	return( have );
+}
+
+void *replayThread( void *arg )
+{
+	struct replay *r = (struct replay *) arg;
+	struct trace *tr = r->tr;
+	struct event *ev, *out;
+	unsigned long long start = 0, first = 0, now;
+	unsigned long have;
+	int warned = 0;
+
+	r->fd = -1;
+
+	for( unsigned long t = 0; t < tr->count; t++ )
+	{
+		ev = &tr->events[t];
+		if( ev->port != r->port )
+			continue;
+
+		if( !start )
+		{
+			start = GetTime_Microseconds();
+			first = ev->time;
+		}
+
+		if( keepTiming && ev->type == TRACE_RECEIVED && (now = GetTime_Microseconds() - start) < ev->time - first )
+			usleep( (useconds_t) (ev->time - first - now) );
+
+		out = &r->events[ r->count++ ];
+		*out = *ev;
+
+		switch( ev->type )
+		{
+		case TRACE_CONNECT:
+			if( r->fd >= 0 )
+				close( r->fd );
+			r->fd = connectPort( r->target, baudRate );
+			break;
+
+		case TRACE_DROPPED:
+			if( !warned++ )
+				log( 0, "'%s', records were lost from the trace, the replay won't match", r->target );
+			break;
+
+		case TRACE_RECEIVED:
+			if( r->fd < 0 || !sendAll( r, ev->data, ev->length ) )
+				log( -1, "'%s', the server closed the connection", r->target );
+			break;
+
+		case TRACE_SENT:
+			if( !(out->data = (unsigned char *) malloc( ev->length )) )
+				log( -1, "'%s', out of memory", r->target );
+
+			out->length = have = receiveAll( r, out->data, ev->length );
+
+			if( have < ev->length || memcmp( out->data, ev->data, have ) )
+			{
+				r->differences++;
+				r->missing += ev->length - have;
+				log( 1, "'%s', at %.6f s the answer differs from the recording (%lu of %lu bytes came)", r->target,
+					 ev->time / 1e6, have, ev->length );
+			}
+			break;
+		}
+
+		out->time = GetTime_Microseconds() - start + first;
+	}
+
+	if( r->fd >= 0 )
+		close( r->fd );
+
+	return( NULL );
+}
+
+//====================================================================================================
+
+int main( int argc, char *argv[] )
+{
+	static struct trace tr;
+	static struct decoder decoders[ TRACE_MAXPORTS ];
+	static struct replay replays[ TRACE_MAXPORTS ];
+	static struct decoder replayed;
+	const char *traceName = NULL;
+	int statsOnly = 0, replayCount = 0, failed = 0;
+
+	baudRate = baudRateMatchString( "115200" );
+
+	for( int t = 1; t < argc; t++ )
+	{
+		char *next = (t+1 < argc ? argv[t+1] : NULL );
+
+		if( argv[t][0] == '-' )
+		{
+			char option = argv[t][1];
+
+			//
+			// All but the flags take a value
+			//
+			if( !option || !strchr( "stv", option ) )
+			{
+				if( !next )
+					usage();
+				t++;
+			}
+
+			switch( option )
+			{
+			case 's':
+				statsOnly = 1;
+				break;
+			case 'r':
+				if( replayCount == TRACE_MAXPORTS )
+					usage();
+				replays[ replayCount++ ].target = next;
+				break;
+			case 't':
+				keepTiming = 1;
+				break;
+			case 'b':
+				if( !(baudRate = baudRateMatchString( next )) || !baudRate->rate )
+					log( -2, "Unknown Baud Rate \"%s\"", next );
+				break;
+			case 'T':
+				if( !(timeout = atol( next )) )
+					usage();
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				log( -2, "Unknown Option: \"-%c\"", option );
+			}
+		}
+		else if( !traceName )
+			traceName = argv[t];
+		else
+			usage();
+	}
+
+	if( !traceName )
+		usage();
+
+	usagePrint( bannerStrings );
+
+	loadTrace( traceName, &tr );
+
+	if( replayCount > tr.ports )
+		log( -2, "'%s' only has %d ports", traceName, tr.ports );
+
+	for( int p = 0; p < tr.ports; p++ )
+		decoderInit( &decoders[p], tr.names[p], !statsOnly && !replayCount );
+
+	for( unsigned long t = 0; t < tr.count; t++ )
+		decode( &decoders[ tr.events[t].port ], &tr.events[t] );
+
+	if( !replayCount )
+	{
+		if( !statsOnly )
+			printf( "\n" );
+		for( int p = 0; p < tr.ports; p++ )
+			report( tr.names[p], &decoders[p].stats );
+		return( 0 );
+	}
+
+	for( int p = 0; p < replayCount; p++ )
+	{
+		replays[p].tr = &tr;
+		replays[p].port = p;
+		if( !(replays[p].events = (struct event *) malloc( tr.count * sizeof(struct event) )) )
+			log( -1, "Out of memory" );
+
+		if( pthread_create( &replays[p].thread, NULL, replayThread, &replays[p] ) )
+			log( -1, "Could not start a thread for '%s'", replays[p].target );
+	}
+
+	for( int p = 0; p < replayCount; p++ )
+	{
+		pthread_join( replays[p].thread, NULL );
+
+		decoderInit( &replayed, replays[p].target, 0 );
+		for( unsigned long t = 0; t < replays[p].count; t++ )
+			decode( &replayed, &replays[p].events[t] );
+
+		printf( "Recorded, " );
+		report( tr.names[p], &decoders[p].stats );
+		printf( "Replayed, " );
+		report( replays[p].target, &replayed.stats );
+
+		if( replays[p].differences )
+		{
+			printf( "    %lu answers differ from the recording, %lu bytes missing\n", replays[p].differences, replays[p].missing );
+			failed = 1;
+		}
+		else
+			printf( "    every answer matches the recording\n" );
+		printf( "\n" );
+	}
+
+	return( failed ? 2 : 0 );
+}
+
+void log( int level, const char *message, ... )
+{
+	va_list args;
+
+	va_start( args, message );
+
+	if( level < 0 )
+	{
+		fprintf( stderr, "ERROR: " );
+		vfprintf( stderr, message, args );
+		fprintf( stderr, "\n" );
+		if( level < -1 )
+		{
+			fprintf( stderr, "\n" );
+			usage();
+		}
+		exit( 1 );
+	}
+	else if( verbose >= level )
+	{
+		vfprintf( stderr, message, args );
+		fprintf( stderr, "\n" );
+	}
+
+	va_end( args );
+}
+
+unsigned long long GetTime_Microseconds(void)
+{
+	struct timespec now;
+
+	if( clock_gettime( CLOCK_MONOTONIC, &now ) )
+		return( 0 );
+	return( now.tv_sec * 1000000ULL + now.tv_nsec / 1000 );
+}
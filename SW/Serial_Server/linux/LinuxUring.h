@@ -0,0 +1,458 @@
+//======================================================================
+//
+// Project:     XTIDE Universal BIOS, Serial Port Server
+//
+// File:        LinuxUring.h - io_uring submission queue shared by all open files
+//
+
+//
+// XTIDE Universal BIOS and Associated Tools
+// Copyright (C) 2009-2010 by Tomi Tilli, 2011-2013 by XTIDE Universal BIOS Team.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// Visit http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+//
+
+//
+// One io_uring instance serves every FileAccess in the process.  Files are registered in its fixed
+// file table when opened, and long lived I/O buffers (such as the read-ahead ring of each serial
+// port) can be registered, so that reads into them are done with IORING_OP_READ_FIXED.
+//
+// Requests are used synchronously: a batch of reads or writes is queued, submitted with a single
+// io_uring_enter, and all of the completions are waited for.  This keeps the callers as simple as
+// with pread/pwrite, while a read-ahead window of many sectors still costs just one system call.
+//
+// Several threads (the image workers) use the queue at once.  The lock is only held to queue,
+// submit and take completions, not while the transfers are in progress: one thread at a time
+// waits in io_uring_enter for completions, without the lock, and hands out whatever arrives to
+// the threads it belongs to.  So a slow image doesn't hold up the transfers of the others.
+//
+// The system calls are made directly, so liburing is not needed.  If the kernel doesn't support
+// io_uring (or it has been disabled), UringQueue::get returns NULL and FileAccess uses pread/pwrite.
+//
+
+#ifndef LINUXURING_H_INCLUDED
+#define LINUXURING_H_INCLUDED
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "../library/Library.h"
+
+#define URING_ENTRIES 64
+#define URING_FILES 64
+#define URING_BUFFERS 64
+
+//
+// The requests of one transfer, which the user_data of their completions points to
+//
+struct uringWait {
+	unsigned remaining;
+	unsigned long len;                      // of each request
+};
+
+class UringQueue
+{
+private:
+	int ring;
+
+	unsigned char *sqRing, *cqRing;
+	size_t sqRingSize, cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+
+	int files[ URING_FILES ];
+	struct iovec buffers[ URING_BUFFERS ];
+	int bufferCount;
+	int fixedBuffers;
+
+	unsigned queued;
+
+	pthread_mutex_t lock;
+	pthread_cond_t completed;               // completions have been handed out
+	int reaping;                            // a thread is waiting in io_uring_enter for completions
+
+	static int setup( unsigned entries, struct io_uring_params *p )
+	{
+		return( syscall( __NR_io_uring_setup, entries, p ) );
+	}
+
+	static int enter( int fd, unsigned toSubmit, unsigned minComplete, unsigned flags )
+	{
+		return( syscall( __NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0 ) );
+	}
+
+	static int registerOp( int fd, unsigned opcode, void *arg, unsigned count )
+	{
+		return( syscall( __NR_io_uring_register, fd, opcode, arg, count ) );
+	}
+
+	int open( void )
+	{
+		struct io_uring_params p;
+
+		memset( &p, 0, sizeof(p) );
+
+		if( (ring = setup( URING_ENTRIES, &p )) < 0 )
+		{
+			log( 1, "io_uring not available (error %i), using pread/pwrite", errno );
+			return( 0 );
+		}
+
+		//
+		// IORING_OP_READ and IORING_OP_WRITE arrived along with this feature flag
+		//
+		if( !(p.features & IORING_FEAT_RW_CUR_POS) )
+		{
+			log( 1, "io_uring too old on this kernel, using pread/pwrite" );
+			close( ring );
+			return( 0 );
+		}
+
+		sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+		if( p.features & IORING_FEAT_SINGLE_MMAP )
+		{
+			if( cqRingSize > sqRingSize )
+				sqRingSize = cqRingSize;
+			cqRingSize = sqRingSize;
+		}
+
+		sqRing = (unsigned char *) mmap( NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING );
+		if( p.features & IORING_FEAT_SINGLE_MMAP )
+			cqRing = sqRing;
+		else
+			cqRing = (unsigned char *) mmap( NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING );
+		sqes = (struct io_uring_sqe *) mmap( NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES );
+
+		if( sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == (struct io_uring_sqe *) MAP_FAILED )
+		{
+			log( 1, "Could not map io_uring queues (error %i), using pread/pwrite", errno );
+			close( ring );
+			return( 0 );
+		}
+
+		sqHead = (unsigned *) (sqRing + p.sq_off.head);
+		sqTail = (unsigned *) (sqRing + p.sq_off.tail);
+		sqMask = (unsigned *) (sqRing + p.sq_off.ring_mask);
+		sqArray = (unsigned *) (sqRing + p.sq_off.array);
+		cqHead = (unsigned *) (cqRing + p.cq_off.head);
+		cqTail = (unsigned *) (cqRing + p.cq_off.tail);
+		cqMask = (unsigned *) (cqRing + p.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe *) (cqRing + p.cq_off.cqes);
+
+		//
+		// A sparse fixed file table, filled in as files are opened
+		//
+		for( int t = 0; t < URING_FILES; t++ )
+			files[t] = -1;
+		if( registerOp( ring, IORING_REGISTER_FILES, files, URING_FILES ) )
+			log( 1, "io_uring fixed files not available (error %i)", errno );
+
+		log( 1, "Using io_uring for disk image access" );
+
+		return( 1 );
+	}
+
+	struct io_uring_sqe *nextSqe( void )
+	{
+		unsigned tail, index;
+
+		if( queued == URING_ENTRIES )
+			submit();
+
+		tail = *sqTail;
+		index = tail & *sqMask;
+
+		memset( &sqes[index], 0, sizeof(struct io_uring_sqe) );
+		sqArray[index] = index;
+		__atomic_store_n( sqTail, tail + 1, __ATOMIC_RELEASE );
+		queued++;
+
+		return( &sqes[index] );
+	}
+
+	//
+	// Hands everything queued to the kernel, without waiting for it
+	//
+	void submit( void )
+	{
+		int n;
+
+		while( queued )
+		{
+			if( (n = enter( ring, queued, 0, 0 )) < 0 )
+			{
+				if( errno != EINTR )
+					log( -1, "io_uring_enter failed (error %i)", errno );
+				continue;
+			}
+
+			queued -= n;
+		}
+	}
+
+	//
+	// Takes the completions that have arrived, whichever threads they belong to, checking them
+	// for errors and short transfers.  Only called while no thread is waiting for completions
+	// in the kernel, which would otherwise miss them.
+	//
+	void reap( void )
+	{
+		unsigned head = *cqHead, tail = __atomic_load_n( cqTail, __ATOMIC_ACQUIRE );
+
+		if( head == tail )
+			return;
+
+		for( ; head != tail; head++ )
+		{
+			struct io_uring_cqe *cqe = &cqes[ head & *cqMask ];
+			struct uringWait *w = (struct uringWait *) cqe->user_data;
+
+			if( cqe->res < 0 || (unsigned long) cqe->res != w->len )
+				log( -1, "io_uring transfer failed (result %i, expected %lu)", cqe->res, w->len );
+			w->remaining--;
+		}
+
+		__atomic_store_n( cqHead, head, __ATOMIC_RELEASE );
+		pthread_cond_broadcast( &completed );
+	}
+
+	//
+	// Submits what is queued, and waits for the requests of 'w' to complete, with the lock held
+	// except while waiting
+	//
+	void wait( struct uringWait *w )
+	{
+		submit();
+
+		for( ;; )
+		{
+			if( !reaping )
+				reap();
+
+			if( !w->remaining )
+				break;
+
+			if( reaping )
+			{
+				pthread_cond_wait( &completed, &lock );
+				continue;
+			}
+
+			reaping = 1;
+			pthread_mutex_unlock( &lock );
+
+			if( enter( ring, 0, 1, IORING_ENTER_GETEVENTS ) < 0 && errno != EINTR )
+				log( -1, "io_uring_enter failed (error %i)", errno );
+
+			pthread_mutex_lock( &lock );
+			reaping = 0;
+			pthread_cond_broadcast( &completed );
+		}
+	}
+
+	//
+	// Returns the index of the registered buffer holding [buff, buff+len), or -1 if there is none
+	//
+	int findBuffer( void *buff, unsigned long len )
+	{
+		if( !fixedBuffers )
+			return( -1 );
+
+		for( int t = 0; t < bufferCount; t++ )
+			if( (char *) buff >= (char *) buffers[t].iov_base &&
+				(char *) buff + len <= (char *) buffers[t].iov_base + buffers[t].iov_len )
+				return( t );
+
+		return( -1 );
+	}
+
+	void queue( struct uringWait *w, int write, int file, void *buff, unsigned long len, unsigned long long offset )
+	{
+		struct io_uring_sqe *sqe = nextSqe();
+		int slot = fileSlot( file );
+		int fixed = findBuffer( buff, len );
+
+		if( fixed >= 0 )
+		{
+			sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe->buf_index = fixed;
+		}
+		else
+			sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+		if( slot >= 0 )
+		{
+			sqe->fd = slot;
+			sqe->flags = IOSQE_FIXED_FILE;
+		}
+		else
+			sqe->fd = file;
+
+		sqe->addr = (unsigned long) buff;
+		sqe->len = len;
+		sqe->off = offset;
+		sqe->user_data = (unsigned long) w;
+		w->remaining++;
+	}
+
+	int fileSlot( int file )
+	{
+		for( int t = 0; t < URING_FILES; t++ )
+			if( files[t] == file )
+				return( t );
+
+		return( -1 );
+	}
+
+	void updateFile( int slot, int file )
+	{
+		struct io_uring_files_update update;
+
+		memset( &update, 0, sizeof(update) );
+		update.offset = slot;
+		update.fds = (unsigned long) &file;
+
+		if( registerOp( ring, IORING_REGISTER_FILES_UPDATE, &update, 1 ) == 1 )
+			files[slot] = file;
+	}
+
+public:
+	UringQueue()
+	{
+		ring = -1;
+		bufferCount = 0;
+		fixedBuffers = 0;
+		queued = 0;
+		reaping = 0;
+		pthread_mutex_init( &lock, NULL );
+		pthread_cond_init( &completed, NULL );
+	}
+
+	//
+	// The shared instance, or NULL if io_uring can't be used
+	//
+	static UringQueue *get( void )
+	{
+		static UringQueue *queue = NULL;
+		static int tried = 0;
+
+		if( !tried )
+		{
+			tried = 1;
+			queue = new UringQueue();
+			if( !queue->open() )
+			{
+				delete queue;
+				queue = NULL;
+			}
+		}
+
+		return( queue );
+	}
+
+	void addFile( int file )
+	{
+		pthread_mutex_lock( &lock );
+		for( int t = 0; t < URING_FILES; t++ )
+			if( files[t] < 0 )
+			{
+				updateFile( t, file );
+				break;
+			}
+		pthread_mutex_unlock( &lock );
+	}
+
+	void removeFile( int file )
+	{
+		int slot;
+
+		pthread_mutex_lock( &lock );
+		if( (slot = fileSlot( file )) >= 0 )
+		{
+			updateFile( slot, -1 );
+			files[slot] = -1;
+		}
+		pthread_mutex_unlock( &lock );
+	}
+
+	//
+	// The whole table is registered again, which is fine as buffers are only added at startup.  If
+	// registration fails (for example, RLIMIT_MEMLOCK is too low), plain reads and writes are used.
+	//
+	void addBuffer( void *buff, unsigned long len )
+	{
+		int t;
+
+		pthread_mutex_lock( &lock );
+
+		//
+		// A serial port that reconnects usually brings the same buffer again
+		//
+		for( t = 0; t < bufferCount; t++ )
+			if( buffers[t].iov_base == buff && buffers[t].iov_len == len )
+				break;
+
+		if( t == bufferCount && bufferCount < URING_BUFFERS )
+		{
+			buffers[ bufferCount ].iov_base = buff;
+			buffers[ bufferCount++ ].iov_len = len;
+
+			if( fixedBuffers )
+				registerOp( ring, IORING_UNREGISTER_BUFFERS, NULL, 0 );
+			if( !(fixedBuffers = !registerOp( ring, IORING_REGISTER_BUFFERS, buffers, bufferCount )) )
+				log( 1, "io_uring buffer registration failed (error %i)", errno );
+		}
+
+		pthread_mutex_unlock( &lock );
+	}
+
+	//
+	// Reads or writes 'len' bytes at 'offset'
+	//
+	void transfer( int write, int file, void *buff, unsigned long len, unsigned long long offset )
+	{
+		struct uringWait w = { 0, len };
+
+		pthread_mutex_lock( &lock );
+		queue( &w, write, file, buff, len, offset );
+		wait( &w );
+		pthread_mutex_unlock( &lock );
+	}
+
+	//
+	// Reads 'count' blocks of 'len' bytes starting at 'offset' into separate buffers, all in one submission
+	//
+	void readVector( int file, void *buffs[], int count, unsigned long len, unsigned long long offset )
+	{
+		struct uringWait w = { 0, len };
+
+		pthread_mutex_lock( &lock );
+		for( int t = 0; t < count; t++ )
+			queue( &w, 0, file, buffs[t], len, offset + (unsigned long long) t * len );
+		wait( &w );
+		pthread_mutex_unlock( &lock );
+	}
+};
+
+#endif
@@ -128,7 +128,7 @@ int main(int argc, char* argv[])
 	Image *img;
 	struct baudRate *baudRate = NULL;
 
-	int timeoutEnabled = 1;
+	struct processTimeouts timeouts = processTimeoutsDefault;
 
 	char *ComPort = NULL, ComPortBuff[20];
 
@@ -232,7 +232,7 @@ int main(int argc, char* argv[])
 				}
 				break;
 			case 't': case 'T':
-				timeoutEnabled = 0;
+				memset( &timeouts, 0, sizeof(timeouts) );
 				break;
 			case 'b': case 'B':
 				if( !next )
@@ -271,7 +271,7 @@ int main(int argc, char* argv[])
 	{
 		serial.Connect( ComPort, baudRate );
 
-		processRequests( &serial, images[0], images[1], timeoutEnabled, verbose );
+		processRequests( &serial, images[0], images[1], &timeouts, verbose );
 
 		serial.Disconnect();
 
@@ -313,7 +313,13 @@ unsigned long GetTime(void)
 	return( GetTickCount() );
 }
 
-unsigned long GetTime_Timeout(void)
+unsigned long long GetTime_Microseconds(void)
 {
-	return( 1000 );
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER now;
+
+	if( !frequency.QuadPart && !QueryPerformanceFrequency( &frequency ) )
+		return( 0 );
+	QueryPerformanceCounter( &now );
+	return( (unsigned long long) now.QuadPart * 1000000 / frequency.QuadPart );
 }
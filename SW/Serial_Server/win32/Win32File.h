@@ -28,6 +28,7 @@
 
 #include <windows.h>
 #include <stdio.h>
+#include <string.h>
 #include "../library/library.h"
 
 class FileAccess
@@ -53,9 +54,12 @@ public:
 		return( 1 );
 	}
 
-	void Open( char *p_name )
+	void Open( char *p_name, int readOnly = 0 )
 	{
-		fp = CreateFileA( p_name, GENERIC_READ|GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+		if( readOnly )
+			fp = CreateFileA( p_name, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+		else
+			fp = CreateFileA( p_name, GENERIC_READ|GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
 
 		if( fp == INVALID_HANDLE_VALUE )
 			log( -1, "'%s', could not open file", p_name );
@@ -91,6 +95,20 @@ public:
 		return( (unsigned long) i );
 	}
 
+	//
+	// Sets the file length without writing any data, the new space reads back as zeros
+	//
+	void SetSizeSectors( unsigned long sectors )
+	{
+		LARGE_INTEGER dist;
+
+		dist.HighPart = sectors >> 23;
+		dist.LowPart = sectors << 9;
+
+		if( !SetFilePointerEx( fp, dist, NULL, FILE_BEGIN ) || !SetEndOfFile( fp ) )
+			log( -1, "'%s', could not set file size to %lu sectors", name, sectors );
+	}
+
 	void SeekSectors( unsigned long lba )
 	{
 		LARGE_INTEGER dist;
@@ -118,6 +136,52 @@ public:
 			log( -1, "'%s', WriteFile failed", name );
 	}
 
+	//
+	// Positional access, the offset given in an OVERLAPPED leaves the file pointer alone so concurrent
+	// callers don't need to share it
+	//
+	void ReadAt( void *buff, unsigned long lba, unsigned long sectors )
+	{
+		OVERLAPPED at;
+		unsigned long out_len;
+
+		memset( &at, 0, sizeof(at) );
+		at.OffsetHigh = lba >> 23;
+		at.Offset = lba << 9;
+
+		if( !ReadFile( fp, buff, sectors * 512, &out_len, &at ) || sectors * 512 != out_len )
+			log( -1, "'%s', ReadFile failed at lba=%lu", name, lba );
+	}
+
+	void WriteAt( void *buff, unsigned long lba, unsigned long sectors )
+	{
+		OVERLAPPED at;
+		unsigned long out_len;
+
+		memset( &at, 0, sizeof(at) );
+		at.OffsetHigh = lba >> 23;
+		at.Offset = lba << 9;
+
+		if( !WriteFile( fp, buff, sectors * 512, &out_len, &at ) || sectors * 512 != out_len )
+			log( -1, "'%s', WriteFile failed at lba=%lu", name, lba );
+	}
+
+	void ReadVectorAt( void *buffs[], unsigned long lba, int count )
+	{
+		for( int t = 0; t < count; t++ )
+			ReadAt( buffs[t], lba + t, 1 );
+	}
+
+	static void RegisterBuffer( void *buff, unsigned long len )
+	{
+	}
+
+	void Flush()
+	{
+		if( !FlushFileBuffers( fp ) )
+			log( 0, "'%s', FlushFileBuffers failed", name );
+	}
+
 	FileAccess()
 	{
 		fp = NULL;
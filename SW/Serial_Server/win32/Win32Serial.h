@@ -83,6 +83,14 @@ public:
 				FillMemory(&dcb, sizeof(dcb), 0);
 				FillMemory(&timeouts, sizeof(timeouts), 0);
 
+				//
+				// Return from ReadFile as soon as any characters have arrived, rather than waiting
+				// for the whole receive buffer to be filled
+				//
+				timeouts.ReadIntervalTimeout = MAXDWORD;
+				timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+				timeouts.ReadTotalTimeoutConstant = MAXDWORD - 1;
+
 				dcb.DCBlength = sizeof(dcb);
 				dcb.BaudRate = baudRate->rate;
 				dcb.ByteSize = 8;
@@ -147,11 +155,54 @@ public:
 		}
 	}
 
+	//
+	// Waits until there are characters to read, or until the time 'until' (see
+	// GetTime_Microseconds), returning 0 if it has passed first.  A COM port is read from with a
+	// timeout for the first character, which is held for readCharacters.  Named pipes aren't
+	// timed, and always have characters to wait for.
+	//
+	int waitCharacters( unsigned long long until )
+	{
+		COMMTIMEOUTS timeouts;
+		unsigned long long now;
+		unsigned long readLen;
+		int ret;
+
+		if( speedEmulation || held )
+			return( 1 );
+
+		if( (now = GetTime_Microseconds()) >= until )
+			now = until;
+
+		FillMemory(&timeouts, sizeof(timeouts), 0);
+		timeouts.ReadIntervalTimeout = MAXDWORD;
+		timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+		timeouts.ReadTotalTimeoutConstant = (DWORD) ((until - now + 999) / 1000) + 1;
+		SetCommTimeouts( pipe, &timeouts );
+
+		ret = ReadFile( pipe, &heldCharacter, 1, &readLen, NULL );
+
+		timeouts.ReadTotalTimeoutConstant = MAXDWORD - 1;
+		SetCommTimeouts( pipe, &timeouts );
+
+		if( !ret )
+			log( -1, "read serial failed (error code %d)", GetLastError() );
+
+		return( held = readLen );
+	}
+
 	unsigned long readCharacters( void *buff, unsigned long len )
 	{
 		unsigned long readLen;
 		int ret;
 
+		if( held )
+		{
+			held = 0;
+			*(unsigned char *) buff = heldCharacter;
+			return( 1 );
+		}
+
 		ret = ReadFile( pipe, buff, len, &readLen, NULL );
 
 		if( !ret || readLen == 0 )
@@ -183,12 +234,22 @@ public:
 		return( 1 );
 	}
 
+	int writeSegments( struct sendSegment *segments, int count )
+	{
+		for( int t = 0; t < count; t++ )
+			if( !writeCharacters( segments[t].data, segments[t].len ) )
+				return( 0 );
+
+		return( 1 );
+	}
+
 	SerialAccess()
 	{
 		pipe = NULL;
 		speedEmulation = 0;
 		resetConnection = 0;
 		baudRate = NULL;
+		held = 0;
 	}
 
 	~SerialAccess()
@@ -203,5 +264,8 @@ public:
 
 private:
 	HANDLE pipe;
+
+	int held;
+	unsigned char heldCharacter;
 };
 